@@ -0,0 +1,161 @@
+/* Lama SM Bytecode interpreter: batch runs of one program on many inputs */
+
+# include <string.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <errno.h>
+# include <limits.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <time.h>
+# include <pthread.h>
+# include <stdatomic.h>
+# include <sys/stat.h>
+# include <sys/resource.h>
+
+# include "lamai.h"
+# include "batch.h"
+
+typedef struct {
+    lamai_program   *program;
+    char            *outdir;
+    char           **inputs;
+    int              n_inputs;
+    atomic_int       next;         /* The index of the next case to run */
+    atomic_int       failed;       /* The number of failed cases        */
+    pthread_mutex_t  report_lock;  /* Serializes the report lines       */
+} batch;
+
+static double now_ms (void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* <outdir>/<the name of input without its directory and last extension>.log */
+static bool log_path (char *buf, size_t size, const char *outdir, const char *input) {
+    const char *name = strrchr (input, '/');
+    const char *ext;
+    int len;
+
+    name = name == NULL ? input : name + 1;
+    ext = strrchr (name, '.');
+    len = ext == NULL || ext == name ? (int) strlen (name) : (int) (ext - name);
+
+    return snprintf (buf, size, "%s/%.*s.log", outdir, len, name) < (int) size;
+}
+
+/* Runs the program on one input in a fresh isolate of the calling thread;
+   a runtime error jumps back here and closes the isolate */
+static bool run_case (batch *b, const char *input) {
+    char path[PATH_MAX];
+    jmp_buf handler;
+    volatile bool ok = false;
+    int in, out;
+
+    if (!log_path (path, sizeof (path), b->outdir, input)) {
+        fprintf (stderr, "%s: the log path is too long\n", input);
+        return false;
+    }
+
+    if ((in = open (input, O_RDONLY)) == -1) {
+        fprintf (stderr, "%s: %s\n", input, strerror (errno));
+        return false;
+    }
+
+    if ((out = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        fprintf (stderr, "%s: %s\n", path, strerror (errno));
+        close (in);
+        return false;
+    }
+
+    set_input_fd (in);
+    set_output_fd (out);
+
+    if (setjmp (handler) == 0) {
+        set_failure_handler (&handler);
+        lamai_close (lamai_start (b->program));
+        ok = true;
+    } else if (lamai_current () != NULL) {
+        lamai_close (lamai_current ());
+    }
+
+    set_failure_handler (NULL);
+    set_output_fd (STDOUT_FILENO);
+    set_input_fd (STDIN_FILENO);
+    close (out);
+    close (in);
+
+    return ok;
+}
+
+static void* worker (void *arg) {
+    batch *b = (batch*) arg;
+    int i;
+
+    while ((i = atomic_fetch_add (&b->next, 1)) < b->n_inputs) {
+        double start = now_ms ();
+        bool ok = run_case (b, b->inputs[i]);
+        double time = now_ms () - start;
+
+        if (!ok) atomic_fetch_add (&b->failed, 1);
+
+        pthread_mutex_lock (&b->report_lock);
+        printf ("%s\t%s\t%.1f ms\n", b->inputs[i], ok ? "ok" : "failed", time);
+        fflush (stdout);
+        pthread_mutex_unlock (&b->report_lock);
+    }
+
+    return NULL;
+}
+
+int run_batch (char *fname, char *outdir, char **inputs, int n_inputs, int jobs) {
+    batch b = {.outdir = outdir, .inputs = inputs, .n_inputs = n_inputs};
+    pthread_t *threads;
+    pthread_attr_t attr;
+    struct rlimit rl;
+    double start = now_ms ();
+    int started = 0;
+
+    if (mkdir (outdir, 0777) == -1 && errno != EEXIST) {
+        fprintf (stderr, "%s: %s\n", outdir, strerror (errno));
+        return n_inputs;
+    }
+
+    if (jobs > n_inputs) jobs = n_inputs;
+    if (jobs < 1) jobs = 1;
+
+    b.program = lamai_load (fname);
+    atomic_init (&b.next, 0);
+    atomic_init (&b.failed, 0);
+    pthread_mutex_init (&b.report_lock, NULL);
+
+    /* The GC copies recursively, so the workers get the stack of the
+       main thread rather than the smaller default of threads */
+    pthread_attr_init (&attr);
+    if (getrlimit (RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        pthread_attr_setstacksize (&attr, rl.rlim_cur);
+    }
+
+    threads = (pthread_t*) malloc (jobs * sizeof (pthread_t));
+
+    for (; threads != NULL && started < jobs; started++) {
+        if (pthread_create (&threads[started], &attr, worker, &b) != 0) break;
+    }
+
+    /* Without workers the main thread runs the cases itself */
+    if (started == 0) worker (&b);
+
+    for (int i = 0; i < started; i++) pthread_join (threads[i], NULL);
+
+    fprintf (stderr, "%d cases, %d failed, %d jobs, %.1f ms\n",
+             n_inputs, atomic_load (&b.failed), started == 0 ? 1 : started, now_ms () - start);
+
+    free (threads);
+    pthread_attr_destroy (&attr);
+    pthread_mutex_destroy (&b.report_lock);
+    lamai_unload (b.program);
+
+    return atomic_load (&b.failed);
+}
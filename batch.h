@@ -0,0 +1,11 @@
+#ifndef LAMAI_BATCH_H
+#define LAMAI_BATCH_H
+
+/* Batch runs: the bytecode file is loaded once and run on every input by
+   a pool of jobs threads, each case in its own isolate with stdin read
+   from the input and stdout written to <outdir>/<input name>.log (the
+   name without its directory and last extension). Prints the status and
+   the time of every case; returns the number of failed cases */
+int run_batch (char *fname, char *outdir, char **inputs, int n_inputs, int jobs);
+
+#endif //LAMAI_BATCH_H
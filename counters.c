@@ -0,0 +1,161 @@
+/* Lama SM Bytecode interpreter: hardware performance counters by phase */
+
+# include <string.h>
+# include <stdlib.h>
+# include <stdint.h>
+# include <errno.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+# include <x86intrin.h>
+
+# include "counters.h"
+
+# define CACHE_MISS(cache, op) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_ ## op << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct {
+    const char *name;
+    uint32_t    type;
+    uint64_t    config;
+    int         fd;                /* -1 if the counter is not available            */
+    struct perf_event_mmap_page *page;    /* For rdpmc, if the kernel allows it    */
+    uint64_t    last;              /* The value at the last switch                  */
+    uint64_t    counts[COUNTERS_PHASES];
+} counter;
+
+static counter counters[] = {
+    {.name = "cycles",                .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES},
+    {.name = "instructions",          .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_INSTRUCTIONS},
+    {.name = "branch-misses",         .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_BRANCH_MISSES},
+    {.name = "L1-dcache-load-misses", .type = PERF_TYPE_HW_CACHE, .config = CACHE_MISS(PERF_COUNT_HW_CACHE_L1D, READ)},
+    {.name = "L1-icache-load-misses", .type = PERF_TYPE_HW_CACHE, .config = CACHE_MISS(PERF_COUNT_HW_CACHE_L1I, READ)},
+    {.name = "LLC-load-misses",       .type = PERF_TYPE_HW_CACHE, .config = CACHE_MISS(PERF_COUNT_HW_CACHE_LL, READ)},
+    {.name = "iTLB-load-misses",      .type = PERF_TYPE_HW_CACHE, .config = CACHE_MISS(PERF_COUNT_HW_CACHE_ITLB, READ)},
+    {.name = "task-clock (ns)",       .type = PERF_TYPE_SOFTWARE, .config = PERF_COUNT_SW_TASK_CLOCK},
+};
+
+# define N_COUNTERS ((int) (sizeof (counters) / sizeof (counters[0])))
+
+static counters_phase phase;
+
+/* The value of a counter, from its page while the kernel keeps the
+   offset and the index there consistent, or with a read */
+static uint64_t counter_value (counter *c) {
+    struct perf_event_mmap_page *pc = c->page;
+    uint64_t value;
+
+    if (pc != NULL) {
+        uint32_t seq, index;
+
+        do {
+            seq = pc->lock;
+            __sync_synchronize ();
+            index = pc->index;
+            value = pc->offset;
+            if (pc->cap_user_rdpmc && index != 0) {
+                int64_t pmc = __rdpmc (index - 1);
+
+                pmc <<= 64 - pc->pmc_width;
+                pmc >>= 64 - pc->pmc_width;
+                value += pmc;
+            }
+            __sync_synchronize ();
+        } while (pc->lock != seq);
+
+        if (pc->cap_user_rdpmc && index != 0) return value;
+    }
+
+    if (read (c->fd, &value, sizeof (value)) != (ssize_t) sizeof (value)) return c->last;
+
+    return value;
+}
+
+bool counters_open (void) {
+    long page_size = sysconf (_SC_PAGESIZE);
+    int opened = 0, error = 0;
+
+    for (int i = 0; i < N_COUNTERS; i++) {
+        counter *c = &counters[i];
+        struct perf_event_attr attr;
+
+        memset (&attr, 0, sizeof (attr));
+        attr.size           = sizeof (attr);
+        attr.type           = c->type;
+        attr.config         = c->config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        c->fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        c->page = NULL;
+
+        if (c->fd == -1) {
+            error = errno;
+            continue;
+        }
+
+        c->page = (struct perf_event_mmap_page*) mmap (NULL, page_size, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (c->page == MAP_FAILED) c->page = NULL;
+
+        c->last = counter_value (c);
+        opened++;
+    }
+
+    if (opened == 0) {
+        fprintf (stderr, "lamai: performance counters are unavailable: %s\n", strerror (error));
+    }
+
+    phase = COUNTERS_INTERPRETER;
+    return opened != 0;
+}
+
+void counters_switch (counters_phase next) {
+    for (int i = 0; i < N_COUNTERS; i++) {
+        counter *c = &counters[i];
+        uint64_t value;
+
+        if (c->fd == -1) continue;
+        value = counter_value (c);
+        c->counts[phase] += value - c->last;
+        c->last = value;
+    }
+
+    phase = next;
+}
+
+counters_phase counters_phase_now (void) {
+    return phase;
+}
+
+void counters_report (FILE *f) {
+    int missing = 0;
+
+    counters_switch (phase);
+
+    fprintf (f, "%-24s %16s %16s %16s %16s\n", "counter", "interpreter", "gc", "runtime", "total");
+    for (int i = 0; i < N_COUNTERS; i++) {
+        counter *c = &counters[i];
+
+        if (c->fd == -1) {
+            missing++;
+            continue;
+        }
+
+        fprintf (f, "%-24s %16llu %16llu %16llu %16llu\n", c->name,
+                 (unsigned long long) c->counts[COUNTERS_INTERPRETER],
+                 (unsigned long long) c->counts[COUNTERS_GC],
+                 (unsigned long long) c->counts[COUNTERS_RUNTIME],
+                 (unsigned long long) (c->counts[COUNTERS_INTERPRETER] + c->counts[COUNTERS_GC]
+                                       + c->counts[COUNTERS_RUNTIME]));
+    }
+
+    if (missing != 0) {
+        fprintf (f, "not available:");
+        for (int i = 0; i < N_COUNTERS; i++) {
+            if (counters[i].fd == -1) fprintf (f, " %s", counters[i].name);
+        }
+        fprintf (f, "\n");
+    }
+}
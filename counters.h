@@ -0,0 +1,26 @@
+#ifndef LAMAI_COUNTERS_H
+#define LAMAI_COUNTERS_H
+
+# include <stdio.h>
+# include <stdbool.h>
+
+/* Hardware performance counters of the calling thread, opened with
+   perf_event_open and read in user space with rdpmc where the kernel
+   allows it. The counts are charged to the phase the thread is in:
+   counters_switch reads them and charges the counts since the previous
+   switch to the phase being left */
+typedef enum {
+    COUNTERS_INTERPRETER,
+    COUNTERS_GC,
+    COUNTERS_RUNTIME,              /* The builtins and the natives                 */
+    COUNTERS_PHASES
+} counters_phase;
+
+/* Opens the counters that are available and starts in the interpreter;
+   returns false, having said why, if none is */
+bool counters_open (void);
+void counters_switch (counters_phase phase);
+counters_phase counters_phase_now (void);
+void counters_report (FILE *f);
+
+#endif //LAMAI_COUNTERS_H
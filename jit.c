@@ -0,0 +1,715 @@
+/* Lama SM Bytecode interpreter: the baseline template JIT (see jit.h) */
+
+# include <string.h>
+# include <stdlib.h>
+# include <stdint.h>
+# include <errno.h>
+# include <unistd.h>
+# include <sys/mman.h>
+
+# include "lamai.h"
+# include "jit.h"
+
+/* The registers of the compiled code: the stack top, the frame and the
+   limit of the stack are kept in callee-saved ones, rax, rcx and rdx are
+   the scratch registers of the templates and rdi, rsi and rdx pass the
+   arguments of the runtime calls. The topmost value may be kept in r11
+   instead of on the stack (see emitter) */
+# define RAX 0
+# define RCX 1
+# define RDX 2
+# define RBX 3                     /* The stack top                                 */
+# define RBP 5                     /* G(0)                                          */
+# define RSI 6
+# define RDI 7
+# define R11 11                    /* The topmost value, if it is cached            */
+# define R13 13                    /* L(0)                                          */
+# define R14 14                    /* A(0)                                          */
+# define R15 15                    /* The limit                                     */
+
+extern _Thread_local size_t __gc_stack_top;
+
+int jit_threshold = 1000;
+
+struct jit_region {
+    jit_region *next;
+    void       *base;
+    size_t      size;
+};
+
+/* A rel32 to patch: to the code of the instruction at offset, or to a
+   stub exiting to the interpreter at offset, which first pushes the
+   cached top if there is one. The stub of a call exits to the BEGIN of
+   the callee with the offset the call returns to */
+typedef struct {
+    int  at;
+    int  offset;
+    bool exit;
+    bool cached;
+    int  ret;                      /* The return offset of a call, or -1            */
+} fixup;
+
+/* Between two instructions the topmost value is either on the stack, or
+   cached in r11 with rbx pointing to its slot; every jump, exit and entry
+   and every runtime call has it on the stack */
+typedef struct {
+    unsigned char *buf;
+    int            size, cap;
+    fixup         *fixups;
+    int            n_fixups, cap_fixups;
+    bool           cached;
+} emitter;
+
+static void* jit_alloc (void *p, size_t size) {
+    p = realloc (p, size);
+
+    if (p == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    return p;
+}
+
+static void emit_byte (emitter *e, int b) {
+    if (e->size == e->cap) {
+        e->cap = e->cap == 0 ? 4096 : 2 * e->cap;
+        e->buf = (unsigned char*) jit_alloc (e->buf, e->cap);
+    }
+
+    e->buf[e->size++] = (unsigned char) b;
+}
+
+# define EMIT(e, ...)                                                   \
+    do {                                                                \
+        static const unsigned char bytes_[] = {__VA_ARGS__};           \
+        for (size_t i_ = 0; i_ < sizeof (bytes_); i_++) emit_byte (e, bytes_[i_]); \
+    } while (0)
+
+static void emit_imm32 (emitter *e, int32_t x) {
+    for (int i = 0; i < 4; i++) emit_byte (e, ((uint32_t) x >> (8 * i)) & 0xFF);
+}
+
+static void emit_imm64 (emitter *e, int64_t x) {
+    for (int i = 0; i < 8; i++) emit_byte (e, ((uint64_t) x >> (8 * i)) & 0xFF);
+}
+
+/* mov reg, [base + disp] (op 0x8B) or mov [base + disp], reg (op 0x89) */
+static void emit_mov (emitter *e, int op, int reg, int base, int32_t disp) {
+    emit_byte (e, 0x48 | (reg >> 3) << 2 | base >> 3);
+    emit_byte (e, op);
+    emit_byte (e, 0x80 | (reg & 7) << 3 | (base & 7));
+    emit_imm32 (e, disp);
+}
+
+# define LOAD(e, reg, base, disp)  emit_mov (e, 0x8B, reg, base, disp)
+# define STORE(e, base, disp, reg) emit_mov (e, 0x89, reg, base, disp)
+
+/* mov dst, src */
+static void emit_mov_reg (emitter *e, int dst, int src) {
+    emit_byte (e, 0x48 | (src >> 3) << 2 | dst >> 3);
+    emit_byte (e, 0x89);
+    emit_byte (e, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+/* mov reg, imm64 */
+static void emit_mov_imm (emitter *e, int reg, int64_t x) {
+    emit_byte (e, 0x48 | reg >> 3);
+    emit_byte (e, 0xB8 | (reg & 7));
+    emit_imm64 (e, x);
+}
+
+/* add rbx, 8 * n: drops n values */
+static void emit_drop (emitter *e, int n) {
+    if (n == 0) return;
+    EMIT (e, 0x48, 0x81, 0xC3);
+    emit_imm32 (e, 8 * n);
+}
+
+static void emit_fixup (emitter *e, int offset, bool exit, int ret) {
+    if (e->n_fixups == e->cap_fixups) {
+        e->cap_fixups = e->cap_fixups == 0 ? 64 : 2 * e->cap_fixups;
+        e->fixups = (fixup*) jit_alloc (e->fixups, e->cap_fixups * sizeof (fixup));
+    }
+
+    e->fixups[e->n_fixups++] = (fixup) {e->size, offset, exit, e->cached, ret};
+    emit_imm32 (e, 0);
+}
+
+/* A jump (jmp, or jcc with the condition code cc) to an instruction or
+   to an exit at offset */
+static void emit_jump (emitter *e, int cc, int offset, bool exit) {
+    if (cc < 0) emit_byte (e, 0xE9);
+    else {
+        emit_byte (e, 0x0F);
+        emit_byte (e, 0x80 | cc);
+    }
+
+    emit_fixup (e, offset, exit, -1);
+}
+
+# define JMP -1
+# define JZ   0x4
+# define JNZ  0x5
+# define JBE  0x6
+
+/* Pushes the cached top, if any, onto the stack */
+static void emit_flush (emitter *e) {
+    if (!e->cached) return;
+    STORE (e, RBX, 0, R11);
+    EMIT (e, 0x48, 0x83, 0xEB, 0x08);            /* sub rbx, 8 */
+    e->cached = false;
+}
+
+/* The topmost value into reg */
+static void emit_top (emitter *e, int reg) {
+    if (e->cached) emit_mov_reg (e, reg, R11);
+    else LOAD (e, reg, RBX, 8);
+}
+
+/* Drops the topmost value */
+static void emit_pop (emitter *e) {
+    if (e->cached) e->cached = false;
+    else emit_drop (e, 1);
+}
+
+/* The check before n pushes, with the top on the stack: the interpreter
+   grows the stack */
+static void emit_push_check (emitter *e, int offset, int n) {
+    emit_flush (e);
+    if (n <= 1) EMIT (e, 0x4C, 0x39, 0xFB);     /* cmp rbx, r15 */
+    else {
+        EMIT (e, 0x48, 0x89, 0xD8, 0x48, 0x2D); /* mov rax, rbx; sub rax, imm32 */
+        emit_imm32 (e, 8 * (n - 1));
+        EMIT (e, 0x4C, 0x39, 0xF8);             /* cmp rax, r15 */
+    }
+    emit_jump (e, JBE, offset, true);
+}
+
+/* Makes the value in reg the new (cached) top, after a push check or
+   with the top on the stack */
+static void emit_push (emitter *e, int reg) {
+    emit_flush (e);
+    if (reg != R11) emit_mov_reg (e, R11, reg);
+    e->cached = true;
+}
+
+static bool emit_binop (emitter *e, int op, int offset) {
+    if (e->cached) {
+        LOAD (e, RAX, RBX, 8);
+        emit_mov_reg (e, RCX, R11);
+    } else {
+        LOAD (e, RAX, RBX, 16);
+        LOAD (e, RCX, RBX, 8);
+    }
+    EMIT (e, 0x48, 0x89, 0xC2,                   /* mov rdx, rax */
+             0x48, 0x21, 0xCA,                   /* and rdx, rcx */
+             0xF6, 0xC2, 0x01);                  /* test dl, 1   */
+    emit_jump (e, JZ, offset, true);
+    EMIT (e, 0x48, 0xD1, 0xF8,                   /* sar rax, 1   */
+             0x48, 0xD1, 0xF9);                  /* sar rcx, 1   */
+
+    switch (op) {
+        case 1: EMIT (e, 0x48, 0x01, 0xC8); break;             /* add rax, rcx  */
+        case 2: EMIT (e, 0x48, 0x29, 0xC8); break;             /* sub rax, rcx  */
+        case 3: EMIT (e, 0x48, 0x0F, 0xAF, 0xC1); break;       /* imul rax, rcx */
+        case 4: case 5:
+            EMIT (e, 0x48, 0x85, 0xC9);                        /* test rcx, rcx */
+            emit_jump (e, JZ, offset, true);
+            EMIT (e, 0x48, 0x99, 0x48, 0xF7, 0xF9);            /* cqo; idiv rcx */
+            if (op == 5) EMIT (e, 0x48, 0x89, 0xD0);           /* mov rax, rdx  */
+            break;
+        case 6: case 7: case 8: case 9: case 10: case 11: {
+            static const unsigned char set[] = {0x9C, 0x9E, 0x9F, 0x9D, 0x94, 0x95};
+
+            EMIT (e, 0x48, 0x39, 0xC8);                        /* cmp rax, rcx  */
+            emit_byte (e, 0x0F);                               /* setcc al      */
+            emit_byte (e, set[op - 6]);
+            emit_byte (e, 0xC0);
+            EMIT (e, 0x0F, 0xB6, 0xC0);                        /* movzx eax, al */
+            break;
+        }
+        case 12:
+            EMIT (e, 0x48, 0x85, 0xC0, 0x0F, 0x95, 0xC0,       /* test rax, rax; setne al */
+                     0x48, 0x85, 0xC9, 0x0F, 0x95, 0xC1,       /* test rcx, rcx; setne cl */
+                     0x20, 0xC8, 0x0F, 0xB6, 0xC0);            /* and al, cl; movzx eax, al */
+            break;
+        case 13:
+            EMIT (e, 0x48, 0x09, 0xC8, 0x0F, 0x95, 0xC0,       /* or rax, rcx; setne al */
+                     0x0F, 0xB6, 0xC0);                        /* movzx eax, al */
+            break;
+        default:
+            return false;
+    }
+
+    EMIT (e, 0x48, 0xD1, 0xE0,                   /* shl rax, 1   */
+             0x48, 0x83, 0xC8, 0x01);            /* or rax, 1    */
+    emit_drop (e, e->cached ? 1 : 2);
+    e->cached = false;
+    emit_push (e, RAX);
+    return true;
+}
+
+/* Runtime calls. The values of the stack are passed by the address of
+   the top, so the collector sees and updates them during the call; the
+   helpers copy them into the new object afterwards */
+static void* jit_sexp (void **sp, aint tag, aint n) {
+    void **b = (void**) LmakeSexp (BOX(n + 1), tag);
+
+    for (aint i = 0; i < n; i++) b[i] = sp[n - i];
+    return b;
+}
+
+static void* jit_array (void **sp, aint n) {
+    void **p = (void**) LmakeArray (BOX(n));
+
+    for (aint i = 0; i < n; i++) p[i] = sp[n - i];
+    return p;
+}
+
+static void* jit_closure (void **sp, void *entry, aint n) {
+    void **f = (void**) LMakeClosure (BOX(n), entry);
+
+    for (aint i = 0; i < n; i++) f[i + 1] = sp[n - i];
+    return f;
+}
+
+/* Before a runtime call the top goes to the stack, the stack top to
+   __gc_stack_top for the collector and the instruction to the ip of the
+   interpreter for the location of a failure */
+static void emit_call_prepare (jit_code *J, emitter *e, int o) {
+    emit_flush (e);
+    emit_mov_imm (e, RAX, (int64_t) (intptr_t) J->gc_top);
+    STORE (e, RAX, 0, RBX);
+    emit_mov_imm (e, RAX, (int64_t) (intptr_t) (J->code + o + 1));
+    emit_mov_imm (e, RCX, (int64_t) (intptr_t) J->ip);
+    STORE (e, RCX, 0, RAX);
+}
+
+/* Calls fn with the arguments in rdi, rsi and rdx, drops n values and
+   pushes the result if there is one. rsp is 16-aligned in compiled code */
+static void emit_call (emitter *e, void *fn, int n, bool result) {
+    emit_mov_imm (e, RAX, (int64_t) (intptr_t) fn);
+    EMIT (e, 0xFF, 0xD0);                        /* call rax */
+    emit_drop (e, n);
+    if (result) emit_push (e, RAX);
+}
+
+/* A call of fn (v1) replacing the topmost value v1 */
+static void emit_call_top (jit_code *J, emitter *e, int o, void *fn) {
+    emit_call_prepare (J, e, o);
+    LOAD (e, RDI, RBX, 8);
+    emit_call (e, fn, 1, true);
+}
+
+/* Emits the template of the instruction at offset o of a function with
+   n_args and n_locs; false if there is none */
+static bool emit_instruction (jit_code *J, emitter *e, int o, int n_args, int n_locs) {
+    const char *ip = J->code + o;
+    int  h = (*ip & 0xF0) >> 4, l = *ip & 0x0F;
+    int  arg = instruction_size (ip) > 1 ? *(const int*) (ip + 1) : 0;
+    static const int bases[] = {RBP, R13, R14};
+
+#define IN_FRAME(l, i) ((l) <= 2 && (i) >= 0 && (i) < ((l) == 0 ? J->n_globals : (l) == 1 ? n_locs : n_args))
+
+    switch (h) {
+        case 0:
+            return emit_binop (e, l, o);
+        case 1:
+            switch (l) {
+                case 0:                          /* CONST */
+                    emit_push_check (e, o, 1);
+                    emit_mov_imm (e, R11, (int64_t) BOX(arg));
+                    e->cached = true;
+                    return true;
+                case 1:                          /* STRING */
+                    emit_push_check (e, o, 1);
+                    emit_call_prepare (J, e, o);
+                    emit_mov_imm (e, RDI, (int64_t) (intptr_t) (J->strings + arg));
+                    emit_call (e, (void*) Bstring, 0, true);
+                    return true;
+                case 2: {                        /* SEXP */
+                    int n = *(const int*) (ip + 5);
+
+                    if (n == 0) emit_push_check (e, o, 1);
+                    emit_call_prepare (J, e, o);
+                    emit_mov_reg (e, RDI, RBX);
+                    emit_mov_imm (e, RSI, (int64_t) J->tag_hash[arg]);
+                    emit_mov_imm (e, RDX, n);
+                    emit_call (e, (void*) jit_sexp, n, true);
+                    return true;
+                }
+                case 4:                          /* STA */
+                    emit_call_prepare (J, e, o);
+                    LOAD (e, RDI, RBX, 8);
+                    LOAD (e, RSI, RBX, 16);
+                    LOAD (e, RDX, RBX, 24);
+                    emit_call (e, (void*) Bsta, 3, true);
+                    return true;
+                case 5:                          /* JMP */
+                    emit_flush (e);
+                    emit_jump (e, JMP, arg, false);
+                    return true;
+                case 8:                          /* DROP */
+                    emit_pop (e);
+                    return true;
+                case 9: {                        /* DUP */
+                    bool cached = e->cached;
+
+                    /* A cached top is pushed and stays in r11 */
+                    emit_push_check (e, o, 1);
+                    if (!cached) LOAD (e, R11, RBX, 8);
+                    e->cached = true;
+                    return true;
+                }
+                case 10:                         /* SWAP */
+                    emit_top (e, RCX);
+                    if (e->cached) {
+                        LOAD (e, R11, RBX, 8);
+                        STORE (e, RBX, 8, RCX);
+                    } else {
+                        LOAD (e, RAX, RBX, 16);
+                        STORE (e, RBX, 8, RAX);
+                        STORE (e, RBX, 16, RCX);
+                    }
+                    return true;
+                case 11:                         /* ELEM */
+                    emit_call_prepare (J, e, o);
+                    LOAD (e, RDI, RBX, 16);
+                    LOAD (e, RSI, RBX, 8);
+                    emit_call (e, (void*) Belem, 2, true);
+                    return true;
+            }
+            return false;
+        case 2: case 4:                          /* LD, ST of G, L and A */
+            if (!IN_FRAME (l, arg)) return false;
+            if (h == 2) {
+                emit_push_check (e, o, 1);
+                LOAD (e, R11, bases[l], -8 * arg);
+                e->cached = true;
+            } else if (e->cached) {
+                STORE (e, bases[l], -8 * arg, R11);
+            } else {
+                LOAD (e, RAX, RBX, 8);
+                STORE (e, bases[l], -8 * arg, RAX);
+            }
+            return true;
+        case 5:
+            switch (l) {
+                case 0: case 1:                  /* CJMPz, CJMPnz */
+                    emit_top (e, RAX);
+                    EMIT (e, 0xA8, 0x01);        /* test al, 1 */
+                    emit_jump (e, JZ, o, true);
+                    emit_pop (e);
+                    EMIT (e, 0x48, 0x83, 0xF8, 0x01);      /* cmp rax, 1 */
+                    emit_jump (e, l == 0 ? JZ : JNZ, arg, false);
+                    return true;
+                case 4: {                        /* CLOSURE */
+                    int n = *(const int*) (ip + 5);
+                    const char *cap = ip + 9;
+
+                    for (int i = 0; i < n; i++) {
+                        if (!IN_FRAME (cap[5 * i], *(const int*) (cap + 5 * i + 1))) return false;
+                    }
+
+                    /* The captured values are pushed, so that they are
+                       rooted while the closure is allocated */
+                    emit_push_check (e, o, n > 0 ? n : 1);
+                    for (int i = 0; i < n; i++) {
+                        LOAD (e, RAX, bases[(int) cap[5 * i]], -8 * *(const int*) (cap + 5 * i + 1));
+                        STORE (e, RBX, 0, RAX);
+                        EMIT (e, 0x48, 0x83, 0xEB, 0x08);    /* sub rbx, 8 */
+                    }
+                    emit_call_prepare (J, e, o);
+                    emit_mov_reg (e, RDI, RBX);
+                    emit_mov_imm (e, RSI, (int64_t) (intptr_t) (J->code + arg));
+                    emit_mov_imm (e, RDX, n);
+                    emit_call (e, (void*) jit_closure, n, true);
+                    return true;
+                }
+                case 6: {                        /* CALL */
+                    char callee = J->code[arg];
+
+                    /* The call is set up as the interpreter does, which
+                       then runs the BEGIN of the callee and enters its code */
+                    if (callee != 0x52 && callee != 0x53) return false;
+                    emit_push_check (e, o, 2);
+                    emit_mov_imm (e, RAX, (int64_t) BOX(0));   /* n_caps */
+                    STORE (e, RBX, 0, RAX);
+                    EMIT (e, 0x48, 0x83, 0xEB, 0x08);        /* sub rbx, 8 */
+                    STORE (e, RBX, 0, RBX);                  /* the dummy closure, its slot */
+                    EMIT (e, 0x48, 0x83, 0xEB, 0x08);        /* sub rbx, 8 */
+                    emit_byte (e, 0xE9);
+                    emit_fixup (e, arg, true, o + instruction_size (ip));
+                    return true;
+                }
+                case 7:                          /* TAG */
+                    emit_call_prepare (J, e, o);
+                    LOAD (e, RDI, RBX, 8);
+                    emit_mov_imm (e, RSI, (int64_t) J->tag_hash[arg]);
+                    emit_mov_imm (e, RDX, (int64_t) BOX(*(const int*) (ip + 5)));
+                    emit_call (e, (void*) Btag, 1, true);
+                    return true;
+                case 8:                          /* ARRAY */
+                    emit_call_prepare (J, e, o);
+                    LOAD (e, RDI, RBX, 8);
+                    emit_mov_imm (e, RSI, (int64_t) BOX(arg));
+                    emit_call (e, (void*) Barray_patt, 1, true);
+                    return true;
+                case 10:                         /* LINE */
+                    return arg != J->stop_line;
+            }
+            return false;
+        case 6: {                                /* PATT */
+            static void* const patt[] = {
+                NULL, (void*) Bstring_tag_patt, (void*) Barray_tag_patt, (void*) Bsexp_tag_patt,
+                (void*) Bboxed_patt, (void*) Bunboxed_patt, (void*) Bclosure_tag_patt
+            };
+
+            if (l > 6) return false;
+            if (l > 0) {
+                emit_call_top (J, e, o, patt[l]);
+                return true;
+            }
+            emit_call_prepare (J, e, o);         /* =str */
+            LOAD (e, RDI, RBX, 16);
+            LOAD (e, RSI, RBX, 8);
+            emit_call (e, (void*) Bstring_patt, 2, true);
+            return true;
+        }
+        case 7:                                  /* The builtins, unless they are counted */
+            if (!J->builtins) return false;
+            switch (l) {
+                case 0:                          /* Lread */
+                    emit_push_check (e, o, 1);
+                    emit_call_prepare (J, e, o);
+                    emit_call (e, (void*) Lread, 0, true);
+                    return true;
+                case 1:                          /* Lwrite, which leaves its argument */
+                    emit_call_prepare (J, e, o);
+                    LOAD (e, RDI, RBX, 8);
+                    emit_call (e, (void*) Lwrite, 0, false);
+                    return true;
+                case 2:                          /* Llength */
+                    emit_call_top (J, e, o, (void*) Blength);
+                    return true;
+                case 3:                          /* Lstring */
+                    emit_call_top (J, e, o, (void*) Bstringval);
+                    return true;
+                case 4:                          /* Barray */
+                    if (arg == 0) emit_push_check (e, o, 1);
+                    emit_call_prepare (J, e, o);
+                    emit_mov_reg (e, RDI, RBX);
+                    emit_mov_imm (e, RSI, arg);
+                    emit_call (e, (void*) jit_array, arg, true);
+                    return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+
+#undef IN_FRAME
+}
+
+static void* map_code (jit_code *J, const unsigned char *buf, size_t size) {
+    size_t page = sysconf (_SC_PAGESIZE), mapped = (size + page - 1) / page * page;
+    jit_region *r;
+    void *p;
+
+    p = mmap (NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    memcpy (p, buf, size);
+    if (mprotect (p, mapped, PROT_READ | PROT_EXEC) != 0) {
+        munmap (p, mapped);
+        return NULL;
+    }
+
+    r = (jit_region*) jit_alloc (NULL, sizeof (jit_region));
+    r->base = p;
+    r->size = mapped;
+    r->next = J->regions;
+    J->regions = r;
+
+    return p;
+}
+
+/* NULL in the i386 build, whose code is interpreted */
+jit_code* jit_new (const char *code, int code_size, const char *strings, const aint *tag_hash,
+                   int n_globals, int stop_line, bool builtins, char **ip) {
+# ifdef __x86_64__
+    jit_code *J = (jit_code*) jit_alloc (NULL, sizeof (jit_code));
+    emitter e;
+
+    memset (J, 0, sizeof (jit_code));
+    J->code      = code;
+    J->code_size = code_size;
+    J->strings   = strings;
+    J->tag_hash  = tag_hash;
+    J->n_globals = n_globals;
+    J->stop_line = stop_line;
+    J->builtins  = builtins;
+    J->ip        = ip;
+    J->gc_top    = &__gc_stack_top;
+    J->counts    = (int*) jit_alloc (NULL, code_size * sizeof (int));
+    J->functions = (int*) jit_alloc (NULL, code_size * sizeof (int));
+    J->compiled  = (bool*) jit_alloc (NULL, code_size * sizeof (bool));
+    J->entries   = (void**) jit_alloc (NULL, code_size * sizeof (void*));
+    memset (J->counts, 0, code_size * sizeof (int));
+    memset (J->functions, 0, code_size * sizeof (int));
+    memset (J->compiled, 0, code_size * sizeof (bool));
+    memset (J->entries, 0, code_size * sizeof (void*));
+
+    for (int o = 0, begin = 0; o < code_size; o += instruction_size (code + o)) {
+        if (code[o] == 0x52 || code[o] == 0x53) begin = o;     /* BEGIN, CBEGIN */
+        J->functions[o] = begin;
+    }
+
+    /* The prologue, called as jit_exit enter (jit_frame *f, void *entry) */
+    memset (&e, 0, sizeof (e));
+    EMIT (&e, 0x53, 0x55, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,   /* push rbx, rbp, r13, r14, r15 */
+              0x48, 0x8B, 0x1F,                                 /* mov rbx, [rdi]      */
+              0x48, 0x8B, 0x6F, 0x08,                           /* mov rbp, [rdi + 8]  */
+              0x4C, 0x8B, 0x6F, 0x10,                           /* mov r13, [rdi + 16] */
+              0x4C, 0x8B, 0x77, 0x18,                           /* mov r14, [rdi + 24] */
+              0x4C, 0x8B, 0x7F, 0x20,                           /* mov r15, [rdi + 32] */
+              0xFF, 0xE6);                                      /* jmp rsi             */
+    J->enter = map_code (J, e.buf, e.size);
+    free (e.buf);
+
+    if (J->enter == NULL) {
+        jit_free (J);
+        return NULL;
+    }
+
+    return J;
+# else
+    return NULL;
+# endif
+}
+
+void jit_free (jit_code *J) {
+    for (jit_region *r = J->regions, *next; r != NULL; r = next) {
+        next = r->next;
+        munmap (r->base, r->size);
+        free (r);
+    }
+
+    free (J->counts);
+    free (J->functions);
+    free (J->compiled);
+    free (J->entries);
+    free (J);
+}
+
+void jit_compile (jit_code *J, int begin) {
+    int start, end, n_args, n_locs, *label, epilogue;
+    bool *compiled, *entry;
+    unsigned char *p;
+    emitter e;
+
+    if (J->compiled[begin] || (J->code[begin] != 0x52 && J->code[begin] != 0x53)) return;
+    J->compiled[begin] = true;
+
+    start  = end = begin + instruction_size (J->code + begin);
+    n_args = *(const int*) (J->code + begin + 1);
+    n_locs = *(const int*) (J->code + begin + 5);
+
+    while (end < J->code_size && J->code[end] != 0x52 && J->code[end] != 0x53) {
+        end += instruction_size (J->code + end);
+    }
+    if (end > J->code_size) end = J->code_size;
+
+    label    = (int*) jit_alloc (NULL, (end - start) * sizeof (int) + 1);
+    compiled = (bool*) jit_alloc (NULL, (end - start) * sizeof (bool) + 1);
+    entry    = (bool*) jit_alloc (NULL, (end - start) * sizeof (bool) + 1);
+    memset (label, -1, (end - start) * sizeof (int));
+    memset (entry, 0, (end - start) * sizeof (bool));
+    memset (&e, 0, sizeof (e));
+
+    /* The code is entered after the BEGIN, at the targets of jumps and
+       where calls return to; the top is on the stack there */
+    entry[0] = true;
+    for (int o = start; o < end; o += instruction_size (J->code + o)) {
+        char x = J->code[o];
+        int  next = o + instruction_size (J->code + o);
+
+        if (x == 0x15 || x == 0x50 || x == 0x51) {                  /* JMP, CJMPz, CJMPnz */
+            int target = *(const int*) (J->code + o + 1);
+            if (target >= start && target < end) entry[target - start] = true;
+        } else if ((x == 0x55 || x == 0x56) && next < end) {        /* CALLC, CALL */
+            entry[next - start] = true;
+        }
+    }
+
+    for (int o = start; o < end; o += instruction_size (J->code + o)) {
+        int n_fixups = e.n_fixups;
+        bool cached;
+
+        if (entry[o - start]) emit_flush (&e);
+        label[o - start] = e.size;
+        cached = e.cached;
+        compiled[o - start] = emit_instruction (J, &e, o, n_args, n_locs);
+
+        /* No template: back to the interpreter, dropping what was emitted */
+        if (!compiled[o - start]) {
+            e.size = label[o - start];
+            e.n_fixups = n_fixups;
+            e.cached = cached;
+            emit_jump (&e, JMP, o, true);
+            e.cached = false;
+        }
+    }
+
+    /* The exits: the offset to go on from in edx and that a call returns
+       to plus one in the high half of rdx, the stack top in rax */
+    epilogue = e.size;
+    EMIT (&e, 0x48, 0x89, 0xD8,                                 /* mov rax, rbx */
+              0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x5D, 0x5B,   /* pop r15, r14, r13, rbp, rbx */
+              0xC3);                                            /* ret */
+
+    for (int i = 0; i < e.n_fixups; i++) {
+        fixup *f = &e.fixups[i];
+        int target, o = f->offset;
+
+        if (!f->exit && o >= start && o < end && label[o - start] >= 0) {
+            target = label[o - start];
+        } else {
+            target = e.size;
+            if (f->cached) {
+                e.cached = true;
+                emit_flush (&e);
+            }
+            emit_mov_imm (&e, RDX, (int64_t) (f->ret + 1) << 32 | (uint32_t) o);
+            emit_byte (&e, 0xE9);                /* jmp epilogue */
+            emit_imm32 (&e, epilogue - (e.size + 4));
+        }
+
+        memcpy (e.buf + f->at, &(int32_t) {target - (f->at + 4)}, 4);
+    }
+
+    if ((p = (unsigned char*) map_code (J, e.buf, e.size)) != NULL) {
+        for (int o = start; o < end; o += instruction_size (J->code + o)) {
+            if (compiled[o - start] && entry[o - start]) J->entries[o] = p + label[o - start];
+        }
+    }
+
+    free (e.buf);
+    free (e.fixups);
+    free (label);
+    free (compiled);
+    free (entry);
+}
+
+typedef struct {
+    void **sp;
+    long   offset;
+} jit_exit;
+
+int jit_run (jit_code *J, void *entry, jit_frame *f, int *ret) {
+    jit_exit r = ((jit_exit (*) (jit_frame*, void*)) J->enter) (f, entry);
+
+    f->sp = r.sp;
+    *ret  = (int) ((unsigned long) r.offset >> 32) - 1;
+    return (int) (uint32_t) r.offset;
+}
@@ -0,0 +1,78 @@
+#ifndef LAMAI_JIT_H
+#define LAMAI_JIT_H
+
+# include <stdbool.h>
+# include <stddef.h>
+
+# include "runtime/runtime.h"
+
+/* A baseline template JIT for x86-64. Once a function has been called
+   jit_threshold times, or a loop in it has jumped back that many times,
+   the code from its BEGIN to the next one is compiled by concatenating a
+   template of machine code per instruction. The templates keep the stack
+   top and the frame in registers, but every value on the Lama stack, so
+   the collector scans the stack as usual; an instruction without a
+   template, or one of its slow paths (a boxed operand, a division by
+   zero, a stack to grow), exits to the interpreter, which executes it.
+   The interpreter enters the code after a BEGIN, after a backward jump
+   and when an END returns into compiled code */
+typedef struct {
+    void **sp;                     /* The stack top, __gc_stack_top                */
+    void **globals;                /* The addresses of G(0), L(0) and A(0)         */
+    void **locals;
+    void **args;
+    void **limit;                  /* A push with the top at or below it exits    */
+} jit_frame;
+
+typedef struct jit_region jit_region;
+
+typedef struct {
+    const char *code;
+    int         code_size;
+    const char *strings;           /* The string table and the tag hashes by string */
+    const aint *tag_hash;
+    int         n_globals;
+    int         stop_line;         /* A LINE of this line exits, see snapshots      */
+    bool        builtins;          /* Whether the CALL builtins are compiled        */
+    char      **ip;                /* The ip of the interpreter, set before a call  */
+    size_t     *gc_top;            /* __gc_stack_top of the thread, likewise        */
+    int        *counts;            /* The calls of a BEGIN, the jumps back to a loop */
+    int        *functions;         /* The BEGIN of the instruction at an offset     */
+    bool       *compiled;          /* By the offset of the BEGIN                    */
+    void      **entries;           /* The code of the instruction at an offset      */
+    jit_region *regions;
+    void       *enter;             /* The prologue jumping to an entry              */
+} jit_code;
+
+extern int jit_threshold;
+
+/* The code is compiled for the calling thread, whose stack top the calls
+   from it set. The builtins are left to the interpreter if they have to
+   be seen by the hardware counters or the timeline */
+jit_code* jit_new (const char *code, int code_size, const char *strings, const aint *tag_hash,
+                   int n_globals, int stop_line, bool builtins, char **ip);
+void jit_free (jit_code *J);
+
+/* Compiles the function whose BEGIN is at begin, once; its instructions
+   without a template are left to the interpreter */
+void jit_compile (jit_code *J, int begin);
+
+/* Counts a call of the function whose BEGIN is at offset, or a backward
+   jump to offset, and compiles the function there when it gets hot; the
+   count stops at the threshold, so it never overflows */
+static inline void jit_count (jit_code *J, int offset) {
+    if (J->counts[offset] < jit_threshold && ++J->counts[offset] == jit_threshold) {
+        jit_compile (J, J->functions[offset]);
+    }
+}
+
+/* Runs the code from entry until it exits; returns the offset of the
+   instruction to go on from, with f->sp the new stack top. If the code
+   exits to call a function, ret is the offset the call returns to, and
+   -1 otherwise */
+int jit_run (jit_code *J, void *entry, jit_frame *f, int *ret);
+
+/* The size of the (prepared) instruction at ip, see lamai.c */
+int instruction_size (const char *ip);
+
+#endif //LAMAI_JIT_H
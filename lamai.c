@@ -4,12 +4,28 @@
 # include <stdio.h>
 # include <errno.h>
 # include <stdlib.h>
+# include <stddef.h>
 # include <math.h>
 # include <assert.h>
 # include <stdbool.h>
+# include <limits.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <signal.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/time.h>
+# include <sys/resource.h>
+# include <time.h>
+# include <stdatomic.h>
+# include <sys/syscall.h>
 #include <stdarg.h>
 
-# include "runtime/runtime.h"
+# include "lamai.h"
+# include "profile.h"
+# include "counters.h"
+# include "timeline.h"
+# include "jit.h"
 
 #define swap(x,y) do {    \
    typeof(x) _x = x;      \
@@ -18,26 +34,41 @@
    y = _x;                \
  } while(0)
 
-//#define DEBUG
-
 void *__start_custom_data;
 void *__stop_custom_data;
 
-char *code_stop_ptr;
-
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
 //extern void __gc_root_scan_stack();
 
-/* The unpacked representation of bytecode file */
+/* The line in effect from the instruction at offset on */
+typedef struct {
+    int offset;
+    int line;
+} line_entry;
+
+/* The unpacked representation of bytecode file. The file itself is mapped
+   read-only, so that the pages are shared between processes running it */
 typedef struct {
     char *string_ptr;              /* A pointer to the beginning of the string table */
     int  *public_ptr;              /* A pointer to the beginning of publics table    */
     char *code_ptr;                /* A pointer to the bytecode itself               */
+    char *code_stop_ptr;           /* A pointer to the last byte of the bytecode     */
     int  *global_ptr;              /* A pointer to the global area                   */
     int   stringtab_size;          /* The size (in bytes) of the string table        */
     int   global_area_size;        /* The size (in words) of global area             */
     int   public_symbols_number;   /* The number of public symbols                   */
-    char  buffer[0];
+    char *buffer;                  /* A pointer to the sections after the header     */
+    void *map;                     /* The mapping of the whole file                  */
+    size_t map_size;               /* The size (in bytes) of the mapping             */
+    aint *tag_hash;                /* Tag hashes of SEXP and TAG names by string pos */
+    int  *native_index;            /* Natives called by name at string pos, plus one */
+    char *code_copy;               /* The code without the stripped LINEs, if any    */
+    int  *public_copy;             /* The publics table with their offsets in it     */
+    line_entry *lines;             /* The line of every LINE and BEGIN, by offset    */
+    int   n_lines;
+    int   kept_line;               /* The LINEs left in the code, see strip_lines    */
+    void *cache_map;               /* The mapping of the cache file, if any          */
+    size_t cache_size;             /* The size (in bytes) of the cache mapping       */
 } bytefile;
 
 /* Gets a string from a string table by an index */
@@ -55,55 +86,730 @@ int get_public_offset (bytefile *f, int i) {
     return f->public_ptr[i*2+1];
 }
 
-static void vfailure (char *s, va_list args) {
-    fprintf(stderr, "*** FAILURE: ");
-    vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
-    exit(255);
-}
-
 void failure (char *s, ...) {
     va_list args;
     va_start(args, s);
     vfailure(s, args);
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
+/* Maps a binary bytecode file by name and unpacks it */
 bytefile* read_file (char *fname) {
-    FILE *f = fopen (fname, "rb");
-    long size;
+    int fd = open (fname, O_RDONLY);
+    struct stat st;
     bytefile *file;
+    const int *header;
+    size_t size, publics_size;
 
-    if (f == 0) {
+    if (fd == -1 || fstat (fd, &st) == -1) {
         failure ("%s\n", strerror (errno));
     }
 
-    if (fseek (f, 0, SEEK_END) == -1) {
-        failure ("%s\n", strerror (errno));
+    if (st.st_size < (off_t) (3 * sizeof(int))) {
+        failure ("%s: not a bytecode file\n", fname);
     }
 
-    file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
+    file = (bytefile*) malloc (sizeof (bytefile));
 
     if (file == 0) {
         failure ("*** FAILURE: unable to allocate memory.\n");
     }
 
-    rewind (f);
+    file->map_size = st.st_size;
+    file->map      = mmap (NULL, file->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-    if (size != fread (&file->stringtab_size, 1, size, f)) {
+    if (file->map == MAP_FAILED) {
         failure ("%s\n", strerror (errno));
     }
 
-    fclose (f);
+    close (fd);
 
-    file->string_ptr  = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
+    /* The header is validated in place: the sections it describes must fit
+       into the file and leave room for at least one byte of code */
+    header = (const int*) file->map;
+    file->stringtab_size        = header[0];
+    file->global_area_size      = header[1];
+    file->public_symbols_number = header[2];
+    file->buffer = (char*) file->map + 3 * sizeof(int);
+    size = file->map_size - 3 * sizeof(int);
+
+    if (file->stringtab_size < 0 || file->global_area_size < 0 || file->public_symbols_number < 0
+        || (size_t) file->public_symbols_number > size / (2 * sizeof(int))) {
+        failure ("%s: malformed bytecode file\n", fname);
+    }
+
+    publics_size = file->public_symbols_number * 2 * sizeof(int);
+
+    if ((size_t) file->stringtab_size >= size - publics_size) {
+        failure ("%s: malformed bytecode file\n", fname);
+    }
+
+    file->string_ptr  = &file->buffer [publics_size];
     file->public_ptr  = (int*) file->buffer;
     file->code_ptr    = &file->string_ptr [file->stringtab_size];
-    code_stop_ptr    = file->buffer + (size - 3 * sizeof(int)) - 1;
+    file->code_stop_ptr = file->buffer + size - 1;
     file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
+    file->code_copy   = NULL;
+    file->public_copy = NULL;
+    file->lines       = NULL;
+    file->cache_map   = NULL;
 
     return file;
 }
 
+/* Unmaps a bytecode file and frees its global area */
+void close_file (bytefile *file) {
+    if (file->cache_map != NULL) munmap (file->cache_map, file->cache_size);
+    else {
+        free (file->tag_hash);
+        free (file->lines);
+    }
+    munmap (file->map, file->map_size);
+    free (file->code_copy);
+    free (file->public_copy);
+    free (file->global_ptr);
+    free (file);
+}
+
+/* Snapshots (see save_snapshot): the file to save one to, or the hook to
+   call instead, and the line whose LINE instruction is the point */
+static char *snapshot_path = NULL;
+static void (*snapshot_hook) (void) = NULL;
+static int   snapshot_line = 0;
+static _Thread_local bool snapshot_due, snapshot_reached;
+
+#define SNAPSHOT_POINT_SET (snapshot_path != NULL || snapshot_hook != NULL)
+
+/* The snapshot native marks the point too: it returns 1 and the snapshot
+   is saved right after. Without a snapshot point set it just returns 0 */
+static aint Lsnapshot (void) {
+    snapshot_due = SNAPSHOT_POINT_SET && !snapshot_reached;
+    return BOX(SNAPSHOT_POINT_SET);
+}
+
+/* Natives: the functions of runtime/Std.i, called from bytecode by the
+   CALL native instruction (0x75 <name> <n_args>) with the arguments in the
+   order they were pushed, the way compiled Lama code calls them. Every
+   native is called through a trampoline, which takes the arguments as an
+   array and calls the function with its own prototype */
+typedef void* (*native_fn) (void **args);
+
+typedef struct {
+    const char *name;
+    native_fn   fn;
+    int         n_args;            /* The number of (fixed) arguments                */
+    bool        variadic;
+} native;
+
+#define NATIVE_MAX_ARGS 10
+
+/* The ith argument as T, and the arguments after the first n of a variadic
+   native, which always gets NATIVE_MAX_ARGS of them */
+#define ARG(i, T) ((T) a[i])
+#define REST1 a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]
+#define REST2 a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]
+
+/* A trampoline returning the result of the call, or 0 for a function
+   returning nothing */
+#define FUNCTION(f, call)  static void* native_##f (void **a) { (void) a; return (void*) (call); }
+#define PROCEDURE(f, call) static void* native_##f (void **a) { (void) a; call; return (void*) BOX(0); }
+
+PROCEDURE (Lassert,         Lassert (a[0], ARG(1, char*), REST2))
+FUNCTION  (Lclone,          Lclone (a[0]))
+FUNCTION  (Lcompare,        Lcompare (a[0], a[1]))
+FUNCTION  (LcompareTags,    LcompareTags (a[0], a[1]))
+PROCEDURE (LdisableGC,      LdisableGC ())
+PROCEDURE (LenableGC,       LenableGC ())
+PROCEDURE (Lfailure,        Lfailure (ARG(0, char*), REST1))
+PROCEDURE (Lfclose,         Lfclose (ARG(0, FILE*)))
+FUNCTION  (LflatCompare,    LflatCompare (a[0], a[1]))
+FUNCTION  (Lfopen,          Lfopen (ARG(0, char*), ARG(1, char*)))
+PROCEDURE (Lfprintf,        Lfprintf (ARG(0, FILE*), ARG(1, char*), REST2))
+FUNCTION  (Lfread,          Lfread (ARG(0, char*)))
+FUNCTION  (Lfst,            Lfst (a[0]))
+PROCEDURE (Lfwrite,         Lfwrite (ARG(0, char*), ARG(1, char*)))
+FUNCTION  (LgetEnv,         LgetEnv (ARG(0, char*)))
+FUNCTION  (Lhash,           Lhash (a[0]))
+FUNCTION  (Lhd,             Lhd (a[0]))
+FUNCTION  (Li__Infix_4343,  Li__Infix_4343 (a[0], a[1]))
+FUNCTION  (LkindOf,         LkindOf (a[0]))
+FUNCTION  (LmakeArray,      LmakeArray (ARG(0, aint)))
+FUNCTION  (LmakeString,     LmakeString (ARG(0, aint)))
+FUNCTION  (LmatchSubString, LmatchSubString (ARG(0, char*), ARG(1, char*), ARG(2, aint)))
+PROCEDURE (Lprintf,         Lprintf (ARG(0, char*), REST1))
+FUNCTION  (Lrandom,         Lrandom (ARG(0, aint)))
+FUNCTION  (Lread,           Lread ())
+FUNCTION  (LreadLine,       LreadLine ())
+FUNCTION  (Lregexp,         Lregexp (ARG(0, char*)))
+FUNCTION  (LregexpMatch,    LregexpMatch (ARG(0, struct re_pattern_buffer*), ARG(1, char*), ARG(2, aint)))
+FUNCTION  (Ls__Infix_3333,  Ls__Infix_3333 (a[0], a[1]))
+FUNCTION  (Ls__Infix_3361,  Ls__Infix_3361 (a[0], a[1]))
+FUNCTION  (Ls__Infix_37,    Ls__Infix_37 (a[0], a[1]))
+FUNCTION  (Ls__Infix_3838,  Ls__Infix_3838 (a[0], a[1]))
+FUNCTION  (Ls__Infix_42,    Ls__Infix_42 (a[0], a[1]))
+FUNCTION  (Ls__Infix_43,    Ls__Infix_43 (a[0], a[1]))
+FUNCTION  (Ls__Infix_45,    Ls__Infix_45 (a[0], a[1]))
+FUNCTION  (Ls__Infix_47,    Ls__Infix_47 (a[0], a[1]))
+FUNCTION  (Ls__Infix_58,    Ls__Infix_58 (a[0], a[1]))
+FUNCTION  (Ls__Infix_60,    Ls__Infix_60 (a[0], a[1]))
+FUNCTION  (Ls__Infix_6061,  Ls__Infix_6061 (a[0], a[1]))
+FUNCTION  (Ls__Infix_6161,  Ls__Infix_6161 (a[0], a[1]))
+FUNCTION  (Ls__Infix_62,    Ls__Infix_62 (a[0], a[1]))
+FUNCTION  (Ls__Infix_6261,  Ls__Infix_6261 (a[0], a[1]))
+FUNCTION  (Lsnapshot,       Lsnapshot ())
+FUNCTION  (Lsnd,            Lsnd (a[0]))
+FUNCTION  (Lsprintf,        Lsprintf (ARG(0, char*), REST1))
+FUNCTION  (LstringInt,      LstringInt (ARG(0, char*)))
+FUNCTION  (Lstringcat,      Lstringcat (a[0]))
+FUNCTION  (Lsubstring,      Lsubstring (a[0], ARG(1, aint), ARG(2, aint)))
+FUNCTION  (Lsystem,         Lsystem (ARG(0, char*)))
+FUNCTION  (LtagHash,        LtagHash (ARG(0, char*)))
+FUNCTION  (Ltime,           Ltime ())
+FUNCTION  (Ltl,             Ltl (a[0]))
+FUNCTION  (Lwrite,          Lwrite (ARG(0, aint)))
+
+#undef PROCEDURE
+#undef FUNCTION
+#undef REST2
+#undef REST1
+#undef ARG
+
+#define NATIVE(f, n)  {#f, native_##f, n, false}
+#define NATIVEV(f, n) {#f, native_##f, n, true}
+
+/* Sorted by name for bsearch */
+static const native natives[] = {
+    NATIVEV(Lassert,         2),
+    NATIVE (Lclone,          1),
+    NATIVE (Lcompare,        2),
+    NATIVE (LcompareTags,    2),
+    NATIVE (LdisableGC,      0),
+    NATIVE (LenableGC,       0),
+    NATIVEV(Lfailure,        1),
+    NATIVE (Lfclose,         1),
+    NATIVE (LflatCompare,    2),
+    NATIVE (Lfopen,          2),
+    NATIVEV(Lfprintf,        2),
+    NATIVE (Lfread,          1),
+    NATIVE (Lfst,            1),
+    NATIVE (Lfwrite,         2),
+    NATIVE (LgetEnv,         1),
+    NATIVE (Lhash,           1),
+    NATIVE (Lhd,             1),
+    NATIVE (Li__Infix_4343,  2),
+    NATIVE (LkindOf,         1),
+    NATIVE (LmakeArray,      1),
+    NATIVE (LmakeString,     1),
+    NATIVE (LmatchSubString, 3),
+    NATIVEV(Lprintf,         1),
+    NATIVE (Lrandom,         1),
+    NATIVE (Lread,           0),
+    NATIVE (LreadLine,       0),
+    NATIVE (Lregexp,         1),
+    NATIVE (LregexpMatch,    3),
+    NATIVE (Ls__Infix_3333,  2),
+    NATIVE (Ls__Infix_3361,  2),
+    NATIVE (Ls__Infix_37,    2),
+    NATIVE (Ls__Infix_3838,  2),
+    NATIVE (Ls__Infix_42,    2),
+    NATIVE (Ls__Infix_43,    2),
+    NATIVE (Ls__Infix_45,    2),
+    NATIVE (Ls__Infix_47,    2),
+    NATIVE (Ls__Infix_58,    2),
+    NATIVE (Ls__Infix_60,    2),
+    NATIVE (Ls__Infix_6061,  2),
+    NATIVE (Ls__Infix_6161,  2),
+    NATIVE (Ls__Infix_62,    2),
+    NATIVE (Ls__Infix_6261,  2),
+    NATIVE (Lsnapshot,       0),
+    NATIVE (Lsnd,            1),
+    NATIVEV(Lsprintf,        1),
+    NATIVE (LstringInt,      1),
+    NATIVE (Lstringcat,      1),
+    NATIVE (Lsubstring,      3),
+    NATIVE (Lsystem,         1),
+    NATIVE (LtagHash,        1),
+    NATIVE (Ltime,           0),
+    NATIVE (Ltl,             1),
+    NATIVE (Lwrite,          1),
+};
+
+#define NATIVES_NUMBER  ((int) (sizeof (natives) / sizeof (natives[0])))
+
+static int native_compare (const void *name, const void *n) {
+    return strcmp ((const char*) name, ((const native*) n)->name);
+}
+
+/* Calls a native with the arguments args[0..n_args-1]. Variadic natives
+   always get NATIVE_MAX_ARGS arguments: they only read what they need */
+static void* call_native (const native *nat, void **args, int n_args) {
+    if (nat->variadic) {
+        for (int i = n_args; i < NATIVE_MAX_ARGS; i++) args[i] = (void*) BOX(0);
+    }
+
+    return nat->fn (args);
+}
+
+/* Decodes the whole code section once: checks that every instruction is
+   known and fits into the file, that every string operand, jump or call
+   target and public symbol is in range, precomputes the tag hashes of
+   SEXP and TAG and resolves the natives called by name */
+static void prepare_file (bytefile *bf, char *fname) {
+    char *ip = bf->code_ptr, *end = bf->code_stop_ptr + 1;
+    int code_size = end - bf->code_ptr;
+
+    bf->tag_hash = (aint*) calloc (bf->stringtab_size, sizeof (aint) + sizeof (int));
+
+    if (bf->tag_hash == NULL && bf->stringtab_size > 0) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    bf->native_index = (int*) (bf->tag_hash + bf->stringtab_size);
+
+#define PFAIL(msg) failure ("%s: %s at offset %d\n", fname, msg, (int) (ip - bf->code_ptr))
+#define PINT (ip + sizeof (int) > end ? PFAIL ("truncated instruction"), 0 \
+                                      : (ip += sizeof (int), *(int*)(ip - sizeof (int))))
+#define PSTRING(pos) do {                                                 \
+        int p = (pos);                                                    \
+        if (p < 0 || p >= bf->stringtab_size) PFAIL ("invalid string");   \
+        if (memchr (bf->string_ptr + p, 0, bf->stringtab_size - p) == NULL) \
+            PFAIL ("unterminated string");                                \
+    } while (0)
+#define PTARGET(addr) do {                                                \
+        int a = (addr);                                                   \
+        if (a < 0 || a >= code_size) PFAIL ("invalid jump target");       \
+    } while (0)
+
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        PSTRING (bf->public_ptr[i*2]);
+        PTARGET (get_public_offset (bf, i));
+    }
+
+    while (ip < end) {
+        char x = *ip++, h = (x & 0xF0) >> 4, l = x & 0x0F;
+        bool ok;
+
+        switch (h) {
+            case 15:                            /* STOP */
+                ok = true;
+                break;
+            case 0:                             /* BINOP */
+                ok = l >= 1 && l <= 13;
+                break;
+            case 1:
+                ok = l <= 11;
+                if (l == 0) PINT;               /* CONST */
+                else if (l == 1) PSTRING (PINT);   /* STRING */
+                else if (l == 5) PTARGET (PINT);   /* JMP */
+                else if (l == 2) {              /* SEXP */
+                    int pos = PINT;
+                    PSTRING (pos);
+                    bf->tag_hash[pos] = LtagHash (get_string (bf, pos));
+                    PINT;
+                }
+                break;
+            case 2: case 3: case 4:             /* LD, LDA, ST */
+                ok = l <= 3;
+                PINT;
+                break;
+            case 5:
+                ok = l <= 10;
+                switch (l) {
+                    case 0: case 1:             /* CJMPz, CJMPnz */
+                        PTARGET (PINT);
+                        break;
+                    case 4: {                   /* CLOSURE */
+                        PTARGET (PINT);
+                        int n_caps = PINT;
+                        if (n_caps < 0) PFAIL ("invalid closure");
+                        for (int i = 0; i < n_caps; i++) {
+                            if (ip >= end) PFAIL ("truncated instruction");
+                            ip++;
+                            PINT;
+                        }
+                        break;
+                    }
+                    case 6:                     /* CALL */
+                        PTARGET (PINT);
+                        PINT;
+                        break;
+                    case 7: {                   /* TAG */
+                        int pos = PINT;
+                        PSTRING (pos);
+                        bf->tag_hash[pos] = LtagHash (get_string (bf, pos));
+                        PINT;
+                        break;
+                    }
+                    case 2: case 3: case 9:     /* BEGIN, CBEGIN, FAIL */
+                        PINT;
+                        PINT;
+                        break;
+                    case 5: case 8: case 10:    /* CALLC, ARRAY, LINE */
+                        PINT;
+                        break;
+                }
+                break;
+            case 6:                             /* PATT */
+                ok = l <= 6;
+                break;
+            case 7:                             /* builtins */
+                ok = l <= 5;
+                if (l == 4) PINT;
+                else if (l == 5) {              /* CALL native */
+                    int pos = PINT, n_args = PINT;
+                    const native *nat;
+                    PSTRING (pos);
+                    nat = bsearch (get_string (bf, pos), natives, NATIVES_NUMBER,
+                                   sizeof (native), native_compare);
+                    if (nat == NULL) PFAIL ("unknown native");
+                    if (n_args < nat->n_args || n_args > NATIVE_MAX_ARGS
+                        || (!nat->variadic && n_args != nat->n_args)) {
+                        PFAIL ("wrong number of native arguments");
+                    }
+                    bf->native_index[pos] = nat - natives + 1;
+                }
+                break;
+            default:
+                ok = false;
+        }
+
+        if (!ok) {
+            ip--;
+            PFAIL ("invalid opcode");
+        }
+    }
+
+#undef PTARGET
+#undef PSTRING
+#undef PINT
+#undef PFAIL
+}
+
+/* The FNV-1a hash of a bytecode file, which snapshots are checked with */
+static uint64_t fnv1a (const unsigned char *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (n--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/* The size of the (prepared) instruction at ip */
+int instruction_size (const char *ip) {
+    char x = *ip, h = (x & 0xF0) >> 4, l = x & 0x0F;
+
+    switch (h) {
+        case 1:
+            return l == 2 ? 9 : l == 0 || l == 1 || l == 5 ? 5 : 1;
+        case 2: case 3: case 4:
+            return 5;
+        case 5:
+            switch (l) {
+                case 4:                         /* CLOSURE */
+                    return 9 + 5 * *(const int*) (ip + 5);
+                case 2: case 3: case 6: case 7: case 9:
+                    return 9;
+                default:
+                    return 5;
+            }
+        case 7:
+            return l == 4 ? 5 : l == 5 ? 9 : 1;
+        default:
+            return 1;
+    }
+}
+
+/* The LINE instructions left in the code by strip_lines: all of them, or
+   those of one line (0 for none) */
+#define KEEP_ALL_LINES (-1)
+
+/* Every statement starts with a LINE, which costs a dispatch to only skip
+   its operand, so LINEs other than the kept ones are moved out of the
+   code into bf->lines, and jump and call targets and public offsets are
+   relocated. The lines of the code are looked up there by line_at. Code
+   that jumps into the middle of an instruction is left as it is */
+static void strip_lines (bytefile *bf, int kept) {
+    int code_size = bf->code_stop_ptr + 1 - bf->code_ptr, n = 0;
+    int *map = (int*) malloc ((code_size + 1) * sizeof (int));
+    bool strip = true;
+    char *code;
+
+#define IS_TARGET(x) ((x) == 0x15 || (x) == 0x50 || (x) == 0x51 || (x) == 0x54 || (x) == 0x56)
+#define STRIPPED(o)  (bf->code_ptr[o] == 0x5A && kept != KEEP_ALL_LINES \
+                      && (kept == 0 || *(int*) (bf->code_ptr + (o) + 1) != kept))
+
+    bf->kept_line = kept;
+    bf->lines = (line_entry*) malloc ((code_size + 1) * sizeof (line_entry));
+
+    if (map == NULL || bf->lines == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    /* The new offset of every instruction, and the lines by old offsets */
+    memset (map, -1, (code_size + 1) * sizeof (int));
+    bf->n_lines = 0;
+
+    for (int o = 0; o < code_size; o += instruction_size (bf->code_ptr + o)) {
+        char x = bf->code_ptr[o];
+
+        map[o] = n;
+
+        if (x == 0x52 || x == 0x53) {           /* BEGIN, CBEGIN */
+            bf->lines[bf->n_lines++] = (line_entry) {o, 0};
+        } else if (x == 0x5A) {                 /* LINE */
+            bf->lines[bf->n_lines++] = (line_entry) {o, *(int*) (bf->code_ptr + o + 1)};
+        }
+
+        if (!STRIPPED (o)) n += instruction_size (bf->code_ptr + o);
+    }
+
+    map[code_size] = n;
+
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        if (map[get_public_offset (bf, i)] == -1) strip = false;
+    }
+
+    for (int o = 0; o < code_size; o += instruction_size (bf->code_ptr + o)) {
+        if (IS_TARGET (bf->code_ptr[o]) && map[*(int*) (bf->code_ptr + o + 1)] == -1) strip = false;
+    }
+
+    if (!strip || n == code_size) {
+        bf->kept_line = KEEP_ALL_LINES;
+        free (map);
+        return;
+    }
+
+    code = (char*) malloc (n);
+    bf->public_copy = (int*) malloc (bf->public_symbols_number * 2 * sizeof (int));
+
+    if (code == NULL || (bf->public_copy == NULL && bf->public_symbols_number > 0)) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    for (int o = 0; o < code_size; o += instruction_size (bf->code_ptr + o)) {
+        if (STRIPPED (o)) continue;
+
+        memcpy (code + map[o], bf->code_ptr + o, instruction_size (bf->code_ptr + o));
+        if (IS_TARGET (bf->code_ptr[o])) {
+            *(int*) (code + map[o] + 1) = map[*(int*) (bf->code_ptr + o + 1)];
+        }
+    }
+
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        bf->public_copy[i*2]   = bf->public_ptr[i*2];
+        bf->public_copy[i*2+1] = map[bf->public_ptr[i*2+1]];
+    }
+
+    for (int i = 0; i < bf->n_lines; i++) bf->lines[i].offset = map[bf->lines[i].offset];
+
+    bf->public_ptr = bf->public_copy;
+    bf->code_copy = bf->code_ptr = code;
+    bf->code_stop_ptr = code + n - 1;
+    free (map);
+
+#undef STRIPPED
+#undef IS_TARGET
+}
+
+/* The line of the instruction at offset, or 0 if it is unknown */
+static int line_at (bytefile *bf, int offset) {
+    int lo = 0, hi = bf->n_lines;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (bf->lines[mid].offset <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo == 0 ? 0 : bf->lines[lo - 1].line;
+}
+
+/* The prepared form of a bytecode file (the tag hashes, the natives, the
+   code without its stripped LINEs, the relocated publics and the lines)
+   is cached on disk under the content hash of the file and the LINEs
+   kept, so later runs of an unchanged file only map it. A cache file is
+   the header and these sections, in this order */
+#define CACHE_MAGIC "LAMAIC2"
+
+typedef struct {
+    char     magic[8];
+    uint32_t word_size;            /* sizeof(aint) of the interpreter writing it     */
+    int32_t  kept;                 /* The LINEs asked to be kept                     */
+    uint64_t file_size;            /* The size and the FNV-1a hash of the bytecode   */
+    uint64_t file_hash;
+    int32_t  kept_line;            /* The LINEs actually left, see strip_lines       */
+    int32_t  code_size;            /* The size of the prepared code                  */
+    int32_t  n_lines;
+    int32_t  reserved;
+} cache_header;
+
+static bool cache_on = true;
+
+/* Cache files live in $LAMAI_CACHE_DIR, $XDG_CACHE_HOME/lamai or
+   $HOME/.cache/lamai; the directories are created when asked to */
+static bool cache_path (char *buf, size_t size, uint64_t hash, int kept, bool create) {
+    char *dir = getenv ("LAMAI_CACHE_DIR"), *base;
+    int n;
+
+    if (dir != NULL && *dir != 0) {
+        n = snprintf (buf, size, "%s", dir);
+    } else if ((base = getenv ("XDG_CACHE_HOME")) != NULL && *base != 0) {
+        n = snprintf (buf, size, "%s/lamai", base);
+    } else if ((base = getenv ("HOME")) != NULL && *base != 0) {
+        n = snprintf (buf, size, "%s/.cache", base);
+        if (create && n > 0 && (size_t) n < size) mkdir (buf, 0755);
+        n = snprintf (buf, size, "%s/.cache/lamai", base);
+    } else {
+        return false;
+    }
+
+    if (n <= 0 || (size_t) n >= size) return false;
+    if (create) mkdir (buf, 0755);
+
+    n += snprintf (buf + n, size - n, "/%016llx%+d", (unsigned long long) hash, kept);
+
+    return (size_t) n < size;
+}
+
+/* The size of the sections of a cache file after its header */
+static size_t cache_sections_size (bytefile *bf, int code_size, int n_lines) {
+    return bf->stringtab_size * (sizeof (aint) + sizeof (int))
+         + bf->public_symbols_number * 2 * sizeof (int)
+         + n_lines * sizeof (line_entry) + code_size;
+}
+
+/* Maps a cache file and points bf into it. The header must describe this
+   file, and the natives, the public offsets and the lines read back must
+   be in range, otherwise the cache is ignored */
+static bool load_cache (bytefile *bf, const char *path, uint64_t hash, int kept) {
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+    cache_header *c;
+    char *p;
+    int code_size;
+    bool ok;
+
+    if (fd == -1) return false;
+
+    if (fstat (fd, &st) == -1 || (size_t) st.st_size < sizeof (cache_header)) {
+        close (fd);
+        return false;
+    }
+
+    c = (cache_header*) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (c == MAP_FAILED) return false;
+
+    code_size = c->code_size;
+    ok = memcmp (c->magic, CACHE_MAGIC, sizeof (c->magic)) == 0
+         && c->word_size == sizeof (aint) && c->kept == kept
+         && c->file_size == bf->map_size && c->file_hash == hash
+         && code_size > 0 && code_size <= bf->code_stop_ptr + 1 - bf->code_ptr
+         && c->n_lines >= 0 && c->n_lines <= code_size
+         && (size_t) st.st_size == sizeof (cache_header) + cache_sections_size (bf, code_size, c->n_lines);
+
+    if (ok) {
+        p = (char*) (c + 1);
+        bf->tag_hash     = (aint*) p;
+        bf->native_index = (int*) (p += bf->stringtab_size * sizeof (aint));
+        bf->public_ptr   = (int*) (p += bf->stringtab_size * sizeof (int));
+        bf->lines        = (line_entry*) (p += bf->public_symbols_number * 2 * sizeof (int));
+        bf->code_ptr     = p + c->n_lines * sizeof (line_entry);
+
+        for (int i = 0; ok && i < bf->stringtab_size; i++) {
+            ok = bf->native_index[i] >= 0 && bf->native_index[i] <= NATIVES_NUMBER;
+        }
+
+        for (int i = 0; ok && i < bf->public_symbols_number; i++) {
+            ok = get_public_offset (bf, i) >= 0 && get_public_offset (bf, i) < code_size;
+        }
+
+        for (int i = 0; ok && i < c->n_lines; i++) {
+            ok = bf->lines[i].offset >= 0 && bf->lines[i].offset <= code_size;
+        }
+    }
+
+    if (!ok) {
+        munmap (c, st.st_size);
+        bf->tag_hash = NULL;
+        bf->native_index = NULL;
+        bf->public_ptr = (int*) bf->buffer;
+        bf->lines = NULL;
+        bf->code_ptr = &bf->string_ptr [bf->stringtab_size];
+        return false;
+    }
+
+    bf->code_stop_ptr = bf->code_ptr + code_size - 1;
+    bf->n_lines       = c->n_lines;
+    bf->kept_line     = c->kept_line;
+    bf->cache_map     = c;
+    bf->cache_size    = st.st_size;
+
+    return true;
+}
+
+/* Writes the cache to a temporary file and renames it into place, so
+   concurrent runs never see a partial one; errors are ignored */
+static void save_cache (bytefile *bf, const char *path, uint64_t hash, int kept) {
+    char tmp[PATH_MAX];
+    cache_header c;
+    int code_size = bf->code_stop_ptr + 1 - bf->code_ptr, fd;
+    size_t tags  = bf->stringtab_size * sizeof (aint);
+    size_t index = bf->stringtab_size * sizeof (int);
+    size_t pubs  = bf->public_symbols_number * 2 * sizeof (int);
+    size_t lines = bf->n_lines * sizeof (line_entry);
+
+    if (snprintf (tmp, sizeof (tmp), "%s.%d", path, (int) getpid ()) >= (int) sizeof (tmp)) return;
+    if ((fd = open (tmp, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) return;
+
+    memset (&c, 0, sizeof (c));
+    memcpy (c.magic, CACHE_MAGIC, sizeof (c.magic));
+    c.word_size = sizeof (aint);
+    c.kept      = kept;
+    c.file_size = bf->map_size;
+    c.file_hash = hash;
+    c.kept_line = bf->kept_line;
+    c.code_size = code_size;
+    c.n_lines   = bf->n_lines;
+
+    if (write (fd, &c, sizeof (c)) != (ssize_t) sizeof (c)
+        || write (fd, bf->tag_hash, tags) != (ssize_t) tags
+        || write (fd, bf->native_index, index) != (ssize_t) index
+        || write (fd, bf->public_ptr, pubs) != (ssize_t) pubs
+        || write (fd, bf->lines, lines) != (ssize_t) lines
+        || write (fd, bf->code_ptr, code_size) != (ssize_t) code_size
+        || close (fd) != 0
+        || rename (tmp, path) != 0) {
+        unlink (tmp);
+    }
+}
+
+/* Maps the cached prepared form of a bytecode file, or prepares the file
+   leaving the LINEs given by kept in its code and caches the result */
+static void load_prepared (bytefile *bf, char *fname, int kept) {
+    char path[PATH_MAX];
+    uint64_t hash;
+
+    if (!cache_on) {
+        prepare_file (bf, fname);
+        strip_lines (bf, kept);
+        return;
+    }
+
+    hash = fnv1a ((const unsigned char*) bf->map, bf->map_size);
+
+    if (cache_path (path, sizeof (path), hash, kept, false) && load_cache (bf, path, hash, kept)) return;
+
+    prepare_file (bf, fname);
+    strip_lines (bf, kept);
+
+    if (cache_path (path, sizeof (path), hash, kept, true)) save_cache (bf, path, hash, kept);
+}
+
 #define INIT_STACK_SIZE 10000
 
 typedef struct Lama_Loc {
@@ -131,7 +837,7 @@ typedef struct Lama_State {
     int n_globals;
 } lama_State;
 
-lama_State eval_state;
+_Thread_local lama_State eval_state;
 
 #define ttisnumber(o)(UNBOXED(o))
 #define ttisstring(o)(!UNBOXED(o)&&TAG(TO_DATA(o)->tag)==STRING_TAG)
@@ -142,7 +848,9 @@ lama_State eval_state;
 #define cast(t,exp)((t)(exp))
 #define check(p)assert(p)
 
-#define stack_bottom cast(StkId, __gc_stack_bottom)
+/* The collector scans the stack from __gc_stack_top up to __gc_stack_bottom
+   exclusive, so that is kept one past the bottom slot, which holds G(0) */
+#define stack_bottom (cast(StkId, __gc_stack_bottom) - 1)
 #define stack_top cast(StkId, __gc_stack_top)
 #define foreach_stack(ptr) for(ptr = stack_bottom; ptr > stack_top; --ptr)
 #define foreach_ci(L, ptr) for(ptr = L->base_ci; ptr >= L->ci; --ptr)
@@ -150,16 +858,19 @@ lama_State eval_state;
 #define set_gc_ptr(ptr,v)ptr=cast(size_t,v)
 
 #define alloc_stack(type,size)(cast(type*, malloc(sizeof(type) * size)) + size - 1)
+#define free_stack(bottom,size)free((bottom) - ((size) - 1))
 
 static void lama_reallocstack(lama_State *L, int newsize) {
+    TIMELINE(TIMELINE_STACK_GROW, 0, newsize * sizeof(void*));
+
     StkId prev_base = L->base;
     StkId prev_stack_last = L->stack_last;
     StkId prev_stack_top = stack_top;
     StkId prev_stack_bottom = stack_bottom;
     int prev_stacksize = L->stacksize;
 
-    set_gc_ptr(__gc_stack_bottom, alloc_stack(void*, newsize));
-    int shift = stack_bottom - prev_stack_bottom;
+    set_gc_ptr(__gc_stack_bottom, alloc_stack(void*, newsize) + 1);
+    ptrdiff_t shift = stack_bottom - prev_stack_bottom;
     set_gc_ptr(__gc_stack_top, prev_stack_top + shift);
     L->base = prev_base + shift;
     L->stacksize = newsize;
@@ -181,7 +892,7 @@ static void lama_reallocstack(lama_State *L, int newsize) {
     lama_CallInfo *ci_ptr;
     foreach_ci(L, ci_ptr)
         ci_ptr->base = ci_ptr->base + shift;
-    free(prev_stack_last + 1);
+    free_stack(prev_stack_bottom, prev_stacksize);
 }
 
 static void lama_growstack(lama_State *L, int n) {
@@ -198,7 +909,7 @@ static void lama_growstack(lama_State *L, int n) {
 #define lama_numsub(a,b)((a)-(b))
 #define lama_nummul(a,b)((a)*(b))
 #define lama_numdiv(a,b)((a)/(b))
-#define lama_nummod(a,b)((a)-floor((a)/(b))*(b))
+#define lama_nummod(a,b)((a)%(b))
 #define lama_numlt(a,b)((a)<(b))
 #define lama_numle(a,b)((a)<=(b))
 #define lama_numgt(a,b)((a)>(b))
@@ -276,7 +987,7 @@ static void **loc2adr(lama_State *L, lama_Loc loc) {
     }
 }
 
-static int lama_tonumber(lama_State *L, int idx) {
+static aint lama_tonumber(lama_State *L, int idx) {
     void *o = *idx2StkId(L, idx);
     if(!UNBOXED(o)) FAIL;
     return UNBOX(o);
@@ -287,13 +998,15 @@ static int lama_tonumber(lama_State *L, int idx) {
 #define lama_pushdummy(L){*stack_top = cast(void*, __gc_stack_top);incr_top(L);}
 
 static void lama_reallocCI(lama_State *L, int newsize) {
+    TIMELINE(TIMELINE_CI_GROW, 0, newsize * sizeof(lama_CallInfo));
+
     lama_CallInfo *prev_base_ci = L->base_ci;
     lama_CallInfo *prev_end_ci = L->end_ci;
     lama_CallInfo *prev_ci = L->ci;
     int prev_size_ci = L->size_ci;
 
     L->base_ci = alloc_stack(lama_CallInfo, newsize);
-    int shift = L->base_ci - prev_base_ci;
+    ptrdiff_t shift = L->base_ci - prev_base_ci;
 
     L->size_ci = newsize;
     L->ci = prev_ci + shift;
@@ -302,6 +1015,7 @@ static void lama_reallocCI(lama_State *L, int newsize) {
     memcpy(prev_end_ci + shift + 1,
            prev_end_ci + 1,
            prev_size_ci * sizeof(lama_CallInfo));
+    free_stack(prev_base_ci, prev_size_ci);
 }
 
 static void lama_growCI(lama_State *L, int n) {
@@ -314,99 +1028,6 @@ static void lama_growCI(lama_State *L, int n) {
 #define lama_checkCI(L,n)if((L->ci)-(L->end_ci)<=n)lama_growCI(L,n);
 #define inc_ci(L){lama_checkCI(L,1);--L->ci;}
 
-#ifdef DEBUG
-#define print_debug(...) printf(__VA_ARGS__)
-#else
-#define print_debug(...) (void)0
-#endif
-
-void printstack(lama_State *L) {
-    printf("stack\n");
-    for (int i = 0; i < L->base - stack_top; i++) {
-        int idx = L->base - stack_top - i;
-        void *d = *idx2StkId(L, idx);
-        if(ttisnumber(d))
-            printf("(int)");
-        else if(ttissexp(d))
-            printf("(sexp)");
-        else if(ttisarray(d))
-            printf("(arr)");
-        else if(ttisstring(d))
-            printf("(str)");
-        else if(ttisfunction(d))
-            printf("(fun)");
-        printf("%s ", cast(char*, Bstringval(d)));
-    }
-    printf("\n");
-}
-
-void printglobals(lama_State *L) {
-    printf("globals\n");
-    for (int i = 0; i < L->n_globals; i++) {
-        lama_Loc loc = {i, LOC_G};
-        void *d = *loc2adr(L, loc);
-        if(ttisnumber(d))
-            printf("(int)");
-        else if(ttissexp(d))
-            printf("(sexp)");
-        else if(ttisarray(d))
-            printf("(arr)");
-        else if(ttisstring(d))
-            printf("(str)");
-        else if(ttisfunction(d))
-            printf("(fun)");
-        printf("%s ", cast(char*, Bstringval(d)));
-    }
-    printf("\n");
-}
-
-void printlocals(lama_State *L) {
-    printf("locals\n");
-    for (int i = 0; i < L->ci->n_locs; i++) {
-        lama_Loc loc = {i, LOC_L};
-        void *d = *loc2adr(L, loc);
-        if(ttisnumber(d))
-            printf("(int)");
-        else if(ttissexp(d))
-            printf("(sexp)");
-        else if(ttisarray(d))
-            printf("(arr)");
-        else if(ttisstring(d))
-            printf("(str)");
-        else if(ttisfunction(d))
-            printf("(fun)");
-        printf("%s ", cast(char*, Bstringval(d)));
-    }
-    printf("\n");
-}
-
-void printargs(lama_State *L) {
-    printf("args\n");
-    for (int i = 0; i < L->ci->n_args; i++) {
-        lama_Loc loc = {i, LOC_A};
-        void *d = *loc2adr(L, loc);
-        if(ttisnumber(d))
-            printf("(int)");
-        else if(ttissexp(d))
-            printf("(sexp)");
-        else if(ttisarray(d))
-            printf("(arr)");
-        else if(ttisstring(d))
-            printf("(str)");
-        else if(ttisfunction(d))
-            printf("(fun)");
-        printf("%s ", cast(char*, Bstringval(d)));
-    }
-    printf("\n");
-}
-
-#ifndef DEBUG
-#define printstack(l) (void)0
-#define printglobals(l) (void)0
-#define printlocals(l) (void)0
-#define printargs(l) (void)0
-#endif
-
 static void lama_begin(lama_State *L, int n_caps, int n_args, int n_locs, char *retip, void *fun) {
     inc_ci(L)
     lama_CallInfo *ci = L->ci;
@@ -455,18 +1076,12 @@ static void lama_end(lama_State *L) {
     lama_push(L, ret);
 }
 
-void eval (bytefile *bf, char *fname) {
-   lama_State *L = &eval_state;
-
-#define INT (L->ip += sizeof (int), *(int*)(L->ip - sizeof (int)))
-#define BYTE *L->ip++
-#define STRING get_string (bf, INT)
-#define OPFAIL failure ("ERROR: invalid opcode %d-%d\n", h, l)
-
-    L->ip = bf->code_ptr;
+/* Allocates the stacks, the global area and the frame main returns to */
+static void lama_open(lama_State *L, bytefile *bf) {
     L->n_globals = bf->global_area_size;
 
-    __gc_stack_top = set_gc_ptr(__gc_stack_bottom, alloc_stack(void*, INIT_STACK_SIZE));
+    set_gc_ptr(__gc_stack_bottom, alloc_stack(void*, INIT_STACK_SIZE) + 1);
+    set_gc_ptr(__gc_stack_top, stack_bottom);
     L->base = stack_bottom;
     L->stacksize = INIT_STACK_SIZE;
     L->stack_last = stack_top - L->stacksize;
@@ -479,129 +1094,759 @@ void eval (bytefile *bf, char *fname) {
 
     L->base = stack_top;
 
-    lama_pushnumber(L, 0);
-    lama_pushnumber(L, 0);
-
     L->ci->n_locs = L->ci->n_args = 0;
     L->ci->base = L->base;
-    lama_pushnumber(L, 0);
-    lama_pushdummy(L);
-
-    char *ret_ip = code_stop_ptr;
 
     for(int i = 0; i < L->n_globals; i++) {
         lama_Loc loc = {i, LOC_G};
         *loc2adr(L, loc) = cast(void*, 1);
     }
+}
 
-    do {
-#ifdef DEBUG
-        printstack(L);
-        printglobals(L);
-        printlocals(L);
-        printargs(L);
-        printf("=============\n");
-#endif
-        char x = BYTE, h = (x & 0xF0) >> 4, l = x & 0x0F;
-        switch (h) {
-            case 15:
-                goto stop;
-            case 0: { //BINOP
-                print_debug("BINOP\n");
+static void lama_close(lama_State *L) {
+    free_stack(stack_bottom, L->stacksize);
+    free_stack(L->base_ci, L->size_ci);
+}
 
-                int nc = cast(int, *idx2StkId(L, 1));
-                if(UNBOXED(nc)) nc = UNBOX(nc);
-                int nb = cast(int, *idx2StkId(L, 2));
-                if(UNBOXED(nb)) nb = UNBOX(nb);
-                lama_pop(L, 2);
-                switch (l) {
-                    case OP_ADD:    lama_pushnumber(L, lama_numadd(nb,nc)); break;
-                    case OP_SUB:    lama_pushnumber(L, lama_numsub(nb,nc)); break;
-                    case OP_MUL:    lama_pushnumber(L, lama_nummul(nb,nc)); break;
-                    case OP_DIV:    lama_pushnumber(L, lama_numdiv(nb,nc)); break;
-                    case OP_MOD:    lama_pushnumber(L, lama_nummod(nb,nc)); break;
-                    case OP_LT:     lama_pushnumber(L, lama_numlt(nb,nc));  break;
-                    case OP_LE:     lama_pushnumber(L, lama_numle(nb,nc));  break;
-                    case OP_GT:     lama_pushnumber(L, lama_numgt(nb,nc));  break;
-                    case OP_GE:     lama_pushnumber(L, lama_numge(nb,nc));  break;
-                    case OP_EQ:     lama_pushnumber(L, lama_numeq(nb,nc));  break;
-                    case OP_NEQ:    lama_pushnumber(L, lama_numneq(nb,nc)); break;
-                    case OP_AND:    lama_pushnumber(L, lama_numand(nb,nc)); break;
-                    case OP_OR:     lama_pushnumber(L, lama_numor(nb,nc));  break;
-                    default: OPFAIL;
-                }
-                break;
-            }
-            case 1:
-                switch (l) {
-                    case 0: //CONST
-                        print_debug("CONST\n");
+/* A snapshot is the state of the interpreter at an instruction boundary:
+   the heap image with its relocation map, the value stack (with the
+   globals at its bottom) and the CI stack, saved with the addresses they
+   had, so that lamai_restore can relocate the pointers. The bytecode is
+   referred to by its path and checked against its hash. Values held
+   outside the heap, such as open files, do not survive a restore */
+#define SNAPSHOT_MAGIC "LAMAIS2"
 
-                        lama_pushnumber(L, INT);
-                        break;
-                    case 1: //STRING
-                        print_debug("STRING\n");
+typedef struct {
+    char     magic[8];
+    uint32_t word_size;            /* sizeof(aint) of the interpreter writing it     */
+    uint32_t path_size;            /* The size of the path of the bytecode, padded   */
+    int32_t  kept_line;            /* The LINEs left in the code by strip_lines      */
+    uint32_t reserved;
+    uint64_t file_size;            /* The size and the FNV-1a hash of the bytecode   */
+    uint64_t file_hash;
+    uint64_t code_ptr;             /* The address of the code                        */
+    uint64_t heap_begin;           /* The address and the size in words of the heap  */
+    uint64_t heap_words;
+    uint64_t stack_end;            /* The address of the value stack bottom          */
+    uint64_t stack_size;           /* The allocated and the used size of it in words */
+    uint64_t stack_used;
+    uint64_t ci_size;              /* The allocated and the used size of the CIs     */
+    uint64_t ci_used;
+    uint64_t ip;                   /* The offset of ip in the code                   */
+    uint64_t base;                 /* The offset of base from the stack bottom       */
+} snapshot_header;                 /* Followed by the path, the heap, the stack, the
+                                      CIs and the relocation map of the heap        */
+
+#define SNAPSHOT_SIZE(h) (sizeof (snapshot_header) + (h)->path_size        \
+                          + ((h)->heap_words + (h)->stack_used) * sizeof (void*) \
+                          + (h)->ci_used * sizeof (lama_CallInfo) + (h)->heap_words)
+
+static void save_snapshot (lama_State *L, bytefile *bf, char *fname) {
+    snapshot_header h;
+    char path[PATH_MAX];
+    size_t *image;
+    unsigned char *reloc;
+    StkId top = stack_top;
+    FILE *f;
+
+    if (realpath (fname, path) == NULL) {
+        failure ("%s: %s\n", fname, strerror (errno));
+    }
 
-                        lama_push(L, Bstring(STRING));
-                        break;
-                    case 2: { //SEXP
-                        print_debug("SEXP\n");
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, SNAPSHOT_MAGIC, sizeof (h.magic));
+    h.word_size    = sizeof (aint);
+    h.path_size    = (strlen (path) + sizeof (void*)) / sizeof (void*) * sizeof (void*);
+    h.file_size    = bf->map_size;
+    h.file_hash    = fnv1a ((const unsigned char*) bf->map, bf->map_size);
+    h.kept_line    = bf->kept_line;
+    h.code_ptr     = (uintptr_t) bf->code_ptr;
+    h.stack_end    = (uintptr_t) stack_bottom;
+    h.stack_size   = L->stacksize;
+    h.stack_used   = stack_bottom - top;
+    h.ci_size      = L->size_ci;
+    h.ci_used      = L->base_ci - L->ci + 1;
+    h.ip           = L->ip - bf->code_ptr;
+    h.base         = stack_bottom - L->base;
+    h.heap_words   = __heap_snapshot ((void**) (top + 1), h.stack_used, &image, &reloc);
+    h.heap_begin   = (uintptr_t) image;
+
+    memset (path + strlen (path), 0, h.path_size - strlen (path));
+
+    if ((f = fopen (snapshot_path, "wb")) == NULL
+        || fwrite (&h, sizeof (h), 1, f) != 1
+        || fwrite (path, 1, h.path_size, f) != h.path_size
+        || fwrite (image, sizeof (size_t), h.heap_words, f) != h.heap_words
+        || fwrite (top + 1, sizeof (void*), h.stack_used, f) != h.stack_used
+        || fwrite (L->ci, sizeof (lama_CallInfo), h.ci_used, f) != h.ci_used
+        || fwrite (reloc, 1, h.heap_words, f) != h.heap_words
+        || fclose (f) != 0) {
+        failure ("%s: %s\n", snapshot_path, strerror (errno));
+    }
 
-                        int tag = LtagHash(STRING);
-                        int n = INT;
-                        void* b = LmakeSexp(BOX(n + 1), tag);
-                        for (int i = 0; i < n; i++)
-                            cast(void**, b)[i] = *idx2StkId(L, n - i);
-                        lama_pop(L, n);
-                        lama_push(L, b);
-                        break;
-                    }
-                    case 3: //STI
-                        OPFAIL;
-                    case 4: { //STA
-                        print_debug("STA\n");
+    free (reloc);
+}
 
-                        StkId v = *idx2StkId(L, 1);
-                        int i = cast(int, *idx2StkId(L, 2));
-                        StkId x = *idx2StkId(L, 3);
-                        lama_pop(L, 3);
-                        lama_push(L, Bsta(v, i, x));
-                        break;
-                    }
-                    case 5: { //JMP
-                        print_debug("JMP\n");
+/* At the snapshot point the hook runs and the program goes on, or the
+   snapshot is saved and the program stops; returns whether it stops */
+static bool snapshot_point (lama_State *L, bytefile *bf, char *fname) {
+    if (snapshot_reached) return false;
+    snapshot_reached = true;
 
-                        int addr = INT;
-                        L->ip = bf->code_ptr + addr;
-                        break;
-                    }
-                    case 6: //END
-                        print_debug("END\n");
+    if (snapshot_hook != NULL) {
+        snapshot_hook ();
+        return false;
+    }
 
-                        lama_end(L);
-                        break;
-                    case 7: //RET
-                        OPFAIL;
-                    case 8: //DROP
-                        print_debug("DROP\n");
+    save_snapshot (L, bf, fname);
+    return true;
+}
 
-                        lama_pop(L, 1);
-                        break;
-                    case 9: //DUP
-                        print_debug("DUP\n");
+/* The profiler (see profile.h): whether to print the table at exit and
+   the file to write the JSON to; the profile of the thread, if enabled */
+static bool  profile_table = false;
+static char *profile_json = NULL;
+static _Thread_local profile_data *profile_state;
 
-                        lama_push(L, *idx2StkId(L, 1));
-                        break;
-                    case 10: { //SWAP
-                        print_debug("SWAP\n");
+/* The name of the public function at offset, if any */
+static char* public_name_at (bytefile *bf, int offset) {
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        if (get_public_offset (bf, i) == offset) return get_public_name (bf, i);
+    }
 
-                        swap(*idx2StkId(L, 1), *idx2StkId(L, 2));
-                        break;
-                    }
-                    case 11: { //ELEM
-                        print_debug("ELEM\n");
+    return NULL;
+}
 
-                        int i = cast(int, *idx2StkId(L, 1));
+/* Enters the function whose BEGIN is at ip, naming it on its first call */
+static void profile_begin (profile_data *P, bytefile *bf, char *ip) {
+    int offset = ip - bf->code_ptr, f = 0;
+
+    if (offset < P->code_size && (f = P->fun_index[offset]) == 0) {
+        f = profile_add_function (P, offset, public_name_at (bf, offset));
+    }
+
+    profile_enter (P, f);
+}
+
+static void profile_at_exit (void) {
+    if (profile_state != NULL) {
+        profile_report (profile_state, profile_table ? stderr : NULL, profile_json);
+    }
+}
+
+/* The sampling profiler: on every SIGPROF the offsets of L->ip and of the
+   return addresses of the frames, from the innermost, are appended to a
+   buffer allocated in advance; when the interpreter is closed or at exit
+   the samples are mapped to functions (the nearest BEGIN before) and
+   lines and written as folded stacks, with the outermost frame first */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+#define SAMPLE_BUFFER_WORDS ((size_t) 16 << 20)
+#define SAMPLE_MAX_DEPTH    1024
+
+static char     *sample_path = NULL;
+static int       sample_rate = 1000;
+static uint32_t *sample_buffer;
+static _Atomic size_t sample_used, sample_dropped;
+static _Atomic (bytefile*) sample_bf;
+static timer_t   sample_timer;
+static _Thread_local bool sampling;   /* Whether the thread is the one sampled */
+
+/* The timer sends SIGPROF to the thread sampled only, whose eval_state
+   the handler reads */
+static void sample_handler (int sig) {
+    lama_State *L = &eval_state;
+    bytefile *bf = sample_bf;
+    size_t used = sample_used;
+    uint32_t *s = sample_buffer + used;
+    int depth = 0;
+
+    (void) sig;
+
+    if (bf == NULL || L->ip < bf->code_ptr || L->ip > bf->code_stop_ptr) return;
+
+    if (used + SAMPLE_MAX_DEPTH + 1 > SAMPLE_BUFFER_WORDS) {
+        sample_dropped++;
+        return;
+    }
+
+    s[++depth] = L->ip - bf->code_ptr;
+
+    for (lama_CallInfo *ci = L->ci; ci < L->base_ci && depth < SAMPLE_MAX_DEPTH; ci++) {
+        if (ci->ret_ip > bf->code_ptr && ci->ret_ip < bf->code_stop_ptr) {
+            s[++depth] = ci->ret_ip - 1 - bf->code_ptr;
+        }
+    }
+
+    s[0] = depth;
+    sample_used = used + depth + 1;
+}
+
+/* Samples the calling thread running bf, unless another interpreter is
+   being sampled */
+static void sample_start (bytefile *bf) {
+    struct sigaction sa;
+    struct sigevent sev;
+    struct itimerspec it;
+    bytefile *none = NULL;
+
+    if (sample_buffer == NULL) {
+        sample_buffer = (uint32_t*) mmap (NULL, SAMPLE_BUFFER_WORDS * sizeof (uint32_t),
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (sample_buffer == MAP_FAILED) {
+            failure ("sampling: %s\n", strerror (errno));
+        }
+
+        memset (&sa, 0, sizeof (sa));
+        sa.sa_handler = sample_handler;
+        sa.sa_flags   = SA_RESTART;
+        sigemptyset (&sa.sa_mask);
+        sigaction (SIGPROF, &sa, NULL);
+    }
+
+    if (!atomic_compare_exchange_strong (&sample_bf, &none, bf)) return;
+
+    sample_used = sample_dropped = 0;
+    sampling = true;
+
+    memset (&sev, 0, sizeof (sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo  = SIGPROF;
+    sev.sigev_notify_thread_id = syscall (SYS_gettid);
+
+    if (timer_create (CLOCK_THREAD_CPUTIME_ID, &sev, &sample_timer) == -1) {
+        failure ("sampling: %s\n", strerror (errno));
+    }
+
+    it.it_interval.tv_sec  = 1 / sample_rate;
+    it.it_interval.tv_nsec = (1000000000L / sample_rate) % 1000000000L;
+    it.it_value = it.it_interval;
+
+    if (timer_settime (sample_timer, 0, &it, NULL) == -1) {
+        failure ("sampling: %s\n", strerror (errno));
+    }
+}
+
+static int compare_strings (const void *a, const void *b) {
+    return strcmp (*(char* const*) a, *(char* const*) b);
+}
+
+/* Stops sampling and writes the folded stacks */
+static void sample_write (void) {
+    bytefile *bf = sample_bf;
+    int code_size, *fun, fun_begin = 0, n = 0;
+    char **stacks;
+    FILE *f;
+
+    if (bf == NULL) return;
+
+    timer_delete (sample_timer);
+    sample_bf = NULL;
+    sampling = false;
+
+    /* The function of every byte of code */
+    code_size = bf->code_stop_ptr + 1 - bf->code_ptr;
+    fun = (int*) malloc (code_size * sizeof (int));
+    stacks = (char**) malloc ((sample_used / 2 + 1) * sizeof (char*));
+
+    if (fun == NULL || stacks == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    for (int o = 0; o < code_size; ) {
+        char x = bf->code_ptr[o];
+        int size = instruction_size (bf->code_ptr + o);
+
+        if (x == 0x52 || x == 0x53) fun_begin = o;     /* BEGIN, CBEGIN */
+        for (int i = o; i < o + size && i < code_size; i++) fun[i] = fun_begin;
+        o += size;
+    }
+
+    for (size_t i = 0; i < sample_used; i += sample_buffer[i] + 1) {
+        int depth = sample_buffer[i];
+        size_t size = 0, len = 0;
+        char *s = NULL;
+
+        for (int d = depth; d >= 1; d--) {
+            int o = sample_buffer[i + d], line = line_at (bf, o);
+            char *name = public_name_at (bf, fun[o]), buf[16];
+
+            if (name == NULL) {
+                snprintf (buf, sizeof (buf), "0x%08x", fun[o]);
+                name = buf;
+            }
+
+            if (len + strlen (name) + 16 > size) {
+                size = 2 * size + strlen (name) + 16;
+                if ((s = (char*) realloc (s, size)) == NULL) {
+                    failure ("*** FAILURE: unable to allocate memory.\n");
+                }
+            }
+
+            len += sprintf (s + len, line != 0 ? "%s%s:%d" : "%s%s",
+                            d == depth ? "" : ";", name, line);
+        }
+
+        stacks[n++] = s;
+    }
+
+    qsort (stacks, n, sizeof (char*), compare_strings);
+
+    if ((f = fopen (sample_path, "w")) == NULL) {
+        failure ("%s: %s\n", sample_path, strerror (errno));
+    }
+
+    for (int i = 0, count; i < n; i += count) {
+        for (count = 1; i + count < n && strcmp (stacks[i], stacks[i + count]) == 0; count++) ;
+        fprintf (f, "%s %d\n", stacks[i], count);
+    }
+
+    fclose (f);
+
+    if (sample_dropped != 0) {
+        fprintf (stderr, "lamai: %zu samples dropped, the buffer is full\n", sample_dropped);
+    }
+
+    for (int i = 0; i < n; i++) free (stacks[i]);
+    free (stacks);
+    free (fun);
+}
+
+/* Line coverage: the LINE instructions executed count the hits of their
+   lines; at exit the counts are written in the lcov format, the source
+   file being the bytecode file with the extension .lama, and the hottest
+   lines are printed to stderr */
+#define COVERAGE_HOT_LINES 10
+
+static char *coverage_path = NULL;
+static char *coverage_source;
+static _Thread_local uint64_t *coverage_counts;
+static _Thread_local bool *coverage_found;
+static _Thread_local int coverage_lines;     /* The greatest line, plus one */
+
+static void coverage_start (bytefile *bf, char *fname) {
+    char *path = realpath (fname, NULL), *ext;
+
+    if (path == NULL) path = strdup (fname);
+    if (path == NULL || (coverage_source = (char*) malloc (strlen (path) + 6)) == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    strcpy (coverage_source, path);
+    ext = strrchr (coverage_source, '.');
+    if (ext == NULL || strchr (ext, '/') != NULL) ext = coverage_source + strlen (coverage_source);
+    strcpy (ext, ".lama");
+    free (path);
+
+    for (int i = 0; i < bf->n_lines; i++) {
+        if (bf->lines[i].line >= coverage_lines) coverage_lines = bf->lines[i].line + 1;
+    }
+
+    coverage_counts = (uint64_t*) calloc (coverage_lines + 1, sizeof (uint64_t));
+    coverage_found = (bool*) calloc (coverage_lines + 1, sizeof (bool));
+
+    if (coverage_counts == NULL || coverage_found == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    for (int i = 0; i < bf->n_lines; i++) {
+        if (bf->lines[i].line > 0) coverage_found[bf->lines[i].line] = true;
+    }
+}
+
+static uint64_t *coverage_keys;
+
+static int compare_hits (const void *a, const void *b) {
+    uint64_t x = coverage_keys[*(const int*) a], y = coverage_keys[*(const int*) b];
+
+    return x < y ? 1 : x > y ? -1 : *(const int*) a - *(const int*) b;
+}
+
+static void coverage_write (void) {
+    uint64_t total = 0;
+    int found = 0, hit = 0, *order;
+    FILE *f;
+
+    if (coverage_counts == NULL) return;
+
+    if ((f = fopen (coverage_path, "w")) == NULL) {
+        fprintf (stderr, "%s: %s\n", coverage_path, strerror (errno));
+        return;
+    }
+
+    fprintf (f, "TN:\nSF:%s\n", coverage_source);
+    for (int line = 0; line < coverage_lines; line++) {
+        if (!coverage_found[line]) continue;
+        fprintf (f, "DA:%d,%llu\n", line, (unsigned long long) coverage_counts[line]);
+        found++;
+        hit += coverage_counts[line] != 0;
+        total += coverage_counts[line];
+    }
+    fprintf (f, "LF:%d\nLH:%d\nend_of_record\n", found, hit);
+    fclose (f);
+
+    if ((order = (int*) malloc ((coverage_lines + 1) * sizeof (int))) == NULL) return;
+
+    for (int i = 0; i < coverage_lines; i++) order[i] = i;
+    coverage_keys = coverage_counts;
+    qsort (order, coverage_lines, sizeof (int), compare_hits);
+
+    fprintf (stderr, "%d of %d lines hit\n%-8s %14s %7s\n", hit, found, "line", "hits", "%");
+    for (int i = 0; i < COVERAGE_HOT_LINES && i < coverage_lines && coverage_counts[order[i]] != 0; i++) {
+        fprintf (stderr, "%-8d %14llu %6.2f%%\n", order[i],
+                 (unsigned long long) coverage_counts[order[i]],
+                 100.0 * coverage_counts[order[i]] / total);
+    }
+
+    free (order);
+}
+
+/* Run statistics for the benchmarks, written as JSON at exit: the time
+   since the first interpreter was opened, the collections of the main
+   thread and the peak RSS of the process */
+static char    *stats_path = NULL;
+static uint64_t stats_start;
+
+static uint64_t now_ns (void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_write (void) {
+    uint64_t time = now_ns () - stats_start, gc_ns;
+    size_t gcs;
+    struct rusage ru;
+    FILE *f;
+
+    __gc_stats (&gcs, &gc_ns);
+    getrusage (RUSAGE_SELF, &ru);
+
+    if ((f = fopen (stats_path, "w")) == NULL) {
+        fprintf (stderr, "%s: %s\n", stats_path, strerror (errno));
+        return;
+    }
+
+    fprintf (f, "{\n  \"time_ms\": %.3f,\n  \"user_ms\": %.3f,\n  \"gc_count\": %zu,\n"
+             "  \"gc_ms\": %.3f,\n  \"max_rss_kb\": %ld\n}\n",
+             time / 1e6, ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+             gcs, gc_ns / 1e6, ru.ru_maxrss);
+    fclose (f);
+}
+
+/* The timeline (see timeline.h) of the program being recorded */
+static char     *timeline_path = NULL;
+static bytefile *timeline_bf;
+
+static const char* timeline_function_name (int offset, char *buf, size_t size) {
+    char *name = timeline_bf == NULL ? NULL : public_name_at (timeline_bf, offset);
+
+    if (name != NULL) return name;
+    snprintf (buf, size, "0x%08x", offset);
+    return buf;
+}
+
+/* Hardware counters split between the interpreter, the collector and the
+   builtins; the collector is told about by the hook of the runtime */
+static bool           counters_on = false;
+static counters_phase counters_resume;
+
+static void counters_at_exit (void) {
+    counters_report (stderr);
+}
+
+/* The census of the live objects (see runtime.h), appended to the file at
+   census_path as a table after every collection */
+static char *census_path = NULL;
+static FILE *census_file;
+static _Thread_local gc_census *census_data;
+
+static int compare_census_words (const void *a, const void *b) {
+    size_t x = ((const gc_census_tag*) a)->words, y = ((const gc_census_tag*) b)->words;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void census_write (void) {
+    static const char *kinds[] = {"string", "array", "sexp", "closure"};
+    gc_census *c = census_data;
+    gc_census_tag sexps[GC_CENSUS_TAGS];
+    size_t gcs, count = 0, words = 0;
+    uint64_t gc_ns;
+    int n = 0;
+
+    __gc_stats (&gcs, &gc_ns);
+    for (int k = 0; k < GC_CENSUS_KINDS; k++) {
+        count += c->count[k];
+        words += c->words[k];
+    }
+
+    fprintf (census_file, "gc %zu: %zu live objects, %zu words\n", gcs, count, words);
+    for (int k = 0; k < GC_CENSUS_KINDS; k++) {
+        if (c->count[k] == 0) continue;
+        fprintf (census_file, "  %-20s %12zu %14zu\n", kinds[k], c->count[k], c->words[k]);
+        if (k != SEXP_TAG >> 1) continue;
+
+        for (int i = 0; i < GC_CENSUS_TAGS; i++) {
+            if (c->sexps[i].count != 0) sexps[n++] = c->sexps[i];
+        }
+        qsort (sexps, n, sizeof (gc_census_tag), compare_census_words);
+        for (int i = 0; i < n; i++) {
+            fprintf (census_file, "    %-18s %12zu %14zu\n",
+                     de_hash (sexps[i].tag), sexps[i].count, sexps[i].words);
+        }
+        if (c->other_count != 0) {
+            fprintf (census_file, "    %-18s %12zu %14zu\n", "(other)", c->other_count, c->other_words);
+        }
+    }
+    fputc ('\n', census_file);
+}
+
+static void gc_event (int event, size_t size) {
+    if (event == GC_EVENT_START) TIMELINE(TIMELINE_GC_START, 0, size);
+    else if (event == GC_EVENT_END) TIMELINE(TIMELINE_GC_END, 0, size);
+    else TIMELINE(TIMELINE_HEAP_GROW, 0, size);
+
+    if (counters_on) {
+        if (event == GC_EVENT_START) {
+            counters_resume = counters_phase_now ();
+            counters_switch (COUNTERS_GC);
+        } else if (event == GC_EVENT_END) {
+            counters_switch (counters_resume);
+        }
+    }
+
+    if (event == GC_EVENT_END && census_data != NULL) census_write ();
+}
+
+/* The tracer: every instruction in the selected range of offsets and in
+   the selected function, if any, is written to the trace file before it
+   is executed, with its function and line, its operands, the operand
+   stack, the arguments and the locals of the frame */
+static char *trace_path = NULL;
+static char *trace_function = NULL;
+static int   trace_from = 0, trace_to = INT_MAX;
+static FILE *trace_file;
+static _Thread_local bytefile *trace_bf;
+static _Thread_local int      *trace_fun;     /* The BEGIN of every byte of code */
+static _Thread_local int       trace_target;  /* That of the selected function   */
+
+static void trace_start (bytefile *bf) {
+    int code_size = bf->code_stop_ptr + 1 - bf->code_ptr, fun_begin = -1;
+
+    trace_fun = (int*) realloc (trace_fun, code_size * sizeof (int));
+    if (trace_fun == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    for (int o = 0; o < code_size; ) {
+        char x = bf->code_ptr[o];
+        int size = instruction_size (bf->code_ptr + o);
+
+        if (x == 0x52 || x == 0x53) fun_begin = o;     /* BEGIN, CBEGIN */
+        for (int i = o; i < o + size && i < code_size; i++) trace_fun[i] = fun_begin;
+        o += size;
+    }
+
+    trace_target = -1;
+    if (trace_function != NULL) {
+        for (int i = 0; i < bf->public_symbols_number; i++) {
+            if (strcmp (get_public_name (bf, i), trace_function) == 0) trace_target = get_public_offset (bf, i);
+        }
+        if (trace_target == -1) fprintf (stderr, "trace: no public function %s\n", trace_function);
+    }
+
+    trace_bf = bf;
+}
+
+static void trace_values (const char *what, void **first, int n, int step) {
+    fprintf (trace_file, " | %s:", what);
+    for (int i = 0; i < n; i++) {
+        fputc (' ', trace_file);
+        fprintValue (trace_file, first[i * step]);
+    }
+}
+
+static __attribute__((noinline))
+void trace_instruction (lama_State *L, bytefile *bf, char *ip) {
+    int offset = ip - bf->code_ptr, fun, line, size;
+    char *name, buf[32];
+
+    if (trace_bf != bf) trace_start (bf);
+    if (offset < trace_from || offset > trace_to) return;
+
+    fun = trace_fun[offset];
+    if (trace_function != NULL && fun != trace_target) return;
+
+    if ((name = fun < 0 ? "" : public_name_at (bf, fun)) == NULL) {
+        snprintf (buf, sizeof (buf), "0x%08x", fun);
+        name = buf;
+    }
+
+    fprintf (trace_file, "0x%08x %s", offset, name);
+    if ((line = line_at (bf, offset)) != 0) fprintf (trace_file, ":%d", line);
+    fprintf (trace_file, " %s", opcode_name ((unsigned char) *ip, buf, sizeof (buf)));
+    size = instruction_size (ip);
+    for (int i = 1; i + (int) sizeof (int) <= size; i += sizeof (int)) {
+        fprintf (trace_file, " %d", *(int*) (ip + i));
+    }
+
+    trace_values ("stack", idx2StkId(L, L->base - stack_top), L->base - stack_top, -1);
+    if (L->ci->n_args > 0) trace_values ("args", loc2adr(L, (lama_Loc) {0, LOC_A}), L->ci->n_args, -1);
+    if (L->ci->n_locs > 0) trace_values ("locals", loc2adr(L, (lama_Loc) {0, LOC_L}), L->ci->n_locs, -1);
+    fputc ('\n', trace_file);
+}
+
+/* The template JIT (see jit.h), off while an instrumented loop, coverage
+   or sampling has to see every instruction */
+static bool jit_on = true;
+static _Thread_local jit_code *jit;
+
+/* Runs the compiled code of the instruction at L->ip, if there is any,
+   until it exits to the interpreter; the code may exit to call a
+   function, then ret_ip is where the call returns to */
+static void jit_enter (lama_State *L, bytefile *bf, char **ret_ip) {
+    void *entry = jit->entries[L->ip - bf->code_ptr];
+    lama_CallInfo *ci = L->ci;
+    jit_frame f;
+    int ret;
+
+    if (entry == NULL) return;
+
+    f.sp      = stack_top;
+    f.globals = stack_bottom;
+    f.locals  = L->base + ci->n_locs;
+    f.args    = L->base + (ci->n_caps + ci->n_args + ci->n_locs + 1);
+    f.limit   = L->stack_last + 2;
+
+    L->ip = bf->code_ptr + jit_run (jit, entry, &f, &ret);
+    set_gc_ptr(__gc_stack_top, f.sp);
+    if (ret >= 0) *ret_ip = bf->code_ptr + ret;
+}
+
+/* Runs the function at L->ip, whose arguments, closure and capture count
+   are on the stack, until it returns to the bottom frame. It is compiled
+   twice: the fast loop, and the instrumented one the profiler and the
+   tracer run in, so they cost nothing when they are off */
+static inline __attribute__((always_inline))
+void execute_loop (lama_State *L, bytefile *bf, char *fname, const bool instrumented) {
+
+#define INT (L->ip += sizeof (int), *(int*)(L->ip - sizeof (int)))
+#define BYTE *L->ip++
+#define STRING get_string (bf, INT)
+#define OPFAIL failure ("ERROR: invalid opcode %d-%d\n", h, l)
+#define profiling (instrumented && P != NULL)
+#define tracing (instrumented && trace_file != NULL)
+#define JIT_LOOP(addr) \
+    if (!instrumented && jit != NULL && bf->code_ptr + (addr) < op_ip) { jit_count(jit, addr); jit_enter(L, bf, &ret_ip); }
+
+    char *ret_ip = bf->code_stop_ptr;
+    profile_data *P = instrumented ? profile_state : NULL;
+
+    if (profiling) profile_start(P);
+
+    do {
+        if (tracing) trace_instruction(L, bf, L->ip);
+        char *op_ip = L->ip;
+        char x = BYTE, h = (x & 0xF0) >> 4, l = x & 0x0F;
+
+        if (profiling) profile_op(P, (unsigned char) x);
+        switch (h) {
+            case 15:
+                goto stop;
+            case 0: { //BINOP
+
+                aint nc = cast(aint, *idx2StkId(L, 1));
+                if(UNBOXED(nc)) nc = UNBOX(nc);
+                aint nb = cast(aint, *idx2StkId(L, 2));
+                if(UNBOXED(nb)) nb = UNBOX(nb);
+                lama_pop(L, 2);
+                switch (l) {
+                    case OP_ADD:    lama_pushnumber(L, lama_numadd(nb,nc)); break;
+                    case OP_SUB:    lama_pushnumber(L, lama_numsub(nb,nc)); break;
+                    case OP_MUL:    lama_pushnumber(L, lama_nummul(nb,nc)); break;
+                    case OP_DIV:    lama_pushnumber(L, lama_numdiv(nb,nc)); break;
+                    case OP_MOD:    lama_pushnumber(L, lama_nummod(nb,nc)); break;
+                    case OP_LT:     lama_pushnumber(L, lama_numlt(nb,nc));  break;
+                    case OP_LE:     lama_pushnumber(L, lama_numle(nb,nc));  break;
+                    case OP_GT:     lama_pushnumber(L, lama_numgt(nb,nc));  break;
+                    case OP_GE:     lama_pushnumber(L, lama_numge(nb,nc));  break;
+                    case OP_EQ:     lama_pushnumber(L, lama_numeq(nb,nc));  break;
+                    case OP_NEQ:    lama_pushnumber(L, lama_numneq(nb,nc)); break;
+                    case OP_AND:    lama_pushnumber(L, lama_numand(nb,nc)); break;
+                    case OP_OR:     lama_pushnumber(L, lama_numor(nb,nc));  break;
+                    default: OPFAIL;
+                }
+                break;
+            }
+            case 1:
+                switch (l) {
+                    case 0: //CONST
+
+                        lama_pushnumber(L, INT);
+                        break;
+                    case 1: //STRING
+
+                        lama_push(L, Bstring(STRING));
+                        break;
+                    case 2: { //SEXP
+
+                        aint tag = bf->tag_hash[INT];
+                        int n = INT;
+                        void* b = LmakeSexp(BOX(n + 1), tag);
+                        for (int i = 0; i < n; i++)
+                            cast(void**, b)[i] = *idx2StkId(L, n - i);
+                        lama_pop(L, n);
+                        lama_push(L, b);
+                        break;
+                    }
+                    case 3: //STI
+                        OPFAIL;
+                    case 4: { //STA
+
+                        StkId v = *idx2StkId(L, 1);
+                        aint i = cast(aint, *idx2StkId(L, 2));
+                        StkId x = *idx2StkId(L, 3);
+                        lama_pop(L, 3);
+                        lama_push(L, Bsta(v, i, x));
+                        break;
+                    }
+                    case 5: { //JMP
+
+                        int addr = INT;
+                        L->ip = bf->code_ptr + addr;
+                        JIT_LOOP(addr);
+                        break;
+                    }
+                    case 6: //END
+
+                        lama_end(L);
+                        if (profiling) profile_leave(P);
+                        TIMELINE(TIMELINE_LEAVE, 0, 0);
+                        if (!instrumented && jit != NULL) jit_enter(L, bf, &ret_ip);
+                        break;
+                    case 7: //RET
+                        OPFAIL;
+                    case 8: //DROP
+
+                        lama_pop(L, 1);
+                        break;
+                    case 9: //DUP
+
+                        lama_push(L, *idx2StkId(L, 1));
+                        break;
+                    case 10: { //SWAP
+
+                        swap(*idx2StkId(L, 1), *idx2StkId(L, 2));
+                        break;
+                    }
+                    case 11: { //ELEM
+
+                        aint i = cast(aint, *idx2StkId(L, 1));
                         void* p = *idx2StkId(L, 2);
                         lama_pop(L, 2);
                         lama_push(L, Belem(p, i));
@@ -612,14 +1857,12 @@ void eval (bytefile *bf, char *fname) {
                 }
                 break;
             case 2: { //LD
-                print_debug("LD");
 
                 lama_Loc loc = {INT, l};
                 lama_push(L, *loc2adr(L, loc));
                 break;
             }
             case 3: { //LDA
-                print_debug("LDA\n");
 
                 lama_Loc loc = {INT, l};
                 lama_push(L, loc2adr(L, loc));
@@ -627,7 +1870,6 @@ void eval (bytefile *bf, char *fname) {
                 break;
             }
             case 4: { //ST
-                print_debug("ST\n");
 
                 lama_Loc loc = {INT, l};
                 *loc2adr(L, loc) = *idx2StkId(L, 1);
@@ -636,38 +1878,45 @@ void eval (bytefile *bf, char *fname) {
             case 5:
                 switch (l) {
                     case 0: { //CJMPz
-                        print_debug("CJMPz\n");
 
-                        int n = lama_tonumber(L, 1);
+                        aint n = lama_tonumber(L, 1);
                         lama_pop(L, 1);
                         int addr = INT;
-                        if(n == 0) L->ip = bf->code_ptr + addr;
+                        if(n == 0) {
+                            L->ip = bf->code_ptr + addr;
+                            JIT_LOOP(addr);
+                        }
                         break;
                     }
                     case 1: { //CJMPnz
-                        print_debug("CJMPnz\n");
 
-                        int n = lama_tonumber(L, 1);
+                        aint n = lama_tonumber(L, 1);
                         lama_pop(L, 1);
                         int addr = INT;
-                        if(n != 0) L->ip = bf->code_ptr + addr;
+                        if(n != 0) {
+                            L->ip = bf->code_ptr + addr;
+                            JIT_LOOP(addr);
+                        }
                         break;
                     }
                     case 2: { //BEGIN
-                        print_debug("BEGIN\n");
 
-                        int n_caps = lama_tonumber(L, 2);
-                        check(n_caps == 0);
+                        check(lama_tonumber(L, 2) == 0); //n_caps
                         void *fun = *idx2StkId(L, 1);
                         if(lama_isdummy(L, 1)) fun = NULL;
 
                         lama_pop(L, 2);
                         int n_args = INT, n_locs = INT;
                         lama_begin(L, 0, n_args, n_locs, ret_ip, fun);
+                        if (profiling) profile_begin(P, bf, op_ip);
+                        TIMELINE(TIMELINE_ENTER, op_ip - bf->code_ptr, 0);
+                        if (!instrumented && jit != NULL) {
+                            jit_count(jit, op_ip - bf->code_ptr);
+                            jit_enter(L, bf, &ret_ip);
+                        }
                         break;
                     }
                     case 3: { //CBEGIN
-                        print_debug("CBEGIN\n");
 
                         int n_caps = lama_tonumber(L, 2);
                         void *fun = *idx2StkId(L, 1);
@@ -676,10 +1925,15 @@ void eval (bytefile *bf, char *fname) {
                         lama_pop(L, 2);
                         int n_args = INT, n_locs = INT;
                         lama_begin(L, n_caps, n_args, n_locs, ret_ip, fun);
+                        if (profiling) profile_begin(P, bf, op_ip);
+                        TIMELINE(TIMELINE_ENTER, op_ip - bf->code_ptr, 0);
+                        if (!instrumented && jit != NULL) {
+                            jit_count(jit, op_ip - bf->code_ptr);
+                            jit_enter(L, bf, &ret_ip);
+                        }
                         break;
                     }
                     case 4: { //CLOSURE
-                        print_debug("CLOSURE\n");
 
                         int func_offset = INT;
                         int n_caps = INT;
@@ -693,7 +1947,6 @@ void eval (bytefile *bf, char *fname) {
                         break;
                     }
                     case 5: { //CALLC
-                        print_debug("CALLC\n");
 
                         int n_args = INT;
                         void *fun = *idx2StkId(L, n_args + 1);
@@ -712,9 +1965,9 @@ void eval (bytefile *bf, char *fname) {
                         break;
                     }
                     case 6: { //CALL
-                        print_debug("CALL\n");
 
-                        int func_offset = INT, n_args = INT;
+                        int func_offset = INT;
+                        L->ip += sizeof (int); //n_args
                         char *func_ptr = bf->code_ptr + func_offset;
                         check(((*func_ptr & 0xF0) >> 4) == 5);
                         check((*func_ptr & 0x0F) == 2 || (*func_ptr & 0x0F) == 3);
@@ -725,22 +1978,19 @@ void eval (bytefile *bf, char *fname) {
                         break;
                     }
                     case 7: { //TAG
-                        print_debug("TAG\n");
 
-                        int t = LtagHash(STRING);
+                        aint t = bf->tag_hash[INT];
                         int n = INT;
                         *idx2StkId(L, 1) = cast(void*, Btag(*idx2StkId(L, 1), t, BOX(n)));
                         break;
                     }
                     case 8: { //ARRAY
-                        print_debug("ARRAY\n");
 
                         int n = INT;
                         *idx2StkId(L, 1) = cast(void*, Barray_patt(*idx2StkId(L, 1), BOX(n)));
                         break;
                     }
                     case 9: { //FAIL
-                        print_debug("FAIL\n");
 
                         int line = INT;
                         int col = INT;
@@ -750,7 +2000,15 @@ void eval (bytefile *bf, char *fname) {
                     }
                     case 10: { //LINE
                         int line = INT;
-                        print_debug("LINE %d\n", line);
+
+                        if (coverage_counts != NULL && (unsigned) line < (unsigned) coverage_lines) {
+                            coverage_counts[line]++;
+                        }
+
+                        if (line == snapshot_line && SNAPSHOT_POINT_SET
+                            && snapshot_point(L, bf, fname)) {
+                            goto stop;
+                        }
                         break;
                     }
                     default:
@@ -758,7 +2016,6 @@ void eval (bytefile *bf, char *fname) {
                 }
                 break;
             case 6: { //PATT
-                print_debug("PATT\n");
 
                 switch (l) {
                     case 0: //=str
@@ -789,29 +2046,30 @@ void eval (bytefile *bf, char *fname) {
                 break;
             }
             case 7: {
+                if (counters_on) counters_switch(COUNTERS_RUNTIME);
                 switch (l) {
                     case 0: // CALL Lread
-                        print_debug("Lread\n");
 
-                        lama_push(L, cast(void*, Lread()));
+                        TIMELINE(TIMELINE_IO_START, 0, 0);
+                        void *v = cast(void*, Lread());
+                        TIMELINE(TIMELINE_IO_END, 0, 0);
+                        lama_push(L, v);
                         break;
                     case 1: //CALL Lwrite
-                        print_debug("Lwrite\n");
 
-                        Lwrite(cast(int, *idx2StkId(L, 1)));
+                        TIMELINE(TIMELINE_IO_START, 1, 0);
+                        Lwrite(cast(aint, *idx2StkId(L, 1)));
+                        TIMELINE(TIMELINE_IO_END, 1, 0);
                         break;
                     case 2: //CALL Llength
-                        print_debug("Llength\n");
 
                         *idx2StkId(L, 1) = cast(void*, Blength(*idx2StkId(L, 1)));
                         break;
                     case 3: //CALL Lstring
-                        print_debug("Lstring\n");
 
                         *idx2StkId(L, 1) = Bstringval(*idx2StkId(L, 1));
                         break;
                     case 4: { //CALL Barray
-                        print_debug("Barray\n");
 
                         int n = INT;
                         void *p = LmakeArray(BOX(n));
@@ -821,9 +2079,27 @@ void eval (bytefile *bf, char *fname) {
                         lama_push(L, p);
                         break;
                     }
+                    case 5: { //CALL native
+                        const native *nat = &natives[bf->native_index[INT] - 1];
+                        int n = INT;
+                        void *args[NATIVE_MAX_ARGS];
+
+                        for (int i = 0; i < n; i++)
+                            args[i] = *idx2StkId(L, n - i);
+                        void *r = call_native(nat, args, n);
+                        lama_pop(L, n);
+                        lama_push(L, r);
+
+                        if (snapshot_due) {
+                            snapshot_due = false;
+                            if (snapshot_point(L, bf, fname)) goto stop;
+                        }
+                        break;
+                    }
                     default:
                         OPFAIL;
                 }
+                if (counters_on) counters_switch(COUNTERS_INTERPRETER);
                 break;
             }
             default:
@@ -832,14 +2108,477 @@ void eval (bytefile *bf, char *fname) {
     }
     while (true);
     stop:
-    free(L->stack_last + 1);
-    free(L->end_ci + 1);
+    if (profiling) profile_stop(P);
+}
+
+static void execute_instrumented (lama_State *L, bytefile *bf, char *fname) {
+    execute_loop (L, bf, fname, true);
+}
+
+static void execute (lama_State *L, bytefile *bf, char *fname) {
+    if (profile_state != NULL || trace_file != NULL) {
+        execute_instrumented (L, bf, fname);
+        return;
+    }
+
+    execute_loop (L, bf, fname, false);
+}
+
+/* The embedding API, see lamai.h */
+struct lamai_program {
+    bytefile *bf;
+    char     *fname;
+};
+
+struct lamai {
+    bytefile      *bf;
+    char          *fname;
+    lama_State    *L;
+    lamai_program *owned;          /* The program loaded by lamai_open, if any */
+    void          *snapshot;       /* The snapshot restored, which holds fname */
+    size_t         snapshot_size;
+};
+
+static _Thread_local lamai *lamai_opened = NULL;
+
+/* Calls the function at ip with the arguments on top of the stack */
+static void lamai_call_at (lamai *vm, char *ip) {
+    lama_State *L = vm->L;
+
+    lama_pushnumber(L, 0); //n_caps
+    lama_pushdummy(L);
+    L->ip = ip;
+    execute (L, vm->bf, vm->fname);
+}
+
+/* Loads a program leaving the LINEs given by kept in its code */
+static lamai_program* load_program (char *fname, int kept) {
+    lamai_program *p = (lamai_program*) malloc (sizeof (lamai_program));
+
+    if (p == 0) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    p->fname = fname;
+    p->bf = read_file (fname);
+    load_prepared (p->bf, fname, kept);
+
+    return p;
+}
+
+/* Coverage counts every LINE, the offsets of a trace are those of the
+   file, and a snapshot point may be a LINE */
+lamai_program* lamai_load (char *fname) {
+    return load_program (fname, coverage_path != NULL || trace_path != NULL ? KEEP_ALL_LINES
+                                : SNAPSHOT_POINT_SET ? snapshot_line : 0);
+}
+
+void lamai_unload (lamai_program *p) {
+    close_file (p->bf);
+    free (p);
+}
+
+void lamai_set_snapshot (char *path, int line) {
+    snapshot_path = path;
+    snapshot_line = line;
+}
+
+void lamai_set_profile (bool table, char *json_path) {
+    profile_table = table;
+    profile_json  = json_path;
+}
+
+void lamai_set_sampling (char *path, int rate) {
+    sample_path = path;
+    sample_rate = rate > 0 && rate <= 1000000 ? rate : 1000;
+}
+
+void lamai_set_coverage (char *path) {
+    coverage_path = path;
+}
+
+void lamai_set_stats (char *path) {
+    stats_path = path;
+}
+
+void lamai_set_timeline (char *path) {
+    timeline_path = path;
+}
+
+void lamai_set_trace (char *path, char *function, int from, int to) {
+    trace_path     = path;
+    trace_function = function;
+    trace_from     = from;
+    trace_to       = to;
+}
+
+void lamai_set_census (char *path) {
+    census_path = path;
+}
+
+void lamai_set_perf_counters (bool on) {
+    counters_on = on;
+}
+
+void lamai_set_cache (bool on) {
+    cache_on = on;
+}
+
+void lamai_set_jit (bool on, int threshold) {
+    jit_on = on;
+    if (threshold > 0) jit_threshold = threshold;
+}
+
+void lamai_set_snapshot_hook (void (*hook) (void), int line) {
+    snapshot_hook = hook;
+    snapshot_line = line;
+}
+
+/* Follows the failures of the interpreter of the thread with the line
+   of the instruction being executed */
+static void failure_location (void) {
+    lamai *vm = lamai_opened;
+    int line;
+
+    if (vm == NULL || vm->L->ip <= vm->bf->code_ptr || vm->L->ip > vm->bf->code_stop_ptr + 1) return;
+
+    if ((line = line_at (vm->bf, vm->L->ip - 1 - vm->bf->code_ptr)) != 0) {
+        fprintf (stderr, "*** at %s:%d\n", vm->fname, line);
+    }
 }
 
-int main (int argc, char* argv[]) {
-    bytefile *f = read_file (argv[1]);
-    eval (f, argv[1]);
-    free(f->global_ptr);
-    free(f);
-    return 0;
-}
\ No newline at end of file
+/* Opens an interpreter of p in the calling thread without running main */
+static lamai* lamai_new (lamai_program *p) {
+    lamai *vm;
+    lama_State *L = &eval_state;
+
+    if (lamai_opened != NULL) {
+        failure ("lamai_open: only one interpreter per thread can be open at a time\n");
+    }
+
+    vm = (lamai*) malloc (sizeof (lamai));
+
+    if (vm == 0) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    lamai_opened = vm;
+    set_failure_location (failure_location);
+    vm->fname = p->fname;
+    vm->bf = p->bf;
+    vm->L = L;
+    vm->owned = NULL;
+    vm->snapshot = NULL;
+    snapshot_due = snapshot_reached = false;
+    lama_open (L, vm->bf);
+
+    if ((profile_table || profile_json != NULL) && profile_state == NULL) {
+        static bool registered = false;
+
+        profile_state = profile_new (p->bf->code_stop_ptr + 1 - p->bf->code_ptr);
+        if (!registered) atexit (profile_at_exit);
+        registered = true;
+    }
+
+    if (sample_path != NULL) {
+        static bool registered = false;
+
+        sample_start (p->bf);
+        if (!registered) atexit (sample_write);
+        registered = true;
+    }
+
+    if (coverage_path != NULL && coverage_counts == NULL) {
+        coverage_start (p->bf, p->fname);
+        atexit (coverage_write);
+    }
+
+    if (stats_path != NULL && stats_start == 0) {
+        stats_start = now_ns ();
+        atexit (stats_write);
+    }
+
+    if (counters_on) {
+        static bool opened = false;
+
+        if (!opened && counters_open ()) atexit (counters_at_exit);
+        else if (!opened) counters_on = false;
+        opened = true;
+    }
+
+    if (timeline_path != NULL) {
+        static bool registered = false;
+
+        timeline_bf = p->bf;
+        timeline_open (timeline_path, timeline_function_name);
+        if (!registered) atexit (timeline_write);
+        registered = true;
+    }
+
+    if (trace_path != NULL && trace_file == NULL) {
+        if (strcmp (trace_path, "-") == 0) trace_file = stderr;
+        else if ((trace_file = fopen (trace_path, "w")) == NULL) {
+            failure ("%s: %s\n", trace_path, strerror (errno));
+        }
+    }
+
+    if (census_path != NULL) {
+        if (census_file == NULL && (census_file = fopen (census_path, "w")) == NULL) {
+            failure ("%s: %s\n", census_path, strerror (errno));
+        }
+        if (census_data == NULL && (census_data = (gc_census*) malloc (sizeof (gc_census))) == NULL) {
+            failure ("*** FAILURE: unable to allocate memory.\n");
+        }
+        set_gc_census (census_data);
+    }
+
+    if (counters_on || timeline_path != NULL || census_path != NULL) set_gc_hook (gc_event);
+
+    if (jit_on && coverage_path == NULL && sample_path == NULL) {
+        jit = jit_new (p->bf->code_ptr, p->bf->code_stop_ptr + 1 - p->bf->code_ptr,
+                       p->bf->string_ptr, p->bf->tag_hash, L->n_globals,
+                       SNAPSHOT_POINT_SET ? snapshot_line : 0,
+                       !counters_on && timeline_path == NULL, &L->ip);
+    }
+
+    return vm;
+}
+
+/* main has returned its result, which is dropped, or has stopped at the
+   snapshot point */
+static void lamai_main_done (lamai *vm) {
+    if (snapshot_reached && snapshot_hook == NULL) return;
+
+    if (!snapshot_reached && SNAPSHOT_POINT_SET) {
+        failure ("%s: the program ended before the snapshot point\n", vm->fname);
+    }
+
+    lama_pop(vm->L, 1);
+}
+
+lamai* lamai_start (lamai_program *p) {
+    lamai *vm = lamai_new (p);
+    lama_State *L = vm->L;
+
+    /* main takes two arguments */
+    lama_pushnumber(L, 0);
+    lama_pushnumber(L, 0);
+    lamai_call_at (vm, vm->bf->code_ptr);
+    lamai_main_done (vm);
+
+    return vm;
+}
+
+lamai* lamai_restore (char *path) {
+    int fd = open (path, O_RDONLY);
+    struct stat st;
+    snapshot_header *h;
+    lamai_program *p;
+    lamai *vm;
+    lama_State *L;
+    char *fname;
+    size_t *image;
+    StkId old_bottom, old_last, slots;
+    lama_CallInfo *cis;
+    ptrdiff_t code_delta, heap_delta, stack_delta;
+    unsigned char *reloc;
+
+    if (fd == -1 || fstat (fd, &st) == -1) {
+        failure ("%s: %s\n", path, strerror (errno));
+    }
+
+    h = (snapshot_header*) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (h == MAP_FAILED) {
+        failure ("%s: %s\n", path, strerror (errno));
+    }
+
+    if ((size_t) st.st_size < sizeof (snapshot_header)
+        || memcmp (h->magic, SNAPSHOT_MAGIC, sizeof (h->magic)) != 0
+        || h->word_size != sizeof (aint)
+        || (size_t) st.st_size != SNAPSHOT_SIZE(h)
+        || h->stack_used > h->stack_size || h->ci_used == 0 || h->ci_used > h->ci_size
+        || h->base > h->stack_used) {
+        failure ("%s: not a snapshot\n", path);
+    }
+
+    fname = (char*) (h + 1);
+    image = (size_t*) (fname + h->path_size);
+    slots = (StkId) (image + h->heap_words);
+    cis   = (lama_CallInfo*) (slots + h->stack_used);
+    reloc = (unsigned char*) (cis + h->ci_used);
+
+    p = load_program (fname, h->kept_line);
+
+    if (p->bf->map_size != h->file_size
+        || fnv1a ((const unsigned char*) p->bf->map, p->bf->map_size) != h->file_hash
+        || h->ip >= (uint64_t) (p->bf->code_stop_ptr - p->bf->code_ptr) + 1) {
+        failure ("%s: %s has changed since the snapshot\n", path, fname);
+    }
+
+    vm = lamai_new (p);
+    vm->owned = p;
+    vm->snapshot = h;
+    vm->snapshot_size = st.st_size;
+    L = vm->L;
+
+    code_delta = p->bf->code_ptr - (char*) (uintptr_t) h->code_ptr;
+    heap_delta = (char*) __heap_restore (image, reloc, h->heap_words,
+                                         (size_t*) (uintptr_t) h->heap_begin, code_delta)
+                 - (char*) (uintptr_t) h->heap_begin;
+
+    /* The stacks are relocated the way lama_reallocstack does it */
+    if ((int) h->stack_size > L->stacksize) lama_reallocstack(L, h->stack_size);
+    if ((int) h->ci_used >= L->size_ci) lama_reallocCI(L, h->ci_size);
+
+    old_bottom  = (StkId) (uintptr_t) h->stack_end;
+    old_last    = old_bottom - h->stack_size;
+    stack_delta = (char*) stack_bottom - (char*) old_bottom;
+
+    set_gc_ptr(__gc_stack_top, stack_bottom - h->stack_used);
+    memcpy(stack_top + 1, slots, h->stack_used * sizeof(void*));
+
+    StkId st_ptr;
+    foreach_stack(st_ptr) {
+        char *v = cast(char*, *st_ptr);
+
+        if (UNBOXED(v)) continue;
+        if (old_last < cast(StkId, v) && cast(StkId, v) <= old_bottom) {
+            *st_ptr = v + stack_delta;
+        } else if ((char*) (uintptr_t) h->heap_begin < v
+                   && v <= (char*) (uintptr_t) h->heap_begin + h->heap_words * sizeof (size_t)) {
+            *st_ptr = v + heap_delta;
+        }
+    }
+
+    L->ci = L->base_ci - (h->ci_used - 1);
+    memcpy(L->ci, cis, h->ci_used * sizeof(lama_CallInfo));
+
+    lama_CallInfo *ci_ptr;
+    foreach_ci(L, ci_ptr) {
+        ci_ptr->base = cast(StkId, cast(char*, ci_ptr->base) + stack_delta);
+        ci_ptr->ret_ip += code_delta;
+    }
+
+    L->base = stack_bottom - h->base;
+    L->ip = p->bf->code_ptr + h->ip;
+
+    execute (L, vm->bf, vm->fname);
+    lamai_main_done (vm);
+
+    return vm;
+}
+
+lamai* lamai_open (char *fname) {
+    lamai_program *p = lamai_load (fname);
+    lamai *vm = lamai_start (p);
+
+    vm->owned = p;
+    return vm;
+}
+
+lamai* lamai_current (void) {
+    return lamai_opened;
+}
+
+void lamai_close (lamai *vm) {
+    if (sampling) sample_write ();
+    if (timeline_bf == vm->bf) {
+        timeline_write ();
+        timeline_bf = NULL;
+    }
+    flush_output ();
+    lama_close (vm->L);
+    __gc_stack_top = __gc_stack_bottom = 0;
+    __shutdown ();
+    if (vm->owned != NULL) lamai_unload (vm->owned);
+    if (vm->snapshot != NULL) munmap (vm->snapshot, vm->snapshot_size);
+    free (vm);
+    lamai_opened = NULL;
+    set_failure_location (NULL);
+    set_gc_hook (NULL);
+    set_gc_census (NULL);
+    trace_bf = NULL;
+    if (jit != NULL) jit_free (jit);
+    jit = NULL;
+}
+
+int lamai_call (lamai *vm, const char *name, int n_args) {
+    bytefile *bf = vm->bf;
+    lama_State *L = vm->L;
+
+    if (n_args < 0 || n_args > L->base - stack_top) return -1;
+
+    for (int i = 0; i < bf->public_symbols_number; i++) {
+        if (strcmp (get_public_name (bf, i), name) == 0) {
+            char *ip = bf->code_ptr + get_public_offset (bf, i);
+            char op = *ip;
+
+            if (((op & 0xF0) >> 4) != 5 || ((op & 0x0F) != 2 && (op & 0x0F) != 3)
+                || *(int*) (ip + 1) != n_args) {
+                return -1;
+            }
+
+            lamai_call_at (vm, ip);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int lamai_gettop (lamai *vm) {
+    lama_State *L = vm->L;
+
+    return L->base - stack_top;
+}
+
+void lamai_pop (lamai *vm, int n) {
+    lama_State *L = vm->L;
+
+    lama_pop(L, n);
+}
+
+void lamai_pushint (lamai *vm, aint n) {
+    lama_State *L = vm->L;
+
+    lama_pushnumber(L, n);
+}
+
+void lamai_pushstring (lamai *vm, const char *s) {
+    lama_State *L = vm->L;
+    void *p = Bstring ((void*) s);
+
+    lama_push(L, p);
+}
+
+void lamai_pushvalue (lamai *vm, int idx) {
+    lama_State *L = vm->L;
+    void *p = *idx2StkId(L, idx);
+
+    lama_push(L, p);
+}
+
+void* lamai_tovalue (lamai *vm, int idx) {
+    return *idx2StkId(vm->L, idx);
+}
+
+bool lamai_isint (lamai *vm, int idx) {
+    return ttisnumber(lamai_tovalue (vm, idx));
+}
+
+aint lamai_toint (lamai *vm, int idx) {
+    void *p = lamai_tovalue (vm, idx);
+
+    return UNBOXED(p) ? UNBOX(p) : 0;
+}
+
+char* lamai_tostring (lamai *vm, int idx) {
+    void *p = lamai_tovalue (vm, idx);
+
+    if (!ttisstring(p)) return NULL;
+
+    /* A rope keeps its flat copy, so the result lives as long as p */
+    return (char*) Bflatten (p);
+}
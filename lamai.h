@@ -0,0 +1,126 @@
+#ifndef LAMAI_H
+#define LAMAI_H
+
+# include <stdbool.h>
+
+# include "runtime/runtime.h"
+
+/* Embedding API of the interpreter.
+
+   lamai_open maps and prepares a bytecode file and runs its main, which
+   initializes the globals; after that the public functions of the file
+   can be called any number of times. Values are passed through a stack
+   scanned by the GC, as in Lua: push the arguments, call, read the result
+   on top and pop it. Stack indices count from the top, 1 is the topmost
+   value. Pointers returned by lamai_tostring are valid while the value is
+   on the stack and no other call to the interpreter allocates.
+
+   Every thread can have one open interpreter. The interpreter and runtime
+   state is thread-local, so interpreters opened by different threads are
+   independent isolates with their own heaps and can run in parallel.
+   A loaded program is read-only and can be shared by the threads: each of
+   them starts its own interpreter of it with lamai_start.
+
+   Runtime errors terminate the process, unless the thread has set a
+   failure handler (see runtime.h): then the error jumps to the handler,
+   which should close lamai_current () before opening another one. */
+typedef struct lamai lamai;
+typedef struct lamai_program lamai_program;
+
+lamai* lamai_open (char *fname);
+void lamai_close (lamai *vm);
+
+lamai_program* lamai_load (char *fname);
+void lamai_unload (lamai_program *p);
+lamai* lamai_start (lamai_program *p);
+
+/* The interpreter open in the calling thread, or NULL */
+lamai* lamai_current (void);
+
+/* Makes lamai_open and lamai_start stop the program at the snapshot point
+   (the LINE instruction of line, or a call of the snapshot native) and
+   save its state to path; lamai_restore opens an interpreter continuing
+   from a saved snapshot, with the snapshot native returning 1 */
+void lamai_set_snapshot (char *path, int line);
+lamai* lamai_restore (char *path);
+
+/* Makes the program call hook at the snapshot point instead, and go on
+   after it returns */
+void lamai_set_snapshot_hook (void (*hook) (void), int line);
+
+/* Profiles the execution of the interpreters started after the call, and
+   reports the profile of the main thread at exit: the table to stderr if
+   table is set, the JSON to json_path if it is not NULL */
+void lamai_set_profile (bool table, char *json_path);
+
+/* Samples the call stacks of the interpreter started next in the process
+   rate times a second of the CPU time of its thread (SIGPROF sent to that
+   thread only), and writes them to path as folded stacks when it is
+   closed or at exit */
+void lamai_set_sampling (char *path, int rate);
+
+/* Counts the executions of every source line (the LINE instructions) and
+   writes them to path in the lcov format at exit, printing the hottest
+   lines to stderr */
+void lamai_set_coverage (char *path);
+
+/* Writes the time of the run, the number and the time of collections and
+   the peak RSS to path as JSON at exit */
+void lamai_set_stats (char *path);
+
+/* Counts cycles, instructions, branch and cache misses with the hardware
+   counters, split between the interpreter, the collector and the builtins,
+   and prints them to stderr at exit; the counters the machine does not
+   have are left out */
+void lamai_set_perf_counters (bool on);
+
+/* Records the calls, the collections, the growth of the heap and of the
+   stacks and the I/O builtins in a ring buffer and writes the last of
+   them to path in the Chrome trace event format at exit or on SIGINT and
+   SIGTERM */
+void lamai_set_timeline (char *path);
+
+/* Appends a census of the live objects to path after every collection:
+   their number and size by kind and, for sexps, by constructor */
+void lamai_set_census (char *path);
+
+/* Writes every instruction executed to path ("-" for stderr) before it is
+   executed: its offset, function, line and operands, the operand stack,
+   the arguments and the locals. Only the offsets from from to to and, if
+   function is not NULL, the public function of that name are traced. The
+   interpreter runs an instrumented copy of its loop while tracing */
+void lamai_set_trace (char *path, char *function, int from, int to);
+
+/* Compiles a function to machine code on its threshold-th call (if
+   threshold is positive, 1000 by default) unless on is false; the code
+   exits to the interpreter for what it has no template for. It is off
+   while profiling, tracing, sampling or counting coverage */
+void lamai_set_jit (bool on, int threshold);
+
+/* Keeps the prepared form of loaded bytecode files in $LAMAI_CACHE_DIR
+   (by default $XDG_CACHE_HOME/lamai or ~/.cache/lamai) under the hash of
+   their contents, and maps it instead of preparing an unchanged file
+   again; on by default */
+void lamai_set_cache (bool on);
+
+/* Reports an error the way runtime errors are reported */
+void failure (char *s, ...);
+
+/* Calls a public function with the n_args values on top of the stack,
+   replacing them by its result; returns -1 if there is no such function
+   or it takes a different number of arguments */
+int lamai_call (lamai *vm, const char *name, int n_args);
+
+int lamai_gettop (lamai *vm);
+void lamai_pop (lamai *vm, int n);
+
+void lamai_pushint (lamai *vm, aint n);
+void lamai_pushstring (lamai *vm, const char *s);
+void lamai_pushvalue (lamai *vm, int idx);
+
+void* lamai_tovalue (lamai *vm, int idx);
+bool lamai_isint (lamai *vm, int idx);
+aint lamai_toint (lamai *vm, int idx);
+char* lamai_tostring (lamai *vm, int idx);
+
+#endif //LAMAI_H
@@ -0,0 +1,181 @@
+/* Lama SM Bytecode interpreter: the command line */
+
+# include <string.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdbool.h>
+# include <limits.h>
+# include <unistd.h>
+
+# include "lamai.h"
+# include "batch.h"
+# include "serve.h"
+
+static const char usage[] =
+    "Usage: lamai [options] <file.bc>\n"
+    "       lamai [options] --batch <dir> <file.bc> <input>...\n"
+    "       lamai [options] --restore <snapshot>\n"
+    "       lamai [options] --serve <socket> <file.bc>\n"
+    "  --line-buffered    flush the output after every line\n"
+    "  --interactive      prompt before every read (default if stdin is a terminal)\n"
+    "  --non-interactive  read without prompts (default otherwise)\n"
+    "  --batch <dir>      run the file on every input, writing the outputs to dir\n"
+    "  --jobs <n>         the number of parallel batch runs (default: the number of CPUs)\n"
+    "  --snapshot <file>  stop at the snapshot point and save the state to file\n"
+    "  --snapshot-line <n>  the snapshot point is line n (default: the snapshot native)\n"
+    "  --restore <file>   continue from a snapshot\n"
+    "  --serve <socket>   run to the snapshot point, then fork a copy going on from it\n"
+    "                     for every connection to the socket\n"
+    "  --profile          print the counts and cycles of opcodes and functions at exit\n"
+    "  --profile-json <file>  write them to file as JSON\n"
+    "  --sample <file>    sample the call stacks and write them to file as folded stacks\n"
+    "  --sample-rate <n>  the number of samples per second of CPU time (default 1000)\n"
+    "  --coverage <file>  count the executions of every line and write them to file (lcov)\n"
+    "  --stats <file>     write the time, the collections and the peak RSS to file (JSON)\n"
+    "  --timeline <file>  write a timeline of the calls, collections and stack growth to file\n"
+    "                     (Chrome trace events)\n"
+    "  --trace <file>     write every instruction executed with the stack and the frame to\n"
+    "                     file (- for stderr)\n"
+    "  --trace-function <name>  trace only the instructions of the public function name\n"
+    "  --trace-range <from>:<to>  trace only the instructions at these offsets\n"
+    "  --census <file>    write the live objects by kind and constructor to file after every\n"
+    "                     collection\n"
+    "  --perf-counters    print the hardware counters of the interpreter, the collector and\n"
+    "                     the builtins at exit\n"
+    "  --no-jit           interpret every function, without compiling the hot ones\n"
+    "  --jit-threshold <n>  compile a function on its nth call (default 1000)\n"
+    "  --no-cache         do not use the cache of prepared bytecode\n"
+    "  --heap <MiB>       the initial size of the heap semispaces (default: 256M words)\n";
+
+int main (int argc, char* argv[]) {
+    char *fname = NULL;
+    char *outdir = NULL;
+    char **inputs = (char**) malloc(argc * sizeof(char*));
+    int n_inputs = 0;
+    int jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char *snapshot = NULL, *restore = NULL, *serve_path = NULL;
+    int snapshot_line = 0;
+    bool profile = false;
+    char *profile_json = NULL;
+    char *sample = NULL;
+    int sample_rate = 1000;
+    char *coverage = NULL;
+    char *stats = NULL;
+    bool perf_counters = false;
+    char *timeline = NULL;
+    char *census = NULL;
+    char *trace = NULL, *trace_function = NULL;
+    long trace_from = 0, trace_to = INT_MAX;
+    bool jit = true;
+    bool cache = true;
+    int jit_threshold = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--line-buffered") == 0) {
+            set_output_line_buffered(true);
+        } else if (strcmp(argv[i], "--interactive") == 0) {
+            set_input_interactive(true);
+        } else if (strcmp(argv[i], "--non-interactive") == 0) {
+            set_input_interactive(false);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            outdir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot-line") == 0 && i + 1 < argc) {
+            snapshot_line = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profile_json = argv[++i];
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample = argv[++i];
+        } else if (strcmp(argv[i], "--sample-rate") == 0 && i + 1 < argc) {
+            sample_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) {
+            coverage = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats = argv[++i];
+        } else if (strcmp(argv[i], "--timeline") == 0 && i + 1 < argc) {
+            timeline = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (strcmp(argv[i], "--trace-function") == 0 && i + 1 < argc) {
+            trace_function = argv[++i];
+        } else if (strcmp(argv[i], "--trace-range") == 0 && i + 1 < argc) {
+            char *end;
+
+            trace_from = strtol(argv[++i], &end, 0);
+            trace_to = *end == ':' ? strtol(end + 1, &end, 0) : -1;
+            if (*end != 0 || trace_from < 0 || trace_to < trace_from) {
+                fputs(usage, stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--census") == 0 && i + 1 < argc) {
+            census = argv[++i];
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf_counters = true;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jit = false;
+        } else if (strcmp(argv[i], "--jit-threshold") == 0 && i + 1 < argc) {
+            jit_threshold = atoi(argv[++i]);
+            if (jit_threshold <= 0) {
+                fputs(usage, stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            cache = false;
+        } else if (strcmp(argv[i], "--heap") == 0 && i + 1 < argc) {
+            set_heap_size((size_t) atol(argv[++i]) * 1024 * 1024 / sizeof(size_t));
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            fputs(usage, stderr);
+            return 1;
+        } else if (fname == NULL) {
+            fname = argv[i];
+        } else {
+            inputs[n_inputs++] = argv[i];
+        }
+    }
+    if ((fname == NULL) == (restore == NULL) || (outdir == NULL) != (n_inputs == 0)
+        || (outdir != NULL && (snapshot != NULL || profile || profile_json != NULL || sample != NULL
+                               || coverage != NULL || perf_counters
+                               || timeline != NULL || census != NULL || trace != NULL))
+        || (serve_path != NULL && (fname == NULL || outdir != NULL || snapshot != NULL))) {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    if (profile || profile_json != NULL) lamai_set_profile(profile, profile_json);
+    if (sample != NULL) lamai_set_sampling(sample, sample_rate);
+    if (coverage != NULL) lamai_set_coverage(coverage);
+    if (stats != NULL) lamai_set_stats(stats);
+    if (perf_counters) lamai_set_perf_counters(true);
+    if (timeline != NULL) lamai_set_timeline(timeline);
+    if (census != NULL) lamai_set_census(census);
+    if (trace != NULL) lamai_set_trace(trace, trace_function, (int) trace_from, (int) trace_to);
+    lamai_set_jit(jit, jit_threshold);
+    lamai_set_cache(cache);
+
+    if (serve_path != NULL) {
+        return run_server (fname, serve_path, snapshot_line);
+    }
+
+    if (snapshot != NULL) lamai_set_snapshot(snapshot, snapshot_line);
+
+    if (restore != NULL) {
+        lamai_close (lamai_restore (restore));
+        return 0;
+    }
+
+    if (outdir != NULL) {
+        return run_batch (fname, outdir, inputs, n_inputs, jobs) == 0 ? 0 : 1;
+    }
+
+    lamai_close (lamai_open (fname));
+    return 0;
+}
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Runs the benchmarks under lamai and compares them against a baseline.
+
+Every benchmark runs --runs times; the report has the median and the
+minimal wall time, the instructions retired (when perf is available), the
+number and the time of collections and the peak RSS. With --baseline the
+medians are compared against a file written earlier with --save, and the
+exit status is 1 if any benchmark is slower by more than --threshold
+percent.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def run_once(lamai, bc, heap, perf, tmp):
+    stats = os.path.join(tmp, "stats.json")
+    counters = os.path.join(tmp, "perf.txt")
+    cmd = [lamai, "--stats", stats, "--heap", str(heap), bc]
+    if perf:
+        cmd = [perf, "stat", "-x", ",", "-e", "instructions:u", "-o", counters] + cmd
+
+    start = time.perf_counter()
+    with open(os.devnull, "rb") as stdin, open(os.devnull, "wb") as stdout:
+        proc = subprocess.Popen(cmd, stdin=stdin, stdout=stdout)
+        _, status, rusage = os.wait4(proc.pid, 0)
+    wall = (time.perf_counter() - start) * 1e3
+
+    if os.waitstatus_to_exitcode(status) != 0:
+        sys.exit("%s: lamai exited with %d" % (bc, os.waitstatus_to_exitcode(status)))
+
+    with open(stats) as f:
+        result = json.load(f)
+    result["wall_ms"] = wall
+    result["max_rss_kb"] = max(result.get("max_rss_kb", 0), rusage.ru_maxrss)
+
+    if perf:
+        with open(counters) as f:
+            for line in f:
+                fields = line.strip().split(",")
+                if len(fields) > 2 and fields[2].startswith("instructions") and fields[0].isdigit():
+                    result["instructions"] = int(fields[0])
+    return result
+
+
+def run_benchmark(lamai, bc, runs, heap, perf):
+    with tempfile.TemporaryDirectory() as tmp:
+        results = [run_once(lamai, bc, heap, perf, tmp) for _ in range(runs)]
+
+    walls = [r["wall_ms"] for r in results]
+    median = statistics.median(walls)
+    typical = min(results, key=lambda r: abs(r["wall_ms"] - median))
+
+    return {
+        "median_ms": round(median, 3),
+        "min_ms": round(min(walls), 3),
+        "instructions": typical.get("instructions"),
+        "gc_count": typical["gc_count"],
+        "gc_ms": typical["gc_ms"],
+        "max_rss_kb": max(r["max_rss_kb"] for r in results),
+    }
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("benchmarks", nargs="*",
+                        help="bytecode files (default: the .bc of every .lama next to this script)")
+    parser.add_argument("--lamai", default=os.path.join(here, "..", "build", "lamai"))
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--heap", type=int, default=16, help="the initial heap in MiB (default 16)")
+    parser.add_argument("--baseline", help="the results to compare against")
+    parser.add_argument("--save", help="write the results to this file")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="the slowdown in percent that fails the comparison (default 5)")
+    parser.add_argument("--no-perf", action="store_true", help="do not count instructions with perf")
+    args = parser.parse_args()
+
+    benchmarks = args.benchmarks or sorted(
+        os.path.join(here, f[:-len(".lama")] + ".bc") for f in os.listdir(here) if f.endswith(".lama"))
+    perf = None if args.no_perf else shutil.which("perf")
+
+    baseline = {}
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    print("%-12s %10s %10s %14s %6s %9s %9s %9s" %
+          ("benchmark", "median ms", "min ms", "instructions", "gcs", "gc ms", "rss MiB", "baseline"))
+
+    results, regressions = {}, []
+    for bc in benchmarks:
+        name = os.path.splitext(os.path.basename(bc))[0]
+        r = results[name] = run_benchmark(args.lamai, bc, args.runs, args.heap, perf)
+
+        change = ""
+        if name in baseline:
+            delta = 100.0 * (r["median_ms"] / baseline[name]["median_ms"] - 1)
+            change = "%+.1f%%" % delta
+            if delta > args.threshold:
+                regressions.append(name)
+                change += " !"
+
+        print("%-12s %10.1f %10.1f %14s %6d %9.1f %9.1f %9s" %
+              (name, r["median_ms"], r["min_ms"],
+               "-" if r["instructions"] is None else r["instructions"],
+               r["gc_count"], r["gc_ms"], r["max_rss_kb"] / 1024, change))
+        sys.stdout.flush()
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    if regressions:
+        print("slower than the baseline by more than %g%%: %s" % (args.threshold, " ".join(regressions)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
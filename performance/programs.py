@@ -0,0 +1,387 @@
+# The benchmarks in bytecode, compiled by hand from the .lama next to
+# them in the shape lamac gives its code (see the regression tests):
+# makeArray and ++ are functions of Std.i, which only the CALL native
+# instruction (0x75 <name> <n_args>) reaches from bytecode, so lamac -b
+# cannot build arrays.lama and strings.lama for lamai.
+# "python3 programs.py" writes the .bc files.
+
+import struct
+
+
+def ints(*xs):
+    return b"".join(struct.pack("<i", x) for x in xs)
+
+
+BINOPS = ["+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"]
+LOCS = "GLAC"
+
+
+class Program:
+    def __init__(self, n_globals):
+        self.n_globals = n_globals
+        self.strings = bytearray()
+        self.positions = {}
+        self.code = bytearray()
+        self.labels = {}
+        self.fixups = []
+        self.n_labels = 0
+
+    def string(self, s):
+        if s not in self.positions:
+            self.positions[s] = len(self.strings)
+            self.strings += s.encode() + b"\0"
+        return self.positions[s]
+
+    def op(self, opcode, *operands):
+        self.code += bytes([opcode]) + ints(*operands)
+
+    def new_label(self):
+        self.n_labels += 1
+        return "L%d" % self.n_labels
+
+    def label(self, name):
+        self.labels[name] = len(self.code)
+
+    def target(self, name):
+        self.fixups.append((len(self.code), name))
+        self.code += ints(0)
+
+    def jump(self, opcode, name):
+        self.code.append(opcode)
+        self.target(name)
+
+    def binop(self, o):    self.op(BINOPS.index(o) + 1)
+    def const(self, n):    self.op(0x10, n)
+    def sconst(self, s):   self.op(0x11, self.string(s))
+    def sexp(self, t, n):  self.op(0x12, self.string(t), n)
+    def sta(self):         self.op(0x14)
+    def end(self):         self.op(0x16)
+    def drop(self):        self.op(0x18)
+    def dup(self):         self.op(0x19)
+    def elem(self):        self.op(0x1B)
+    def ld(self, x):       self.op(0x20 + LOCS.index(x[0]), int(x[1:]))
+    def st(self, x):       self.op(0x40 + LOCS.index(x[0]), int(x[1:]))
+    def begin(self, a, l): self.op(0x52, a, l)
+    def cbegin(self, a, l): self.op(0x53, a, l)
+    def callc(self, n):    self.op(0x55, n)
+    def tag(self, t, n):   self.op(0x57, self.string(t), n)
+    def fail(self, l, c):  self.op(0x59, l, c)
+    def line(self, n):     self.op(0x5A, n)
+    def write(self):       self.op(0x71)
+    def length(self):      self.op(0x72)
+    def stringval(self):   self.op(0x73)
+
+    def call(self, f, n):
+        self.jump(0x56, f)
+        self.code += ints(n)
+
+    def closure(self, f, caps):
+        self.jump(0x54, f)
+        self.code += ints(len(caps))
+        for x in caps:
+            self.code += bytes([LOCS.index(x[0])]) + ints(int(x[1:]))
+
+    def native(self, name, n_args):
+        self.op(0x75, self.string(name), n_args)
+
+    # x := e; as a statement
+    def assign(self, x, e):
+        e()
+        self.st(x)
+        self.drop()
+
+    # for init, cond, step do body od
+    def loop(self, init, cond, step, body):
+        head, test = self.new_label(), self.new_label()
+        init()
+        self.jump(0x15, test)
+        self.label(head)
+        body()
+        step()
+        self.label(test)
+        cond()
+        self.jump(0x51, head)
+
+    # for x := a, x < b, x := x + 1 do body od
+    def upto(self, x, a, b, body):
+        self.loop(lambda: self.assign(x, lambda: self.const(a)),
+                  lambda: (self.ld(x), b(), self.binop("<")),
+                  lambda: self.assign(x, lambda: (self.ld(x), self.const(1), self.binop("+"))),
+                  body)
+
+    # if c then a else b fi (b is None for no else)
+    def cond(self, c, a, b):
+        other, done = self.new_label(), self.new_label()
+        c()
+        self.jump(0x50, other)
+        a()
+        self.jump(0x15, done)
+        self.label(other)
+        if b is not None:
+            b()
+        self.jump(0x15, done)
+        self.label(done)
+
+    # The branch of a case on the scrutinee at the top: the pattern tag
+    # (a constructor with arity, or None for {}), the locals bound to its
+    # fields (None for _), then the body; falls to the next branch
+    def branch(self, t, n, binds, body, done):
+        ok, fail = self.new_label(), self.new_label()
+        if t is None:
+            self.dup(); self.const(0); self.binop("==")
+            self.jump(0x50, fail)
+            self.drop()
+        else:
+            self.dup(); self.dup(); self.tag(t, n)
+            self.jump(0x51, ok)
+            self.drop()
+            self.jump(0x15, fail)
+            self.label(ok)
+            for i in range(n):
+                self.dup(); self.const(i); self.elem(); self.drop()
+            self.drop()
+            for i, x in enumerate(binds):
+                if x is not None:
+                    self.dup(); self.const(i); self.elem(); self.st(x); self.drop()
+            self.drop()
+        body()
+        self.jump(0x15, done)
+        self.label(fail)
+
+    def save(self, path):
+        self.code += b"\xff"
+        for at, name in self.fixups:
+            self.code[at:at + 4] = ints(self.labels[name])
+        name = self.string("main")
+        with open(path, "wb") as f:
+            f.write(ints(len(self.strings), self.n_globals, 1) + ints(name, 0) + self.strings + self.code)
+
+
+# loop.lama: var i, j, s
+p = Program(3)
+i, j, s = "G0", "G1", "G2"
+p.begin(2, 0)
+p.line(3); p.assign(s, lambda: p.const(0))
+p.line(5)
+p.upto(i, 0, lambda: p.const(3000), lambda: (
+    p.line(6),
+    p.upto(j, 0, lambda: p.const(10000), lambda: (
+        p.line(7),
+        p.assign(s, lambda: (p.ld(s), p.ld(i), p.ld(j), p.binop("*"), p.binop("+"),
+                             p.const(1000003), p.binop("%")))))))
+p.line(11); p.ld(s); p.write(); p.end()
+p.save("loop.bc")
+
+# recursion.lama: var i, s
+p = Program(2)
+i, s = "G0", "G1"
+p.begin(2, 0)
+p.line(11); p.assign(s, lambda: p.const(0))
+p.line(13)
+p.upto(i, 0, lambda: p.const(20), lambda: (
+    p.line(14),
+    p.assign(s, lambda: (p.ld(s), p.const(100000), p.call("depth", 1), p.binop("+")))))
+p.line(17); p.const(27); p.call("fib", 1); p.write(); p.drop()
+p.line(18); p.ld(s); p.write(); p.end()
+
+p.label("fib"); p.begin(1, 0); p.line(4)
+p.cond(lambda: (p.ld("A0"), p.const(2), p.binop("<")),
+       lambda: p.ld("A0"),
+       lambda: (p.ld("A0"), p.const(1), p.binop("-"), p.call("fib", 1),
+                p.ld("A0"), p.const(2), p.binop("-"), p.call("fib", 1), p.binop("+")))
+p.end()
+
+p.label("depth"); p.begin(1, 0); p.line(8)
+p.cond(lambda: (p.ld("A0"), p.const(0), p.binop("==")),
+       lambda: p.const(0),
+       lambda: (p.const(1), p.ld("A0"), p.const(1), p.binop("-"), p.call("depth", 1), p.binop("+")))
+p.end()
+p.save("recursion.bc")
+
+# closures.lama: var l, i, s
+p = Program(3)
+l, i, s = "G0", "G1", "G2"
+p.begin(2, 0)
+p.line(29); p.assign(l, lambda: (p.const(0), p.const(1000), p.call("upto", 2)))
+p.line(30); p.assign(s, lambda: p.const(0))
+p.line(32)
+p.upto(i, 0, lambda: p.const(2000), lambda: (
+    p.line(33),
+    p.assign(s, lambda: (p.ld(s),
+                         p.closure("plus", []), p.const(0),
+                         p.ld(i), p.call("adder", 1), p.const(1), p.call("adder", 1),
+                         p.call("compose", 2), p.ld(l), p.call("mapList", 2),
+                         p.call("foldList", 3), p.binop("+"),
+                         p.const(1000003), p.binop("%")))))
+p.line(36); p.ld(s); p.write(); p.end()
+
+p.label("plus"); p.begin(2, 0)
+p.ld("A0"); p.ld("A1"); p.binop("+"); p.end()
+
+p.label("upto"); p.begin(2, 0); p.line(4)
+p.cond(lambda: (p.ld("A0"), p.ld("A1"), p.binop(">=")),
+       lambda: p.const(0),
+       lambda: (p.ld("A0"), p.ld("A0"), p.const(1), p.binop("+"), p.ld("A1"),
+                p.call("upto", 2), p.sexp("cons", 2)))
+p.end()
+
+p.label("mapList"); p.begin(2, 2); p.line(8); p.ld("A1")
+done = p.new_label()
+p.branch(None, 0, [], lambda: p.const(0), done)
+p.branch("cons", 2, ["L1", "L0"],
+         lambda: (p.line(10), p.ld("A0"), p.ld("L1"), p.callc(1),
+                  p.ld("A0"), p.ld("L0"), p.call("mapList", 2), p.sexp("cons", 2)), done)
+p.fail(8, 3); p.jump(0x15, done)
+p.label(done); p.end()
+
+p.label("foldList"); p.begin(3, 2); p.line(15); p.ld("A2")
+done = p.new_label()
+p.branch(None, 0, [], lambda: p.ld("A1"), done)
+p.branch("cons", 2, ["L1", "L0"],
+         lambda: (p.line(17), p.ld("A0"), p.ld("A0"), p.ld("A1"), p.ld("L1"), p.callc(2),
+                  p.ld("L0"), p.call("foldList", 3)), done)
+p.fail(15, 3); p.jump(0x15, done)
+p.label(done); p.end()
+
+p.label("adder"); p.begin(1, 0); p.line(22)
+p.closure("adder_fun", ["A0"]); p.end()
+p.label("adder_fun"); p.cbegin(1, 0)
+p.ld("A0"); p.ld("C0"); p.binop("+"); p.end()
+
+p.label("compose"); p.begin(2, 0); p.line(26)
+p.closure("compose_fun", ["A0", "A1"]); p.end()
+p.label("compose_fun"); p.cbegin(1, 0)
+p.ld("C0"); p.ld("C1"); p.ld("A0"); p.callc(1); p.callc(1); p.end()
+p.save("closures.bc")
+
+# sexp.lama: var t, i, j, s
+p = Program(4)
+t, i, j, s = "G0", "G1", "G2", "G3"
+p.begin(2, 0)
+p.line(36); p.assign(s, lambda: p.const(0))
+p.line(38)
+p.upto(j, 0, lambda: p.const(20), lambda: (
+    p.line(39), p.assign(t, lambda: p.sexp("Leaf", 0)),
+    p.line(40),
+    p.upto(i, 0, lambda: p.const(5000), lambda: (
+        p.line(41),
+        p.assign(t, lambda: (p.ld(t), p.ld(i), p.const(7919), p.binop("*"), p.ld(j), p.binop("+"),
+                             p.const(10007), p.binop("%"), p.call("insert", 2))))),
+    p.line(43),
+    p.assign(s, lambda: (p.ld(s), p.ld(t), p.call("sum", 1), p.binop("+"),
+                         p.ld(t), p.call("height", 1), p.binop("+")))))
+p.line(46); p.ld(s); p.write(); p.end()
+
+p.label("insert"); p.begin(2, 3); p.line(4); p.ld("A0")
+done = p.new_label()
+p.branch("Leaf", 0, [],
+         lambda: (p.line(5), p.sexp("Leaf", 0), p.ld("A1"), p.sexp("Leaf", 0), p.sexp("Node", 3)), done)
+p.branch("Node", 3, ["L2", "L1", "L0"], lambda: (
+    p.line(7),
+    p.cond(lambda: (p.ld("A1"), p.ld("L1"), p.binop("<")),
+           lambda: (p.ld("L2"), p.ld("A1"), p.call("insert", 2), p.ld("L1"), p.ld("L0"),
+                    p.sexp("Node", 3)),
+           lambda: (p.line(8),
+                    p.cond(lambda: (p.ld("A1"), p.ld("L1"), p.binop(">")),
+                           lambda: (p.ld("L2"), p.ld("L1"), p.ld("L0"), p.ld("A1"),
+                                    p.call("insert", 2), p.sexp("Node", 3)),
+                           lambda: (p.line(9), p.ld("A0")))))), done)
+p.fail(4, 3); p.jump(0x15, done)
+p.label(done); p.end()
+
+p.label("sum"); p.begin(1, 3); p.line(15); p.ld("A0")
+done = p.new_label()
+p.branch("Leaf", 0, [], lambda: (p.line(16), p.const(0)), done)
+p.branch("Node", 3, ["L2", "L1", "L0"],
+         lambda: (p.line(17), p.ld("L2"), p.call("sum", 1), p.ld("L1"), p.binop("+"),
+                  p.ld("L0"), p.call("sum", 1), p.binop("+")), done)
+p.fail(15, 3); p.jump(0x15, done)
+p.label(done); p.end()
+
+p.label("max"); p.begin(2, 0); p.line(22)
+p.cond(lambda: (p.ld("A0"), p.ld("A1"), p.binop(">")), lambda: p.ld("A0"), lambda: p.ld("A1"))
+p.end()
+
+p.label("height"); p.begin(1, 2); p.line(26); p.ld("A0")
+done = p.new_label()
+p.branch("Leaf", 0, [], lambda: (p.line(27), p.const(0)), done)
+p.branch("Node", 3, ["L1", None, "L0"],
+         lambda: (p.line(28), p.ld("L1"), p.call("height", 1), p.ld("L0"), p.call("height", 1),
+                  p.call("max", 2), p.const(1), p.binop("+")), done)
+p.fail(26, 3); p.jump(0x15, done)
+p.label(done); p.end()
+p.save("sexp.bc")
+
+# strings.lama: var s, i, j, n
+p = Program(4)
+s, i, j, n = "G0", "G1", "G2", "G3"
+p.begin(2, 0)
+p.line(3); p.assign(n, lambda: p.const(0))
+p.line(5)
+p.upto(j, 0, lambda: p.const(20), lambda: (
+    p.line(6), p.assign(s, lambda: p.sconst("")),
+    p.line(7),
+    p.upto(i, 0, lambda: p.const(3000), lambda: (
+        p.line(8),
+        p.assign(s, lambda: (p.ld(s), p.ld(i), p.stringval(), p.sconst(","),
+                             p.native("Li__Infix_4343", 2), p.native("Li__Infix_4343", 2))))),
+    p.line(10),
+    p.assign(n, lambda: (p.ld(n), p.ld(s), p.length(), p.binop("+")))))
+p.line(13); p.ld(n); p.write(); p.end()
+p.save("strings.bc")
+
+# arrays.lama: var a, i, j, k, n, c
+p = Program(6)
+a, i, j, k, n, c = "G0", "G1", "G2", "G3", "G4", "G5"
+p.begin(2, 0)
+p.line(3); p.assign(n, lambda: p.const(200000))
+p.line(4); p.assign(a, lambda: (p.ld(n), p.native("LmakeArray", 1)))
+p.line(5); p.assign(c, lambda: p.const(0))
+p.line(7)
+p.upto(j, 0, lambda: p.const(10), lambda: (
+    p.line(8),
+    p.upto(i, 0, lambda: p.ld(n), lambda: (
+        p.line(9), p.ld(a), p.ld(i), p.const(1), p.sta(), p.drop())),
+    p.line(11),
+    p.upto(i, 2, lambda: p.ld(n), lambda: (
+        p.line(12),
+        p.cond(lambda: (p.ld(a), p.ld(i), p.elem(), p.const(0), p.binop("!=")),
+               lambda: (p.line(13),
+                        p.assign(c, lambda: (p.ld(c), p.const(1), p.binop("+"))),
+                        p.line(14),
+                        p.loop(lambda: p.assign(k, lambda: (p.ld(i), p.ld(i), p.binop("+"))),
+                               lambda: (p.ld(k), p.ld(n), p.binop("<")),
+                               lambda: p.assign(k, lambda: (p.ld(k), p.ld(i), p.binop("+"))),
+                               lambda: (p.line(15), p.ld(a), p.ld(k), p.const(0), p.sta(), p.drop()))),
+               None)))))
+p.line(21); p.ld(c); p.write(); p.end()
+p.save("arrays.bc")
+
+# gc.lama: var i, s, keep
+p = Program(3)
+i, s, keep = "G0", "G1", "G2"
+p.begin(2, 0)
+p.line(14); p.assign(s, lambda: p.const(0))
+p.line(15); p.assign(keep, lambda: (p.const(10000), p.call("build", 1)))
+p.line(17)
+p.upto(i, 0, lambda: p.const(1000), lambda: (
+    p.line(18),
+    p.assign(s, lambda: (p.ld(s), p.const(2000), p.call("build", 1), p.call("len", 1),
+                         p.binop("+")))))
+p.line(21); p.ld(s); p.ld(keep); p.call("len", 1); p.binop("+"); p.write(); p.end()
+
+p.label("build"); p.begin(1, 0); p.line(4)
+p.cond(lambda: (p.ld("A0"), p.const(0), p.binop("==")),
+       lambda: p.sexp("Nil", 0),
+       lambda: (p.ld("A0"), p.ld("A0"), p.const(1), p.binop("+"), p.op(0x74, 2),
+                p.ld("A0"), p.const(1), p.binop("-"), p.call("build", 1), p.sexp("Cons", 2)))
+p.end()
+
+p.label("len"); p.begin(1, 1); p.line(8); p.ld("A0")
+done = p.new_label()
+p.branch("Nil", 0, [], lambda: (p.line(9), p.const(0)), done)
+p.branch("Cons", 2, [None, "L0"],
+         lambda: (p.line(10), p.const(1), p.ld("L0"), p.call("len", 1), p.binop("+")), done)
+p.fail(8, 3); p.jump(0x15, done)
+p.label(done); p.end()
+p.save("gc.bc")
@@ -0,0 +1,281 @@
+/* Microbenchmarks of the runtime primitives, run without the interpreter.
+   The roots live on a fake stack between __gc_stack_top and
+   __gc_stack_bottom, the way the interpreter keeps its value stack, and
+   in the extra roots. Every primitive is timed on inputs of a few sizes,
+   repeating it until the run takes long enough, and reported in ns per
+   operation; the arguments, if any, select the benchmarks by name */
+
+# include <string.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdbool.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <time.h>
+
+# include "runtime.h"
+
+/* There is no custom data section for the collector to scan */
+void *__start_custom_data;
+void *__stop_custom_data;
+
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
+
+/* The fake stack: root(0) is the slot at its bottom */
+# define N_ROOTS 4
+
+static void *stack[N_ROOTS];
+
+# define root(i) stack[N_ROOTS - 1 - (i)]
+
+# define MIN_TIME_NS 50000000
+
+static char **filters;
+static int    n_filters;
+static aint   cons_tag, node_tag;
+
+static uint64_t now_ns (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool selected (const char *name) {
+  if (n_filters == 0) return true;
+
+  for (int i = 0; i < n_filters; i++) {
+    if (strstr (name, filters[i]) != NULL) return true;
+  }
+
+  return false;
+}
+
+/* Runs body with the number of operations to do, doubling it until the
+   run is long enough, and prints the time per operation */
+static void measure (const char *name, long size, const char *unit,
+                     void (*body) (long size, long n)) {
+  uint64_t time;
+  long n = 1;
+
+  if (!selected (name)) return;
+
+  while (1) {
+    uint64_t start = now_ns ();
+
+    body (size, n);
+    time = now_ns () - start;
+
+    if (time >= MIN_TIME_NS) break;
+    n = time < MIN_TIME_NS / 64 ? n * 8 : n * 2;
+  }
+
+  printf ("%-16s %10ld %12.1f ns/%s\n", name, size, (double) time / n, unit);
+  fflush (stdout);
+}
+
+/* The object graphs */
+static void* list (long n) {
+  root(1) = (void*) BOX(0);
+
+  for (long i = 0; i < n; i++) {
+    void **c = (void**) LmakeSexp (BOX(3), cons_tag);
+
+    c[0] = (void*) BOX(i);
+    c[1] = root(1);
+    root(1) = c;
+  }
+
+  return root(1);
+}
+
+static void* tree (long depth) {
+  void *l, *r, **n;
+
+  if (depth == 0) return (void*) BOX(0);
+
+  l = tree (depth - 1);
+  push_extra_root (&l);
+  r = tree (depth - 1);
+  push_extra_root (&r);
+  n = (void**) LmakeSexp (BOX(3), node_tag);
+  pop_extra_root (&r);
+  pop_extra_root (&l);
+  n[0] = l;
+  n[1] = r;
+
+  return n;
+}
+
+static void* strings (long n) {
+  root(1) = LmakeArray (BOX(n));
+
+  for (long i = 0; i < n; i++) {
+    void *s = Bstring ("abcdefghijklmnop");
+
+    Bsta (s, BOX(i), root(1));
+  }
+
+  return root(1);
+}
+
+static void* string_of (long n) {
+  char *buf = (char*) malloc (n + 1);
+  void *s;
+
+  memset (buf, 'a', n);
+  buf[n] = 0;
+  s = Bstring (buf);
+  free (buf);
+
+  return s;
+}
+
+/* The benchmarks */
+static void bench_alloc (long size, long n) {
+  for (long i = 0; i < n; i++) alloc (size);
+}
+
+/* Collections with the graph in root(0) live: garbage is allocated until
+   n more collections have happened */
+static void bench_gc (long size, long n) {
+  size_t count, target;
+  uint64_t ns;
+
+  (void) size;
+  __gc_stats (&count, &ns);
+
+  for (target = count + n; count < target; __gc_stats (&count, &ns)) alloc (4096);
+}
+
+static void bench_tag_hash (long size, long n) {
+  char *tag = (char*) malloc (size + 1);
+
+  memset (tag, 'A', size);
+  tag[size] = 0;
+  for (long i = 0; i < n; i++) LtagHash (tag);
+  free (tag);
+}
+
+static void bench_compare (long size, long n) {
+  (void) size;
+  for (long i = 0; i < n; i++) Lcompare (root(0), root(1));
+}
+
+static void bench_hash (long size, long n) {
+  (void) size;
+  for (long i = 0; i < n; i++) Lhash (root(0));
+}
+
+static void bench_bstring (long size, long n) {
+  char *buf = (char*) malloc (size + 1);
+
+  memset (buf, 'a', size);
+  buf[size] = 0;
+  for (long i = 0; i < n; i++) Bstring (buf);
+  free (buf);
+}
+
+static void bench_concat (long size, long n) {
+  (void) size;
+  for (long i = 0; i < n; i++) Li__Infix_4343 (root(0), root(1));
+}
+
+static void bench_elem (long size, long n) {
+  for (long i = 0, j = 0; i < n; i++, j = j + 1 == size ? 0 : j + 1) Belem (root(0), BOX(j));
+}
+
+static void bench_sta (long size, long n) {
+  for (long i = 0, j = 0; i < n; i++, j = j + 1 == size ? 0 : j + 1) {
+    Bsta ((void*) BOX(i), BOX(j), root(0));
+  }
+}
+
+static void bench_print (long size, long n) {
+  (void) size;
+  for (long i = 0; i < n; i++) printValue (root(0));
+  flush_output ();
+}
+
+static void clear_roots (void) {
+  for (int i = 0; i < N_ROOTS; i++) stack[i] = (void*) BOX(0);
+}
+
+int main (int argc, char *argv[]) {
+  static const long alloc_sizes[]  = {16, 64, 512};
+  static const long graph_sizes[]  = {1000, 10000, 30000};
+  static const long tree_depths[]  = {10, 13, 16};
+  static const long tag_sizes[]    = {1, 2, 4};
+  static const long value_sizes[]  = {10, 100, 1000};
+  static const long string_sizes[] = {8, 64, 1024};
+  int null_fd = open ("/dev/null", O_WRONLY);
+
+  filters   = argv + 1;
+  n_filters = argc - 1;
+
+  __gc_stack_bottom = (size_t) (stack + N_ROOTS);
+  __gc_stack_top    = (size_t) stack;
+  clear_roots ();
+
+  /* A small heap, so that the collections are quick to come by */
+  set_heap_size (128 * 1024);
+  __init ();
+
+  cons_tag = LtagHash ("cons");
+  node_tag = LtagHash ("Node");
+
+  for (int i = 0; i < 3; i++) measure ("alloc", alloc_sizes[i], "op", bench_alloc);
+
+  /* The collector copies recursively, so long lists need a deep C stack */
+  for (int i = 0; i < 3; i++) {
+    clear_roots ();
+    if (selected ("gc list")) root(0) = list (graph_sizes[i]);
+    measure ("gc list", graph_sizes[i], "gc", bench_gc);
+    clear_roots ();
+    if (selected ("gc tree")) root(0) = tree (tree_depths[i]);
+    measure ("gc tree", (1L << tree_depths[i]) - 1, "gc", bench_gc);
+    clear_roots ();
+    if (selected ("gc strings")) root(0) = strings (graph_sizes[i]);
+    measure ("gc strings", graph_sizes[i], "gc", bench_gc);
+  }
+
+  for (int i = 0; i < 3; i++) measure ("LtagHash", tag_sizes[i], "op", bench_tag_hash);
+
+  for (int i = 0; i < 3; i++) {
+    clear_roots ();
+    root(0) = list (value_sizes[i]);
+    root(1) = list (value_sizes[i]);
+    measure ("Lcompare", value_sizes[i], "op", bench_compare);
+    measure ("Lhash", value_sizes[i], "op", bench_hash);
+  }
+
+  for (int i = 0; i < 3; i++) measure ("Bstring", string_sizes[i], "op", bench_bstring);
+
+  for (int i = 0; i < 3; i++) {
+    clear_roots ();
+    root(0) = string_of (string_sizes[i]);
+    root(1) = string_of (string_sizes[i]);
+    measure ("++", 2 * string_sizes[i], "op", bench_concat);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    clear_roots ();
+    root(0) = LmakeArray (BOX(value_sizes[i]));
+    measure ("Belem", value_sizes[i], "op", bench_elem);
+    measure ("Bsta", value_sizes[i], "op", bench_sta);
+  }
+
+  /* printValue writes to the output buffer, which goes to /dev/null */
+  set_output_fd (null_fd);
+  for (int i = 0; i < 3; i++) {
+    clear_roots ();
+    root(0) = list (value_sizes[i]);
+    measure ("printValue", value_sizes[i], "op", bench_print);
+  }
+  set_output_fd (STDOUT_FILENO);
+
+  clear_roots ();
+  __shutdown ();
+
+  return 0;
+}
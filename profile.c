@@ -0,0 +1,269 @@
+/* Lama SM Bytecode interpreter: the execution profile and its report */
+
+# include <string.h>
+# include <stdlib.h>
+# include <errno.h>
+# include <stdbool.h>
+
+# include "lamai.h"
+# include "profile.h"
+
+# define PROFILE_TOP_PAIRS 20
+
+static void* profile_alloc (void *p, size_t size) {
+    p = realloc (p, size);
+
+    if (p == NULL) {
+        failure ("*** FAILURE: unable to allocate memory.\n");
+    }
+
+    return p;
+}
+
+profile_data* profile_new (int code_size) {
+    profile_data *P = (profile_data*) profile_alloc (NULL, sizeof (profile_data));
+
+    memset (P, 0, sizeof (profile_data));
+    P->code_size = code_size;
+    P->fun_index = (int*) profile_alloc (NULL, code_size * sizeof (int));
+    memset (P->fun_index, 0, code_size * sizeof (int));
+    profile_add_function (P, -1, "(outside functions)");
+
+    return P;
+}
+
+void profile_free (profile_data *P) {
+    for (int i = 0; i < P->n_funs; i++) free (P->funs[i].name);
+    free (P->funs);
+    free (P->fun_index);
+    free (P->stack);
+    free (P);
+}
+
+int profile_add_function (profile_data *P, int offset, const char *name) {
+    profile_function *f;
+    char buf[16];
+
+    if (P->n_funs == P->size_funs) {
+        P->size_funs = P->size_funs == 0 ? 64 : 2 * P->size_funs;
+        P->funs = (profile_function*) profile_alloc (P->funs, P->size_funs * sizeof (profile_function));
+    }
+
+    if (name == NULL) {
+        snprintf (buf, sizeof (buf), "0x%08x", offset);
+        name = buf;
+    }
+
+    f = &P->funs[P->n_funs];
+    memset (f, 0, sizeof (profile_function));
+    f->offset = offset;
+    f->name   = strdup (name);
+
+    if (offset >= 0) P->fun_index[offset] = P->n_funs;
+
+    return P->n_funs++;
+}
+
+void profile_enter (profile_data *P, int fun) {
+    if (P->depth == P->size) {
+        P->size  = P->size == 0 ? 256 : 2 * P->size;
+        P->stack = (profile_frame*) profile_alloc (P->stack, P->size * sizeof (profile_frame));
+    }
+
+    P->stack[P->depth].fun   = P->fun;
+    P->stack[P->depth].entry = __rdtsc ();
+    P->depth++;
+    P->funs[fun].calls++;
+    P->funs[fun].active++;
+    P->fun = fun;
+}
+
+/* A frame restored from a snapshot was not entered here and is ignored */
+void profile_leave (profile_data *P) {
+    profile_function *f = &P->funs[P->fun];
+
+    if (P->depth == 0) return;
+
+    P->depth--;
+    if (--f->active == 0) f->total_cycles += __rdtsc () - P->stack[P->depth].entry;
+    P->fun = P->stack[P->depth].fun;
+}
+
+/* The mnemonic of an opcode, the way the disassembler prints them */
+const char* opcode_name (int x, char *buf, size_t size) {
+    static const char *binops[] = {
+        NULL, "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"
+    };
+    static const char *h1[] = {
+        "CONST", "STRING", "SEXP", "STI", "STA", "JMP", "END", "RET", "DROP", "DUP", "SWAP", "ELEM"
+    };
+    static const char *h5[] = {
+        "CJMPz", "CJMPnz", "BEGIN", "CBEGIN", "CLOSURE", "CALLC", "CALL", "TAG", "ARRAY", "FAIL", "LINE"
+    };
+    static const char *h6[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
+    static const char *h7[] = {"Lread", "Lwrite", "Llength", "Lstring", "Barray", "native"};
+    static const char *locs[] = {"G", "L", "A", "C"};
+    int h = x >> 4, l = x & 0x0F;
+
+    switch (h) {
+    case 0:
+        if (l >= 1 && l <= 13) snprintf (buf, size, "BINOP %s", binops[l]);
+        else break;
+        return buf;
+    case 1:
+        if (l < 12) return h1[l];
+        break;
+    case 2: case 3: case 4:
+        if (l < 4) snprintf (buf, size, "%s %s", h == 2 ? "LD" : h == 3 ? "LDA" : "ST", locs[l]);
+        else break;
+        return buf;
+    case 5:
+        if (l < 11) return h5[l];
+        break;
+    case 6:
+        if (l < 7) snprintf (buf, size, "PATT %s", h6[l]);
+        else break;
+        return buf;
+    case 7:
+        if (l < 6) snprintf (buf, size, "CALL %s", h7[l]);
+        else break;
+        return buf;
+    case 15:
+        return "STOP";
+    }
+
+    snprintf (buf, size, "0x%02x", x);
+    return buf;
+}
+
+static uint64_t* sort_keys;
+
+static int compare_by_key (const void *a, const void *b) {
+    uint64_t x = sort_keys[*(const int*) a], y = sort_keys[*(const int*) b];
+
+    return x < y ? 1 : x > y ? -1 : *(const int*) a - *(const int*) b;
+}
+
+/* The indices of n counters by the counters, descending */
+static int* sorted (uint64_t *keys, int n) {
+    int *order = (int*) profile_alloc (NULL, n * sizeof (int));
+
+    for (int i = 0; i < n; i++) order[i] = i;
+    sort_keys = keys;
+    qsort (order, n, sizeof (int), compare_by_key);
+
+    return order;
+}
+
+static void json_string (FILE *f, const char *s) {
+    fputc ('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc ('\\', f);
+        fputc (*s, f);
+    }
+    fputc ('"', f);
+}
+
+/* The table goes to table, if any, the JSON to the file at json_path */
+void profile_report (profile_data *P, FILE *table, const char *json_path) {
+    uint64_t total = 0, instructions = 0;
+    uint64_t *pair_counts = (uint64_t*) profile_alloc (NULL, 256 * 256 * sizeof (uint64_t));
+    uint64_t *self = (uint64_t*) profile_alloc (NULL, P->n_funs * sizeof (uint64_t));
+    int *ops = sorted (P->cycles, 256), *pairs, *funs;
+    char a[32], b[32];
+    FILE *json;
+
+    for (int i = 0; i < 256; i++) {
+        total += P->cycles[i];
+        instructions += P->count[i];
+    }
+
+    /* The pairs starting with the entry of execute are not real ones */
+    memcpy (pair_counts, P->pairs, sizeof (P->pairs));
+    memset (pair_counts + PROFILE_ENTRY_OP * 256, 0, 256 * sizeof (uint64_t));
+    pairs = sorted (pair_counts, 256 * 256);
+
+    for (int i = 0; i < P->n_funs; i++) self[i] = P->funs[i].self_cycles;
+    funs = sorted (self, P->n_funs);
+
+    if (table != NULL) {
+        fprintf (table, "%-20s %14s %16s %10s %7s\n", "opcode", "count", "cycles", "cycles/op", "%");
+        for (int i = 0; i < 256; i++) {
+            int op = ops[i];
+
+            if (P->count[op] == 0) continue;
+            fprintf (table, "%-20s %14llu %16llu %10.1f %6.2f%%\n", opcode_name (op, a, sizeof (a)),
+                     (unsigned long long) P->count[op], (unsigned long long) P->cycles[op],
+                     (double) P->cycles[op] / P->count[op],
+                     total == 0 ? 0.0 : 100.0 * P->cycles[op] / total);
+        }
+        fprintf (table, "%-20s %14llu %16llu\n\n", "total",
+                 (unsigned long long) instructions, (unsigned long long) total);
+
+        fprintf (table, "%-20s %10s %14s %16s %16s %7s\n",
+                 "function", "calls", "instructions", "self cycles", "total cycles", "self %");
+        for (int i = 0; i < P->n_funs; i++) {
+            profile_function *f = &P->funs[funs[i]];
+
+            if (f->instructions == 0) continue;
+            fprintf (table, "%-20s %10llu %14llu %16llu %16llu %6.2f%%\n", f->name,
+                     (unsigned long long) f->calls, (unsigned long long) f->instructions,
+                     (unsigned long long) f->self_cycles, (unsigned long long) f->total_cycles,
+                     total == 0 ? 0.0 : 100.0 * f->self_cycles / total);
+        }
+
+        fprintf (table, "\n%-41s %14s\n", "opcode pair", "count");
+        for (int i = 0; i < PROFILE_TOP_PAIRS && pair_counts[pairs[i]] != 0; i++) {
+            fprintf (table, "%-20s %-20s %14llu\n", opcode_name (pairs[i] >> 8, a, sizeof (a)),
+                     opcode_name (pairs[i] & 0xFF, b, sizeof (b)),
+                     (unsigned long long) pair_counts[pairs[i]]);
+        }
+    }
+
+    if (json_path != NULL) {
+        if ((json = fopen (json_path, "w")) == NULL) {
+            fprintf (stderr, "%s: %s\n", json_path, strerror (errno));
+        } else {
+            fprintf (json, "{\n  \"opcodes\": [");
+            for (int i = 0, first = 1; i < 256; i++) {
+                int op = ops[i];
+
+                if (P->count[op] == 0) continue;
+                fprintf (json, "%s\n    {\"opcode\": %d, \"name\": ", first ? "" : ",", op);
+                json_string (json, opcode_name (op, a, sizeof (a)));
+                fprintf (json, ", \"count\": %llu, \"cycles\": %llu}",
+                         (unsigned long long) P->count[op], (unsigned long long) P->cycles[op]);
+                first = 0;
+            }
+
+            fprintf (json, "\n  ],\n  \"functions\": [");
+            for (int i = 0, first = 1; i < P->n_funs; i++) {
+                profile_function *f = &P->funs[funs[i]];
+
+                if (f->instructions == 0) continue;
+                fprintf (json, "%s\n    {\"name\": ", first ? "" : ",");
+                json_string (json, f->name);
+                fprintf (json, ", \"offset\": %d, \"calls\": %llu, \"instructions\": %llu, "
+                         "\"self_cycles\": %llu, \"total_cycles\": %llu}", f->offset,
+                         (unsigned long long) f->calls, (unsigned long long) f->instructions,
+                         (unsigned long long) f->self_cycles, (unsigned long long) f->total_cycles);
+                first = 0;
+            }
+
+            fprintf (json, "\n  ],\n  \"pairs\": [");
+            for (int i = 0; i < 256 * 256 && pair_counts[pairs[i]] != 0; i++) {
+                fprintf (json, "%s\n    {\"first\": %d, \"second\": %d, \"count\": %llu}",
+                         i == 0 ? "" : ",", pairs[i] >> 8, pairs[i] & 0xFF,
+                         (unsigned long long) pair_counts[pairs[i]]);
+            }
+            fprintf (json, "\n  ]\n}\n");
+            fclose (json);
+        }
+    }
+
+    free (ops);
+    free (pairs);
+    free (funs);
+    free (self);
+    free (pair_counts);
+}
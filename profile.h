@@ -0,0 +1,86 @@
+#ifndef LAMAI_PROFILE_H
+#define LAMAI_PROFILE_H
+
+# include <stdio.h>
+# include <stdint.h>
+# include <x86intrin.h>
+
+/* The execution profile: counts and rdtsc cycles per opcode and per
+   function, and counts of opcode pairs. An instruction is charged the
+   cycles until the next one starts, so they include the dispatch.
+   Functions are told by the offsets of their BEGIN */
+typedef struct {
+    int      offset;               /* The offset of the BEGIN of the function        */
+    char    *name;                 /* Its public name, or the offset in hex          */
+    uint64_t calls;
+    uint64_t instructions;
+    uint64_t self_cycles;
+    uint64_t total_cycles;         /* With the callees, of outermost activations     */
+    int      active;               /* The number of its activations on the stack     */
+} profile_function;
+
+typedef struct {
+    int      fun;
+    uint64_t entry;
+} profile_frame;
+
+typedef struct {
+    uint64_t count[256];
+    uint64_t cycles[256];
+    uint64_t pairs[256][256];      /* By the first and the second opcode             */
+    profile_function *funs;        /* funs[0] stands for the code out of functions   */
+    int      n_funs, size_funs;
+    int     *fun_index;            /* The index of the function by its offset, or 0  */
+    int      code_size;
+    profile_frame *stack;          /* The functions being executed                   */
+    int      depth, size;
+    int      fun;                  /* The current function                           */
+    int      last_fun;             /* The function and the opcode of the instruction */
+    int      last_op;              /* being charged, and when it started             */
+    uint64_t last;
+} profile_data;
+
+/* The opcode the instruction charged at the start of execute is said to
+   be: STOP, which is executed only at its end */
+# define PROFILE_ENTRY_OP 0xFF
+
+profile_data* profile_new (int code_size);
+void profile_free (profile_data *P);
+int profile_add_function (profile_data *P, int offset, const char *name);
+void profile_enter (profile_data *P, int fun);
+void profile_leave (profile_data *P);
+void profile_report (profile_data *P, FILE *table, const char *json_path);
+
+/* The mnemonic of an opcode, the way the disassembler prints them; buf
+   holds those made up of several words */
+const char* opcode_name (int x, char *buf, size_t size);
+
+/* Starts the instruction op: charges the previous one */
+static inline void profile_op (profile_data *P, int op) {
+    uint64_t now = __rdtsc (), d = now - P->last;
+
+    P->cycles[P->last_op] += d;
+    P->funs[P->last_fun].self_cycles += d;
+    P->pairs[P->last_op][op]++;
+    P->count[op]++;
+    P->funs[P->fun].instructions++;
+    P->last_op  = op;
+    P->last_fun = P->fun;
+    P->last     = now;
+}
+
+static inline void profile_start (profile_data *P) {
+    P->last_op  = PROFILE_ENTRY_OP;
+    P->last_fun = P->fun;
+    P->last     = __rdtsc ();
+}
+
+/* Charges the last instruction when execute returns */
+static inline void profile_stop (profile_data *P) {
+    uint64_t d = __rdtsc () - P->last;
+
+    P->cycles[P->last_op] += d;
+    P->funs[P->last_fun].self_cycles += d;
+}
+
+#endif //LAMAI_PROFILE_H
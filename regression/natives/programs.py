@@ -0,0 +1,137 @@
+# The programs of this suite in bytecode: no Lama compiler emits the CALL
+# native instruction (0x75 <name> <n_args>), so they are assembled here.
+# "python3 programs.py" writes the testNNN.bc files.
+
+import struct
+
+
+def ints(*xs):
+    return b"".join(struct.pack("<i", x) for x in xs)
+
+
+class Program:
+    def __init__(self, n_locs, n_globals=0):
+        self.n_globals = n_globals
+        self.strings = bytearray()
+        self.positions = {}
+        self.code = bytearray()
+        self.labels = {}
+        self.fixups = []
+        self.op(0x52, 2, n_locs)                # BEGIN of main
+
+    def string(self, s):
+        if s not in self.positions:
+            self.positions[s] = len(self.strings)
+            self.strings += s.encode() + b"\0"
+        return self.positions[s]
+
+    def op(self, opcode, *operands):
+        self.code += bytes([opcode]) + ints(*operands)
+
+    def label(self, name):
+        self.labels[name] = len(self.code)
+
+    def jump(self, opcode, name):
+        self.fixups.append((len(self.code) + 1, name))
+        self.op(opcode, 0)
+
+    def const(self, n):   self.op(0x10, n)
+    def sconst(self, s):  self.op(0x11, self.string(s))
+    def drop(self):       self.op(0x18)
+    def ld(self, i):      self.op(0x21, i)
+    def st(self, i):      self.op(0x41, i)
+    def ldg(self, i):     self.op(0x20, i)
+    def stg(self, i):     self.op(0x40, i)
+    def length(self):     self.op(0x72)
+    def write(self):      self.op(0x71)
+
+    def native(self, name, n_args):
+        self.op(0x75, self.string(name), n_args)
+
+    def save(self, path):
+        self.const(0)
+        self.op(0x16)                           # END
+        self.code += b"\xff"
+        for at, name in self.fixups:
+            self.code[at:at + 4] = ints(self.labels[name])
+        name = self.string("main")
+        with open(path, "wb") as f:
+            f.write(ints(len(self.strings), self.n_globals, 1) + ints(name, 0) + self.strings + self.code)
+
+
+# Natives of fixed arity and variadic ones, with and without a result
+p = Program(1)
+p.sconst("%d %s\n"); p.const(42); p.sconst("abc"); p.native("Lprintf", 3); p.drop()
+p.sconst("12"); p.native("LstringInt", 1); p.const(30); p.op(0x01); p.write(); p.drop()
+p.sconst("%s\n"); p.sconst("ab"); p.sconst("cd"); p.native("Li__Infix_4343", 2); p.native("Lprintf", 2); p.drop()
+p.sconst("%d-%d"); p.const(1); p.const(2); p.native("Lsprintf", 3); p.st(0); p.drop()
+p.sconst("%s %d\n"); p.ld(0); p.ld(0); p.length(); p.native("Lprintf", 3); p.drop()
+p.sconst("%s\n"); p.sconst("substring"); p.const(3); p.const(4); p.native("Lsubstring", 3); p.native("Lprintf", 2); p.drop()
+p.sconst("a"); p.sconst("b"); p.native("Lcompare", 2); p.write(); p.drop()
+p.save("test001.bc")
+
+# printf output longer than the output buffer (64 KB), after buffered output
+p = Program(1)
+p.sconst("start\n"); p.native("Lprintf", 1); p.drop()
+p.sconst("0123456789" * 7); p.st(0); p.drop()
+for _ in range(10):
+    p.ld(0); p.ld(0); p.native("Li__Infix_4343", 2); p.st(0); p.drop()
+p.sconst("%s\n"); p.ld(0); p.native("Lprintf", 2); p.drop()
+p.ld(0); p.length(); p.write(); p.drop()
+p.save("test002.bc")
+
+# Ropes built by appending and by prepending 300000 pieces, 300000 deep,
+# flattened by compare, substring and printf, and one nested both ways
+p = Program(3)
+for i, prepend in ((0, False), (1, True)):
+    p.sconst(""); p.st(i); p.drop()
+    p.const(300000); p.st(2); p.drop()
+    p.label("loop%d" % i); p.ld(2); p.jump(0x50, "done%d" % i)
+    if prepend:
+        p.sconst("ab"); p.ld(i)
+    else:
+        p.ld(i); p.sconst("ab")
+    p.native("Li__Infix_4343", 2); p.st(i); p.drop()
+    p.ld(2); p.const(1); p.op(0x02); p.st(2); p.drop()
+    p.jump(0x15, "loop%d" % i)
+    p.label("done%d" % i)
+p.sconst("%d %d\n"); p.ld(0); p.length(); p.ld(1); p.length(); p.native("Lprintf", 3); p.drop()
+p.ld(0); p.ld(1); p.native("Lcompare", 2); p.write(); p.drop()
+p.sconst("%s\n"); p.ld(1); p.const(599990); p.const(10); p.native("Lsubstring", 3); p.native("Lprintf", 2); p.drop()
+p.sconst("%d\n"); p.ld(1); p.native("Lhash", 1); p.native("Lprintf", 2); p.drop()
+p.sconst("%d\n"); p.ld(0); p.native("Lhash", 1); p.native("Lprintf", 2); p.drop()
+p.sconst("-"); p.st(0); p.drop()
+for _ in range(40):
+    p.sconst("<"); p.ld(0); p.native("Li__Infix_4343", 2); p.sconst(">"); p.native("Li__Infix_4343", 2); p.st(0); p.drop()
+p.sconst("%s\n"); p.ld(0); p.native("Lprintf", 2); p.drop()
+p.save("test003.bc")
+
+# Strings in the globals, the first of which is in the bottom slot of the
+# stack, kept across the collections of 200000 concatenations
+p = Program(2, 2)
+for g in range(2):
+    p.sconst("global"); p.const(g); p.op(0x73); p.native("Li__Infix_4343", 2); p.stg(g); p.drop()
+p.const(200000); p.st(1); p.drop()
+p.label("loop"); p.ld(1); p.jump(0x50, "done")
+p.sconst("0123456789"); p.sconst("0123456789"); p.native("Li__Infix_4343", 2); p.st(0); p.drop()
+p.ld(1); p.const(1); p.op(0x02); p.st(1); p.drop()
+p.jump(0x15, "loop")
+p.label("done")
+p.sconst("%s %s\n"); p.ldg(0); p.ldg(1); p.native("Lprintf", 3); p.drop()
+p.save("test004.bc")
+
+# A failure message given as a rope
+p = Program(0)
+p.sconst("x" * 40); p.sconst("y" * 40); p.native("Li__Infix_4343", 2); p.native("Lfailure", 1)
+p.save("fail001.bc")
+
+# An assertion message given as a rope
+p = Program(0)
+p.const(0); p.sconst("z" * 40); p.sconst("w" * 40); p.native("Li__Infix_4343", 2); p.native("Lassert", 2)
+p.save("fail002.bc")
+
+# A substring position beyond 32 bits
+p = Program(0)
+p.sconst("abc"); p.const(65536); p.const(65536); p.op(0x03); p.const(2); p.op(0x03); p.const(1)
+p.native("Lsubstring", 3)
+p.save("fail003.bc")
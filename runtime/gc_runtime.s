@@ -4,8 +4,16 @@ printf_format2:		.string	"BOT: %lx\n"
 printf_format3:		.string	"TOP: %lx\n"
 printf_format4:		.string	"EAX: %lx\n"
 printf_format5:		.string	"LOL\n"
-__gc_stack_bottom:	.long	0
-__gc_stack_top:	        .long	0
+
+	// The stack bounds are thread-local: every thread runs its own isolate
+			.section .tbss,"awT",@nobits
+			.align	4
+			.type	__gc_stack_bottom, @object
+			.size	__gc_stack_bottom, 4
+__gc_stack_bottom:	.zero	4
+			.type	__gc_stack_top, @object
+			.size	__gc_stack_top, 4
+__gc_stack_top:	        .zero	4
 
 			.globl	__pre_gc
 			.globl	__post_gc
@@ -17,8 +25,8 @@ __gc_stack_top:	        .long	0
 			.extern	gc_test_and_copy_root
 			.text
 
-__gc_init:		movl	%ebp, __gc_stack_bottom
-			addl	$4, __gc_stack_bottom
+__gc_init:		movl	%ebp, %gs:__gc_stack_bottom@ntpoff
+			addl	$4, %gs:__gc_stack_bottom@ntpoff
 			call	__init
 			ret
 
@@ -27,12 +35,12 @@ __gc_init:		movl	%ebp, __gc_stack_bottom
 	// else return
 __pre_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	$0, %eax
 			jne	__pre_gc_2
 			movl	%ebp, %eax
 			// addl	$8, %eax
-			movl	%eax, __gc_stack_top
+			movl	%eax, %gs:__gc_stack_top@ntpoff
 __pre_gc_2:
 			popl	%eax
 			ret
@@ -43,10 +51,10 @@ __pre_gc_2:
 	// else return
 __post_gc:
 			pushl	%eax
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			cmpl	%eax, %ebp
 			jnz	__post_gc2
-			movl	$0, __gc_stack_top
+			movl	$0, %gs:__gc_stack_top@ntpoff
 __post_gc2:
 			popl	%eax
 			ret
@@ -59,7 +67,7 @@ __gc_root_scan_stack:
 			movl	%esp, %ebp
 			pushl	%ebx
 			pushl	%edx
-			movl	__gc_stack_top, %eax
+			movl	%gs:__gc_stack_top@ntpoff, %eax
 			jmp 	next
 
 loop:
@@ -83,12 +91,12 @@ check12:
 	// i.e. the following is not true:
 	// __gc_stack_top <= (%eax) <= __gc_stack_bottom
 check21:	
-			cmpl	%ebx, __gc_stack_top
+			cmpl	%ebx, %gs:__gc_stack_top@ntpoff
 			jna	check22
 			jmp	loop2
 
 check22:
-			cmpl	%ebx, __gc_stack_bottom
+			cmpl	%ebx, %gs:__gc_stack_bottom@ntpoff
 			jnb	next
 
 	// check if it a valid pointer
@@ -105,7 +113,7 @@ gc_run_t:
 
 next:
 			addl	$4, %eax
-			cmpl	%eax, __gc_stack_bottom
+			cmpl	%eax, %gs:__gc_stack_bottom@ntpoff
 			jne	loop
 returnn:
 			movl	$0, %eax
@@ -0,0 +1,127 @@
+	// The stack bounds are thread-local: every thread runs its own isolate
+			.section .tbss,"awT",@nobits
+			.align	8
+			.type	__gc_stack_bottom, @object
+			.size	__gc_stack_bottom, 8
+__gc_stack_bottom:	.zero	8
+			.type	__gc_stack_top, @object
+			.size	__gc_stack_top, 8
+__gc_stack_top:	        .zero	8
+
+			.globl	__pre_gc
+			.globl	__post_gc
+			.globl	__gc_init
+			.globl	__gc_root_scan_stack
+			.globl	__gc_stack_top
+			.globl	__gc_stack_bottom
+			.extern	init_pool
+			.extern	gc_test_and_copy_root
+			.text
+
+__gc_init:		movq	__gc_stack_bottom@gottpoff(%rip), %rax
+			movq	%rbp, %fs:(%rax)
+			addq	$8, %fs:(%rax)
+			subq	$8, %rsp
+			call	__init
+			addq	$8, %rsp
+			ret
+
+	// if __gc_stack_top is equal to 0
+	// then set __gc_stack_top to %rbp
+	// else return
+__pre_gc:
+			pushq	%rax
+			movq	__gc_stack_top@gottpoff(%rip), %rax
+			cmpq	$0, %fs:(%rax)
+			jne	__pre_gc_2
+			movq	%rbp, %fs:(%rax)
+__pre_gc_2:
+			popq	%rax
+			ret
+
+	// if __gc_stack_top has been set by the caller
+	//   (i.e. it is equal to its %rbp)
+	// then set __gc_stack_top to 0
+	// else return
+__post_gc:
+			pushq	%rax
+			movq	__gc_stack_top@gottpoff(%rip), %rax
+			cmpq	%fs:(%rax), %rbp
+			jnz	__post_gc2
+			movq	$0, %fs:(%rax)
+__post_gc2:
+			popq	%rax
+			ret
+
+	// Scan stack for roots
+	// strting from __gc_stack_top
+	// till __gc_stack_bottom
+	// %rbx holds the current slot, %r12 and %r13 the top and the bottom
+	// since they survive the call
+__gc_root_scan_stack:
+			pushq	%rbp
+			movq	%rsp, %rbp
+			pushq	%rbx
+			pushq	%r12
+			pushq	%r13
+			pushq	%rdx
+			movq	__gc_stack_top@gottpoff(%rip), %rax
+			movq	%fs:(%rax), %r12
+			movq	__gc_stack_bottom@gottpoff(%rip), %rax
+			movq	%fs:(%rax), %r13
+			movq	%r12, %rbx
+			jmp 	next
+
+loop:
+			movq	(%rbx), %rax
+
+	// check that it is not a pointer to code section
+	// i.e. the following is not true:
+	// __executable_start <= (%rbx) <= __etext
+check11:
+			leaq	__executable_start(%rip), %rdx
+			cmpq	%rax, %rdx
+			jna	check12
+			jmp	check21
+
+check12:
+			leaq	__etext(%rip), %rdx
+			cmpq	%rax, %rdx
+			jnb	next
+
+	// check that it is not a pointer into the program stack
+	// i.e. the following is not true:
+	// __gc_stack_top <= (%rbx) <= __gc_stack_bottom
+check21:
+			cmpq	%rax, %r12
+			jna	check22
+			jmp	loop2
+
+check22:
+			cmpq	%rax, %r13
+			jnb	next
+
+	// check if it a valid pointer
+	// i.e. the lastest bit is set to zero
+loop2:
+			andq	$0x00000001, %rax
+			jnz     next
+gc_run_t:
+			movq	%rbx, %rdi
+			call	gc_test_and_copy_root
+
+next:
+			addq	$8, %rbx
+			cmpq	%rbx, %r13
+			jne	loop
+returnn:
+			movq	$0, %rax
+			popq	%rdx
+			popq	%r13
+			popq	%r12
+			popq	%rbx
+			movq	%rbp, %rsp
+			popq	%rbp
+			ret
+
+			.section	.note.GNU-stack,"",@progbits
@@ -12,6 +12,9 @@
 # include <regex.h>
 # include <time.h>
 # include <limits.h>
+# include <ctype.h>
+# include <unistd.h>
+# include <pthread.h>
 
 #include "runtime.h"
 
@@ -23,14 +26,17 @@
 /* # define DEBUG_PRINT 1 */
 
 #ifdef DEBUG_PRINT
-int indent = 0;
+_Thread_local int indent = 0;
 void print_indent (void) {
   for (int i = 0; i < indent; i++) printf (" ");
   printf("| ");
 }
 #endif
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+/* Isolates: all the state of the runtime, the heap, the roots and the
+   buffers, is thread-local, so that every thread can run its own program;
+   only the settings of the command line are shared */
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
 
 /* GC pool structure and data; declared here in order to allow debug print */
 typedef struct {
@@ -40,9 +46,9 @@ typedef struct {
   size_t   size;
 } pool;
 
-static pool from_space;
-static pool to_space;
-size_t      *current;
+static _Thread_local pool from_space;
+static _Thread_local pool to_space;
+_Thread_local size_t     *current;
 /* end */
 
 # ifdef __ENABLE_GC__
@@ -67,65 +73,219 @@ void __post_gc_subst () {}
 #endif
 
 /* GC extra roots */
-#define MAX_EXTRA_ROOTS_NUMBER 16
-typedef struct {
-  int current_free;
-  void ** roots[MAX_EXTRA_ROOTS_NUMBER];
-} extra_roots_pool;
+#define EXTRA_ROOTS_INIT 64
 
-static extra_roots_pool extra_roots;
+_Thread_local extra_roots_pool extra_roots;
 
 void clear_extra_roots (void) {
   extra_roots.current_free = 0;
 }
 
-void push_extra_root (void ** p) {
+void grow_extra_roots (void) {
+  size_t size  = extra_roots.size ? extra_roots.size << 1 : EXTRA_ROOTS_INIT;
+  void ***roots = (void***) realloc (extra_roots.roots, size * sizeof (void**));
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf ("push_extra_root %p %p\n", p, &p); fflush (stdout);
+  printf ("grow_extra_roots %zu -> %zu\n", extra_roots.size, size); fflush (stdout);
+  indent--;
 #endif
-  if (extra_roots.current_free >= MAX_EXTRA_ROOTS_NUMBER) {
-    perror ("ERROR: push_extra_roots: extra_roots_pool overflow");
+  if (roots == NULL) {
+    perror ("ERROR: grow_extra_roots: unable to allocate memory");
     exit   (1);
   }
-  extra_roots.roots[extra_roots.current_free] = p;
-  extra_roots.current_free++;
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
+  extra_roots.roots = roots;
+  extra_roots.size  = size;
 }
 
-void pop_extra_root (void ** p) {
-#ifdef DEBUG_PRINT
-  indent++; print_indent ();
-  printf ("pop_extra_root %p %p\n", p, &p); fflush (stdout);
-#endif
-  if (extra_roots.current_free == 0) {
-    perror ("ERROR: pop_extra_root: extra_roots are empty");
-    exit   (1);
+/* end */
+
+/* Buffered output of write and printf: the buffer goes to stdout (or the
+   output descriptor of the thread) when full, before reading, on failure
+   and at exit of the thread or the process; or after every line if
+   requested */
+# define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static _Thread_local char   output_buffer[OUTPUT_BUFFER_SIZE];
+static _Thread_local size_t output_length;
+static _Thread_local int    output_fd = STDOUT_FILENO;
+static _Thread_local int    output_keyed;
+static int            output_line_buffered;
+static pthread_once_t output_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  output_key;
+
+/* Writes n bytes at s to the output descriptor */
+static void write_output (const char *s, size_t n) {
+  size_t done = 0;
+
+  while (done < n) {
+    ssize_t k = write (output_fd, s + done, n - done);
+
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      output_length = 0;
+      fprintf (stderr, "*** FAILURE: write: %s\n", strerror (errno));
+      _exit   (255);
+    }
+
+    done += k;
   }
-  extra_roots.current_free--;
-  if (extra_roots.roots[extra_roots.current_free] != p) {
-#ifdef DEBUG_PRINT
-    print_indent ();
-    printf ("%i %p %p", extra_roots.current_free,
-	    extra_roots.roots[extra_roots.current_free], p);
-    fflush (stdout);
-#endif
-    perror ("ERROR: pop_extra_root: stack invariant violation");
-    exit   (1);
+}
+
+void flush_output (void) {
+  fflush (stdout);
+  write_output (output_buffer, output_length);
+  output_length = 0;
+}
+
+void set_output_line_buffered (int flag) {
+  output_line_buffered = flag;
+}
+
+void set_output_fd (int fd) {
+  flush_output ();
+  output_fd = fd;
+}
+
+/* The key destructor flushes the buffer of an exiting thread; the
+   atexit hook, that of the thread which ends the process */
+static void flush_thread_output (void *unused) {
+  (void) unused;
+  flush_output ();
+}
+
+static void register_output (void) {
+  atexit (flush_output);
+  pthread_key_create (&output_key, flush_thread_output);
+}
+
+static void output (const char *s, size_t n) {
+  if (!output_keyed) {
+    pthread_once (&output_once, register_output);
+    pthread_setspecific (output_key, output_buffer);
+    output_keyed = 1;
   }
-#ifdef DEBUG_PRINT
-  indent--;
-#endif
+
+  if (output_length + n > OUTPUT_BUFFER_SIZE) {
+    flush_output ();
+  }
+
+  /* What does not fit in the buffer bypasses it */
+  if (n >= OUTPUT_BUFFER_SIZE) {
+    write_output (s, n);
+    return;
+  }
+
+  memcpy (output_buffer + output_length, s, n);
+  output_length += n;
 }
 
-/* end */
+/* Formats n in decimal backwards from end; returns the first digit */
+static char* format_aint (char *end, aint n) {
+  auint u = n < 0 ? -(auint) n : (auint) n;
+
+  do {
+    *--end = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (n < 0) *--end = '-';
+
+  return end;
+}
+
+static void failure (char *s, ...);
+
+/* Buffered input of read and readLine. Prompts are printed only in the
+   interactive mode, which by default is on when stdin is a terminal */
+# define INPUT_BUFFER_SIZE (64 * 1024)
+
+static _Thread_local char  input_buffer[INPUT_BUFFER_SIZE];
+static _Thread_local char *input_ptr;
+static _Thread_local char *input_end;
+static _Thread_local int   input_fd = STDIN_FILENO;
+static int   input_interactive = -1;
+
+void set_input_interactive (int flag) {
+  input_interactive = flag;
+}
+
+/* Switches the input of the thread to fd, dropping anything buffered */
+void set_input_fd (int fd) {
+  input_fd  = fd;
+  input_ptr = input_end = NULL;
+}
+
+/* Returns the next input character without consuming it, or EOF */
+static int input_peek (void) {
+  if (input_ptr == input_end) {
+    ssize_t n;
+
+    do n = read (input_fd, input_buffer, INPUT_BUFFER_SIZE);
+    while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+      failure ("read: %s\n", strerror (errno));
+    }
+
+    if (n == 0) return EOF;
+
+    input_ptr = input_buffer;
+    input_end = input_buffer + n;
+  }
+
+  return (unsigned char) *input_ptr;
+}
 
-static void vfailure (char *s, va_list args) {
+/* Scans a decimal integer like scanf ("%d") does; returns 0 and leaves
+   the offending character unread if there is none */
+static int input_aint (aint *n) {
+  auint u   = 0;
+  int   neg = 0, c;
+
+  while ((c = input_peek ()) != EOF && isspace (c)) input_ptr++;
+
+  if (c == '-' || c == '+') {
+    neg = c == '-';
+    input_ptr++;
+    c = input_peek ();
+  }
+
+  if (c == EOF || !isdigit (c)) return 0;
+
+  do {
+    u = u * 10 + (c - '0');
+    input_ptr++;
+  } while ((c = input_peek ()) != EOF && isdigit (c));
+
+  *n = neg ? -(aint) u : (aint) u;
+
+  return 1;
+}
+
+static _Thread_local jmp_buf *failure_handler;
+
+void set_failure_handler (jmp_buf *handler) {
+  failure_handler = handler;
+}
+
+static _Thread_local void (*failure_location) (void);
+
+void set_failure_location (void (*where) (void)) {
+  failure_location = where;
+}
+
+/* Leaves after a failure: to the handler of the thread if there is one */
+static void failure_exit (void) {
+  if (failure_handler != NULL) longjmp (*failure_handler, 1);
+  exit (255);
+}
+
+extern void vfailure (char *s, va_list args) {
+  flush_output ();
   fprintf  (stderr, "*** FAILURE: ");
   vfprintf (stderr, s, args); // vprintf (char *, va_list) <-> printf (char *, ...)
-  exit     (255);
+  if (failure_location != NULL) failure_location ();
+  failure_exit ();
 }
 
 static void failure (char *s, ...) {
@@ -135,12 +295,15 @@ static void failure (char *s, ...) {
   vfailure (s, args);
 }
 
+static char* string_chars (void *p, char **tmp);
+
 void Lassert (void *f, char *s, ...) {
   if (!UNBOX(f)) {
     va_list args;
+    char   *tmp;
 
     va_start (args, s);
-    vfailure (s, args);    
+    vfailure (string_chars (s, &tmp), args);
   }
 }
 
@@ -163,20 +326,20 @@ void Lassert (void *f, char *s, ...) {
 //} sexp;
 
 extern void* alloc    (size_t);
-extern void* Bsexp    (int n, ...);
-extern int   LtagHash (char*);
+extern void* Bsexp    (aint n, ...);
+extern aint  LtagHash (char*);
 
-void *global_sysargs;
+_Thread_local void *global_sysargs;
 
 // Gets a raw tag
-extern int LkindOf (void *p) {
+extern aint LkindOf (void *p) {
   if (UNBOXED(p)) return UNBOXED_TAG;
   
   return TAG(TO_DATA(p)->tag);
 }
 
 // Compare sexprs tags
-extern int LcompareTags (void *p, void *q) {
+extern aint LcompareTags (void *p, void *q) {
   data *pd, *qd;
   
   ASSERT_BOXED ("compareTags, 0", p);
@@ -193,7 +356,7 @@ extern int LcompareTags (void *p, void *q) {
       BOX((GET_SEXP_TAG(TO_SEXP(p)->tag)) - (GET_SEXP_TAG(TO_SEXP(p)->tag)));
     #endif      
   }
-  else failure ("not a sexpr in compareTags: %d, %d\n", TAG(pd->tag), TAG(qd->tag));    
+  else failure ("not a sexpr in compareTags: %d, %d\n", (int) TAG(pd->tag), (int) TAG(qd->tag));    
           
   return 0; // never happens
 }
@@ -216,7 +379,7 @@ void* Ls__Infix_58 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "!!";
-int Ls__Infix_3333 (void *p, void *q) {
+aint Ls__Infix_3333 (void *p, void *q) {
   ASSERT_UNBOXED("captured !!:1", p);
   ASSERT_UNBOXED("captured !!:2", q);
 
@@ -224,7 +387,7 @@ int Ls__Infix_3333 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "&&";
-int Ls__Infix_3838 (void *p, void *q) {
+aint Ls__Infix_3838 (void *p, void *q) {
   ASSERT_UNBOXED("captured &&:1", p);
   ASSERT_UNBOXED("captured &&:2", q);
 
@@ -232,12 +395,12 @@ int Ls__Infix_3838 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "==";
-int Ls__Infix_6161 (void *p, void *q) {
+aint Ls__Infix_6161 (void *p, void *q) {
   return BOX(p == q);
 }
 
 // Functional synonym for built-in operator "!=";
-int Ls__Infix_3361 (void *p, void *q) {
+aint Ls__Infix_3361 (void *p, void *q) {
   ASSERT_UNBOXED("captured !=:1", p);
   ASSERT_UNBOXED("captured !=:2", q);
 
@@ -245,7 +408,7 @@ int Ls__Infix_3361 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<=";
-int Ls__Infix_6061 (void *p, void *q) {
+aint Ls__Infix_6061 (void *p, void *q) {
   ASSERT_UNBOXED("captured <=:1", p);
   ASSERT_UNBOXED("captured <=:2", q);
 
@@ -253,7 +416,7 @@ int Ls__Infix_6061 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "<";
-int Ls__Infix_60 (void *p, void *q) {
+aint Ls__Infix_60 (void *p, void *q) {
   ASSERT_UNBOXED("captured <:1", p);
   ASSERT_UNBOXED("captured <:2", q);
 
@@ -261,7 +424,7 @@ int Ls__Infix_60 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">=";
-int Ls__Infix_6261 (void *p, void *q) {
+aint Ls__Infix_6261 (void *p, void *q) {
   ASSERT_UNBOXED("captured >=:1", p);
   ASSERT_UNBOXED("captured >=:2", q);
 
@@ -269,7 +432,7 @@ int Ls__Infix_6261 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator ">";
-int Ls__Infix_62 (void *p, void *q) {
+aint Ls__Infix_62 (void *p, void *q) {
   ASSERT_UNBOXED("captured >:1", p);
   ASSERT_UNBOXED("captured >:2", q);
 
@@ -277,7 +440,7 @@ int Ls__Infix_62 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "+";
-int Ls__Infix_43 (void *p, void *q) {
+aint Ls__Infix_43 (void *p, void *q) {
   ASSERT_UNBOXED("captured +:1", p);
   ASSERT_UNBOXED("captured +:2", q);
 
@@ -285,7 +448,7 @@ int Ls__Infix_43 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "-";
-int Ls__Infix_45 (void *p, void *q) {
+aint Ls__Infix_45 (void *p, void *q) {
   if (UNBOXED(p)) {
     ASSERT_UNBOXED("captured -:2", q);
     return BOX(UNBOX(p) - UNBOX(q));
@@ -296,7 +459,7 @@ int Ls__Infix_45 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "*";
-int Ls__Infix_42 (void *p, void *q) {
+aint Ls__Infix_42 (void *p, void *q) {
   ASSERT_UNBOXED("captured *:1", p);
   ASSERT_UNBOXED("captured *:2", q);
 
@@ -304,7 +467,7 @@ int Ls__Infix_42 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "/";
-int Ls__Infix_47 (void *p, void *q) {
+aint Ls__Infix_47 (void *p, void *q) {
   ASSERT_UNBOXED("captured /:1", p);
   ASSERT_UNBOXED("captured /:2", q);
 
@@ -312,14 +475,14 @@ int Ls__Infix_47 (void *p, void *q) {
 }
 
 // Functional synonym for built-in operator "%";
-int Ls__Infix_37 (void *p, void *q) {
+aint Ls__Infix_37 (void *p, void *q) {
   ASSERT_UNBOXED("captured %:1", p);
   ASSERT_UNBOXED("captured %:2", q);
 
   return BOX(UNBOX(p) % UNBOX(q));
 }
 
-extern int Blength (void *p) {
+extern aint Blength (void *p) {
   data *a = (data*) BOX (NULL);
   
   ASSERT_BOXED(".length", p);
@@ -330,9 +493,9 @@ extern int Blength (void *p) {
 
 static char* chars = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
 
-extern char* de_hash (int);
+extern char* de_hash (aint);
 
-extern int LtagHash (char *s) {
+extern aint LtagHash (char *s) {
   char *p;
   int  h = 0, limit = 0;
                
@@ -357,9 +520,9 @@ extern int LtagHash (char *s) {
   return BOX(h);
 }
 
-char* de_hash (int n) {
+char* de_hash (aint n) {
   //  static char *chars = (char*) BOX (NULL);
-  static char buf[6] = {0,0,0,0,0,0};
+  static _Thread_local char buf[6] = {0,0,0,0,0,0};
   char *p = (char *) BOX (NULL);
   p = &buf[5];
 
@@ -392,7 +555,7 @@ typedef struct {
   int len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static _Thread_local StringBuf stringBuf;
 
 # define STRINGBUF_INIT 128
 
@@ -417,11 +580,14 @@ static void vprintStringBuf (char *fmt, va_list args) {
   int     written = 0,
           rest    = 0;
   char   *buf     = (char*) BOX(NULL);
+  va_list vsargs;
 
  again:
   buf     = &stringBuf.contents[stringBuf.ptr];
   rest    = stringBuf.len - stringBuf.ptr;
-  written = vsnprintf (buf, rest, fmt, args);
+  va_copy (vsargs, args);
+  written = vsnprintf (buf, rest, fmt, vsargs);
+  va_end  (vsargs);
   
   if (written >= rest) {
     extendStringBuf ();
@@ -440,99 +606,405 @@ static void printStringBuf (char *fmt, ...) {
 
 int is_valid_heap_pointer (void *p);
 
-extern void printValue (void *p) {
-  data *a = (data*) BOX(NULL);
-  int i   = BOX(0);
-  if (UNBOXED(p)) printStringBuf ("%d", UNBOX(p));
-  else {
-    if (! is_valid_heap_pointer(p)) {
-      printStringBuf ("0x%x", p);
-      return;
+/* Ropes */
+
+/* Results of ++ shorter than this are built flat */
+# define ROPE_MIN_LENGTH 64
+
+# define ROPE_LEFT(d)  (((void**) (d)->contents)[0])
+# define ROPE_RIGHT(d) (((void**) (d)->contents)[1])
+
+/* Non-flattened rope node behind the header d */
+# define IS_ROPE_NODE(d) (IS_ROPE((d)->tag) && !UNBOXED(ROPE_RIGHT(d)))
+
+extern void* LmakeString (aint length);
+
+/* Copies the characters of a string or a rope into dst. A node whose
+   left or right part is flat goes on with the other part, so the spines
+   of append and prepend loops take no memory; the right parts of nodes
+   with two rope parts wait on an explicit stack */
+static void copy_flat (char *dst, data *d) {
+  if (IS_ROPE(d->tag)) d = TO_DATA(ROPE_LEFT(d));
+  memcpy (dst, d->contents, LEN(d->tag));
+}
+
+static void rope_copy (char *dst, data *d) {
+  struct { char *dst; data *d; } *stack = NULL;
+  size_t n = 0, size = 0;
+
+  for (;;) {
+    while (IS_ROPE_NODE(d)) {
+      data *l = TO_DATA(ROPE_LEFT(d)), *r = TO_DATA(ROPE_RIGHT(d));
+      char *right = dst + LEN(d->tag) - LEN(r->tag);
+
+      if (!IS_ROPE_NODE(r)) {
+        copy_flat (right, r);
+      } else if (!IS_ROPE_NODE(l)) {
+        copy_flat (dst, l);
+        dst = right;
+        l = r;
+      } else {
+        if (n == size) {
+          size  = size == 0 ? 64 : 2 * size;
+          stack = realloc (stack, size * sizeof (*stack));
+          if (stack == NULL) failure ("unable to allocate memory for a string\n");
+        }
+        stack[n].dst = right;
+        stack[n].d   = r;
+        n++;
+      }
+
+      d = l;
     }
-    
-    a = TO_DATA(p);
 
-    switch (TAG(a->tag)) {      
+    copy_flat (dst, d);
+
+    if (n == 0) break;
+    n--;
+    dst = stack[n].dst;
+    d   = stack[n].d;
+  }
+
+  free (stack);
+}
+
+/* Characters of a string without allocating in the heap: a rope which is
+   not flattened yet is copied into a malloc'ed buffer returned in *tmp */
+static char* string_chars (void *p, char **tmp) {
+  data *d = TO_DATA(p);
+
+  *tmp = NULL;
+
+  if (!IS_ROPE(d->tag)) return (char*) p;
+  if (!IS_ROPE_NODE(d)) return (char*) ROPE_LEFT(d);
+
+  *tmp = (char*) malloc (LEN(d->tag) + 1);
+
+  if (*tmp == NULL) {
+    failure ("unable to allocate memory for a string\n");
+  }
+
+  rope_copy (*tmp, d);
+  (*tmp)[LEN(d->tag)] = 0;
+
+  return *tmp;
+}
+
+/* Flattens a rope into a fresh flat string cached in the rope node;
+   any other value is returned as is */
+extern void* Bflatten (void *p) {
+  data *d;
+  char *f;
+
+  if (UNBOXED(p)) return p;
+
+  d = TO_DATA(p);
+
+  if (TAG(d->tag) != STRING_TAG || !IS_ROPE(d->tag)) return p;
+  if (!IS_ROPE_NODE(d)) return ROPE_LEFT(d);
+
+  __pre_gc ();
+
+  push_extra_root (&p);
+  f = (char*) LmakeString (BOX(LEN(d->tag)));
+  pop_extra_root (&p);
+
+  d = TO_DATA(p);
+  rope_copy (f, d);
+  f[LEN(d->tag)] = 0;
+
+  ROPE_LEFT(d)  = f;
+  ROPE_RIGHT(d) = (void*) BOX(0);
+
+  __post_gc ();
+
+  return f;
+}
+
+/* Makes a part for a new rope. A rope node is cloned and a flat string is
+   copied since both stay mutable through the original value; the parts
+   themselves are never visible to Lama code and are never mutated */
+static void* rope_part (void *p) {
+  data *d = TO_DATA(p), *r;
+  void *s;
+
+  __pre_gc ();
+
+  push_extra_root (&p);
+
+  if (IS_ROPE_NODE(d)) {
+    r = (data*) alloc (3 * sizeof (aint));
+    d = TO_DATA(p);
+    r->tag = d->tag;
+    ROPE_LEFT(r)  = ROPE_LEFT(d);
+    ROPE_RIGHT(r) = ROPE_RIGHT(d);
+    s = r->contents;
+  }
+  else {
+    s = LmakeString (BOX(LEN(d->tag)));
+    d = TO_DATA(Bflatten (p));
+    memcpy (s, d->contents, LEN(d->tag) + 1);
+  }
+
+  pop_extra_root (&p);
+
+  __post_gc ();
+
+  return s;
+}
+
+/* Flattens two strings keeping each rooted while the other is flattened */
+static void flatten_strings (void **p, void **q) {
+  push_extra_root (q);
+  *p = Bflatten (*p);
+  pop_extra_root (q);
+
+  push_extra_root (p);
+  *q = Bflatten (*q);
+  pop_extra_root (p);
+}
+
+/* Value printer. The printer walks the value iteratively with an explicit
+   stack of the objects being printed, and either only counts the output,
+   copies it to a preallocated buffer or passes it to a write function */
+typedef struct {
+  char   *dst;                               /* where to copy the output  */
+  void  (*write) (const char *s, size_t n);  /* or where to pass it       */
+  size_t  len;                               /* the length of the output  */
+} printer;
+
+typedef struct {
+  data *d;      /* the object being printed, the current cell for lists    */
+  aint  i;      /* the index of its element being printed                  */
+  char  close;  /* its closing bracket; '}' for lists                      */
+} print_frame;
+
+static void print_chars (printer *pr, const char *s, size_t n) {
+  if (pr->dst) memcpy (pr->dst + pr->len, s, n);
+  else if (pr->write) pr->write (s, n);
+  pr->len += n;
+}
+
+static void print_string (printer *pr, void *p) {
+  data *d = TO_DATA(p);
+
+  if (pr->dst) rope_copy (pr->dst + pr->len, d);
+  else if (pr->write) {
+    char *tmp;
+
+    pr->write (string_chars (p, &tmp), LEN(d->tag));
+    free (tmp);
+  }
+
+  pr->len += LEN(d->tag);
+}
+
+static void print_aint (printer *pr, aint n) {
+  char buf[3 * sizeof (aint) + 1], *end = buf + sizeof (buf);
+  char *p = format_aint (end, n);
+
+  print_chars (pr, p, end - p);
+}
+
+static void print_hex (printer *pr, size_t n) {
+  char buf[2 * sizeof (size_t) + 2], *p = buf + sizeof (buf);
+
+  do {
+    *--p = "0123456789abcdef"[n & 0xF];
+    n >>= 4;
+  } while (n);
+
+  *--p = 'x';
+  *--p = '0';
+  print_chars (pr, p, buf + sizeof (buf) - p);
+}
+
+/* Constructor names by tag, computed by de_hash once per tag */
+# define TAG_NAMES_SIZE 256
+
+static _Thread_local struct {
+  aint   tag;
+  size_t len;
+  char   name[8];
+} tag_names[TAG_NAMES_SIZE];
+
+static const char* tag_name (aint tag, size_t *len) {
+  size_t k = ((auint) tag >> 1) % TAG_NAMES_SIZE;
+
+  if (tag_names[k].tag != tag || tag_names[k].len == 0) {
+#ifndef DEBUG_PRINT
+    char *name = de_hash (tag);
+#else
+    char *name = de_hash (GET_SEXP_TAG(tag));
+#endif
+    tag_names[k].tag = tag;
+    tag_names[k].len = strlen (name);
+    memcpy (tag_names[k].name, name, tag_names[k].len + 1);
+  }
+
+  *len = tag_names[k].len;
+  return tag_names[k].name;
+}
+
+static void print_value (printer *pr, void *p) {
+  print_frame *stack = NULL, *f;
+  size_t       sp = 0, size = 0;
+
+ value:
+  if (UNBOXED(p)) print_aint (pr, UNBOX(p));
+  else if (! is_valid_heap_pointer (p)) print_hex (pr, (size_t) p);
+  else {
+    data *a = TO_DATA(p);
+    char  close = 0;
+    aint  first = 0;
+
+    switch (TAG(a->tag)) {
     case STRING_TAG:
-      printStringBuf ("\"%s\"", a->contents);
+      print_chars  (pr, "\"", 1);
+      print_string (pr, p);
+      print_chars  (pr, "\"", 1);
       break;
 
     case CLOSURE_TAG:
-      printStringBuf ("<closure ");
-      for (i = 0; i < LEN(a->tag); i++) {
-	if (i) printValue ((void*)((int*) a->contents)[i]);
-	else printStringBuf ("0x%x", (void*)((int*) a->contents)[i]);
-	
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
+      print_chars (pr, "<closure ", 9);
+      if (LEN(a->tag) > 0) print_hex (pr, (size_t) ((aint*) a->contents)[0]);
+      if (LEN(a->tag) > 1) {
+        print_chars (pr, ", ", 2);
+        close = '>';
+        first = 1;
       }
-      printStringBuf (">");
+      else print_chars (pr, ">", 1);
       break;
-      
+
     case ARRAY_TAG:
-      printStringBuf ("[");
-      for (i = 0; i < LEN(a->tag); i++) {
-        printValue ((void*)((int*) a->contents)[i]);
-	if (i != LEN(a->tag) - 1) printStringBuf (", ");
-      }
-      printStringBuf ("]");
+      print_chars (pr, "[", 1);
+      if (LEN(a->tag) > 0) close = ']';
+      else print_chars (pr, "]", 1);
       break;
-      
+
     case SEXP_TAG: {
-#ifndef DEBUG_PRINT
-      char * tag = de_hash (TO_SEXP(p)->tag);
-#else
-      char * tag = de_hash (GET_SEXP_TAG(TO_SEXP(p)->tag));
-#endif      
-      
-      if (strcmp (tag, "cons") == 0) {
-	data *b = a;
-	
-	printStringBuf ("{");
+      size_t      len;
+      const char *tag = tag_name (TO_SEXP(p)->tag, &len);
 
-	while (LEN(a->tag)) {
-	  printValue ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
-	  if (! UNBOXED(b)) {
-	    printStringBuf (", ");
-	    b = TO_DATA(b);
-	  }
-	  else break;
-	}
-	
-	printStringBuf ("}");
+      if (len == 4 && memcmp (tag, "cons", 4) == 0) {
+        print_chars (pr, "{", 1);
+        if (LEN(a->tag) > 0) close = '}';
+        else print_chars (pr, "}", 1);
       }
       else {
-	printStringBuf ("%s", tag);
-	if (LEN(a->tag)) {
-	  printStringBuf (" (");
-	  for (i = 0; i < LEN(a->tag); i++) {
-	    printValue ((void*)((int*) a->contents)[i]);
-	    if (i != LEN(a->tag) - 1) printStringBuf (", ");
-	  }
-	  printStringBuf (")");
-	}
+        print_chars (pr, tag, len);
+        if (LEN(a->tag) > 0) {
+          print_chars (pr, " (", 2);
+          close = ')';
+        }
       }
+      break;
     }
-    break;
 
     default:
-      printStringBuf ("*** invalid tag: 0x%x ***", TAG(a->tag));
+      print_chars (pr, "*** invalid tag: ", 17);
+      print_hex   (pr, TAG(a->tag));
+      print_chars (pr, " ***", 4);
+    }
+
+    if (close) {
+      if (sp == size) {
+        size  = size ? 2 * size : 16;
+        stack = (print_frame*) realloc (stack, size * sizeof (print_frame));
+
+        if (stack == NULL) {
+          failure ("unable to allocate memory for printing a value\n");
+        }
+      }
+
+      stack[sp].d     = a;
+      stack[sp].i     = first;
+      stack[sp].close = close;
+      sp++;
+
+      p = ((void**) a->contents)[first];
+      goto value;
     }
   }
+
+  /* The value is printed: go on with the next element of the innermost
+     unfinished object, closing the finished ones */
+  while (sp > 0) {
+    f = &stack[sp - 1];
+
+    if (f->close == '}') {
+      void *next = ((void**) f->d->contents)[1];
+
+      if (! UNBOXED(next)) {
+        print_chars (pr, ", ", 2);
+        f->d = TO_DATA(next);
+        p    = ((void**) f->d->contents)[0];
+        goto value;
+      }
+    }
+    else if (++f->i < LEN(f->d->tag)) {
+      print_chars (pr, ", ", 2);
+      p = ((void**) f->d->contents)[f->i];
+      goto value;
+    }
+
+    print_chars (pr, &f->close, 1);
+    sp--;
+  }
+
+  free (stack);
+}
+
+/* The length of the printed representation of a value */
+static size_t value_length (void *p) {
+  printer pr = {NULL, NULL, 0};
+
+  print_value (&pr, p);
+
+  return pr.len;
+}
+
+static void error_output (const char *s, size_t n) {
+  fwrite (s, 1, n, stderr);
+}
+
+/* Prints a value to the standard output */
+extern void printValue (void *p) {
+  printer pr = {NULL, output, 0};
+
+  print_value (&pr, p);
+}
+
+static _Thread_local FILE *value_file;
+
+static void file_output (const char *s, size_t n) {
+  fwrite (s, 1, n, value_file);
+}
+
+/* Prints a value to f; unlike Bstringval it does not allocate in the heap */
+extern void fprintValue (FILE *f, void *p) {
+  printer pr = {NULL, file_output, 0};
+
+  value_file = f;
+  print_value (&pr, p);
 }
 
 static void stringcat (void *p) {
   data *a;
-  int i;
+  aint i;
   
   if (UNBOXED(p)) ;
   else {
     a = TO_DATA(p);
 
     switch (TAG(a->tag)) {      
-    case STRING_TAG:
-      printStringBuf ("%s", a->contents);
+    case STRING_TAG: {
+      char *tmp;
+
+      printStringBuf ("%s", string_chars (p, &tmp));
+      free (tmp);
       break;
+    }
       
     case SEXP_TAG: {
 #ifndef DEBUG_PRINT
@@ -544,8 +1016,8 @@ static void stringcat (void *p) {
 	data *b = a;
 	
 	while (LEN(a->tag)) {
-	  stringcat ((void*)((int*) b->contents)[0]);
-	  b = (data*)((int*) b->contents)[1];
+	  stringcat ((void*)((aint*) b->contents)[0]);
+	  b = (data*)((aint*) b->contents)[1];
 	  if (! UNBOXED(b)) {
 	    b = TO_DATA(b);
 	  }
@@ -557,18 +1029,89 @@ static void stringcat (void *p) {
     break;
 
     default:
-      printStringBuf ("*** invalid tag: 0x%x ***", TAG(a->tag));
+      printStringBuf ("*** invalid tag: 0x%x ***", (int) TAG(a->tag));
     }
   }
 }
 
-extern int LmatchSubString (char *subj, char *patt, int pos) {
-  data *p = TO_DATA(patt), *s = TO_DATA(subj);
-  int   n;
+/* Length of the string stringcat builds from p, or -1 if p contains
+   anything but strings and lists of them */
+static aint stringcat_length (void *p) {
+  data *a;
+  aint  n = 0, m;
+
+  if (UNBOXED(p)) return 0;
+
+  a = TO_DATA(p);
+
+  switch (TAG(a->tag)) {
+  case STRING_TAG:
+    return LEN(a->tag);
+
+  case SEXP_TAG: {
+#ifndef DEBUG_PRINT
+    char * tag = de_hash (TO_SEXP(p)->tag);
+#else
+    char * tag = de_hash (GET_SEXP_TAG(TO_SEXP(p)->tag));
+#endif
+    data *b = a;
+
+    if (strcmp (tag, "cons") != 0) return -1;
+
+    while (LEN(a->tag)) {
+      if ((m = stringcat_length ((void*)((aint*) b->contents)[0])) < 0) return -1;
+      n += m;
+      b = (data*)((aint*) b->contents)[1];
+      if (! UNBOXED(b)) b = TO_DATA(b);
+      else break;
+    }
+
+    return n;
+  }
+
+  default:
+    return -1;
+  }
+}
+
+/* Copies the strings of p measured by stringcat_length to dst; returns
+   the end of the copied characters */
+static char* stringcat_copy (char *dst, void *p) {
+  data *a;
+
+  if (UNBOXED(p)) return dst;
+
+  a = TO_DATA(p);
+
+  if (TAG(a->tag) == STRING_TAG) {
+    rope_copy (dst, a);
+    return dst + LEN(a->tag);
+  }
+  else {
+    data *b = a;
+
+    while (LEN(a->tag)) {
+      dst = stringcat_copy (dst, (void*)((aint*) b->contents)[0]);
+      b = (data*)((aint*) b->contents)[1];
+      if (! UNBOXED(b)) b = TO_DATA(b);
+      else break;
+    }
+
+    return dst;
+  }
+}
+
+extern aint LmatchSubString (char *subj, char *patt, aint pos) {
+  data *p, *s;
+  aint  n;
 
   ASSERT_STRING("matchSubString:1", subj);
   ASSERT_STRING("matchSubString:2", patt);
   ASSERT_UNBOXED("matchSubString:3", pos);
+
+  flatten_strings ((void**) &subj, (void**) &patt);
+  p = TO_DATA(patt);
+  s = TO_DATA(subj);
   
   n = LEN (p->tag);
 
@@ -578,21 +1121,24 @@ extern int LmatchSubString (char *subj, char *patt, int pos) {
   return BOX(strncmp (subj + UNBOX(pos), patt, n) == 0);
 }
 
-extern void* Lsubstring (void *subj, int p, int l) {
+extern void* Lsubstring (void *subj, aint p, aint l) {
   data *d = TO_DATA(subj);
-  int pp = UNBOX (p), ll = UNBOX (l);
+  aint pp = UNBOX (p), ll = UNBOX (l);
 
   ASSERT_STRING("substring:1", subj);
   ASSERT_UNBOXED("substring:2", p);
   ASSERT_UNBOXED("substring:3", l);
+
+  subj = Bflatten (subj);
+  d    = TO_DATA(subj);
       
-  if (pp + ll <= LEN(d->tag)) {
+  if (pp >= 0 && ll >= 0 && pp + ll <= LEN(d->tag)) {
     data *r;
     
     __pre_gc ();
 
     push_extra_root (&subj);
-    r = (data*) alloc (ll + 1 + sizeof (int));
+    r = (data*) alloc (ll + 1 + sizeof (aint));
     pop_extra_root (&subj);
 
     r->tag = STRING_TAG | (ll << 3);
@@ -604,31 +1150,36 @@ extern void* Lsubstring (void *subj, int p, int l) {
     return r->contents;    
   }
   
-  failure ("substring: index out of bounds (position=%d, length=%d, \
-            subject length=%d)", pp, ll, LEN(d->tag));
+  failure ("substring: index out of bounds (position=%" PRIdAI ", length=%" PRIdAI
+           ", subject length=%" PRIdAI ")\n", pp, ll, LEN(d->tag));
 }
 
 extern struct re_pattern_buffer *Lregexp (char *regexp) {
-  regex_t *b = (regex_t*) malloc (sizeof (regex_t));
+  regex_t *b;
+
+  regexp = Bflatten (regexp);
+  b      = (regex_t*) malloc (sizeof (regex_t));
 
   memset (b, 0, sizeof (regex_t));
   
-  int n = (int) re_compile_pattern (regexp, strlen (regexp), b);
+  const char *err = re_compile_pattern (regexp, strlen (regexp), b);
   
-  if (n != 0) {
-    failure ("%", strerror (n));
+  if (err != NULL) {
+    failure ("regexp: %s\n", err);
   };
 
   return b;
 }
 
-extern int LregexpMatch (struct re_pattern_buffer *b, char *s, int pos) {
-  int res;
+extern aint LregexpMatch (struct re_pattern_buffer *b, char *s, aint pos) {
+  aint res;
   
   ASSERT_BOXED("regexpMatch:1", b);
   ASSERT_STRING("regexpMatch:2", s);
   ASSERT_UNBOXED("regexpMatch:3", pos);
 
+  s = Bflatten (s);
+
   res = re_match (b, s, LEN(TO_DATA(s)->tag), UNBOX(pos), 0);
 
   if (res) {
@@ -655,7 +1206,7 @@ void *Lclone (void *p) {
   if (UNBOXED(p)) return p;
   else {
     data *a = TO_DATA(p);
-    int t   = TAG(a->tag), l = LEN(a->tag);
+    aint t  = TAG(a->tag), l = LEN(a->tag);
 
     push_extra_root (&p);
     switch (t) {
@@ -664,7 +1215,7 @@ void *Lclone (void *p) {
       print_indent ();
       printf ("Lclone: string1 &p=%p p=%p\n", &p, p); fflush (stdout);
 #endif
-      res = Bstring (TO_DATA(p)->contents);
+      res = Bstring (Bflatten (p));
 #ifdef DEBUG_PRINT
       print_indent ();
       printf ("Lclone: string2 %p %p\n", &p, p); fflush (stdout);
@@ -677,8 +1228,8 @@ void *Lclone (void *p) {
       print_indent ();
       printf ("Lclone: closure or array &p=%p p=%p ebp=%p\n", &p, p, ebp); fflush (stdout);
 #endif
-      obj = (data*) alloc (sizeof(int) * (l+1));
-      memcpy (obj, TO_DATA(p), sizeof(int) * (l+1));
+      obj = (data*) alloc (sizeof(aint) * (l+1));
+      memcpy (obj, TO_DATA(p), sizeof(aint) * (l+1));
       res = (void*) (obj->contents);
       break;
       
@@ -686,13 +1237,13 @@ void *Lclone (void *p) {
 #ifdef DEBUG_PRINT
       print_indent (); printf ("Lclone: sexp\n"); fflush (stdout);
 #endif
-      sobj = (sexp*) alloc (sizeof(int) * (l+2));
-      memcpy (sobj, TO_SEXP(p), sizeof(int) * (l+2));
+      sobj = (sexp*) alloc (sizeof(aint) * (l+2));
+      memcpy (sobj, TO_SEXP(p), sizeof(aint) * (l+2));
       res = (void*) sobj->contents.contents;
       break;
        
     default:
-      failure ("invalid tag %d in clone *****\n", t);
+      failure ("invalid tag %d in clone *****\n", (int) t);
     }
     pop_extra_root (&p);
   }
@@ -710,25 +1261,26 @@ void *Lclone (void *p) {
 }
 
 # define HASH_DEPTH 3
-# define HASH_APPEND(acc, x) (((acc + (unsigned) x) << (WORD_SIZE / 2)) | ((acc + (unsigned) x) >> (WORD_SIZE / 2)))
+# define HASH_WIDTH (CHAR_BIT * sizeof(unsigned))
+# define HASH_APPEND(acc, x) (((acc + (unsigned) (auint) x) << (HASH_WIDTH / 2)) | ((acc + (unsigned) (auint) x) >> (HASH_WIDTH / 2)))
 
-int inner_hash (int depth, unsigned acc, void *p) {
+unsigned inner_hash (int depth, unsigned acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
 
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
   else if (is_valid_heap_pointer (p)) {
     data *a = TO_DATA(p);
-    int t = TAG(a->tag), l = LEN(a->tag), i;
+    aint t = TAG(a->tag), l = LEN(a->tag), i;
 
     acc = HASH_APPEND(acc, t);
     acc = HASH_APPEND(acc, l);    
 
     switch (t) {
     case STRING_TAG: {
-      char *p = a->contents;
+      char *c = (char*) Bflatten (p);
 
-      while (*p) {
-        int n = (int) *p++;
+      while (*c) {
+        int n = (int) *c++;
 	acc = HASH_APPEND(acc, n);
       }
 
@@ -746,9 +1298,9 @@ int inner_hash (int depth, unsigned acc, void *p) {
 
     case SEXP_TAG: {
 #ifndef DEBUG_PRINT
-      int ta = TO_SEXP(p)->tag;
+      aint ta = TO_SEXP(p)->tag;
 #else
-      int ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
+      aint ta = GET_SEXP_TAG(TO_SEXP(p)->tag);
 #endif
       acc = HASH_APPEND(acc, ta);
       i = 0;
@@ -756,11 +1308,16 @@ int inner_hash (int depth, unsigned acc, void *p) {
     }
 
     default:
-      failure ("invalid tag %d in hash *****\n", t);
+      failure ("invalid tag %d in hash *****\n", (int) t);
     }
 
+    /* Hashing a rope element flattens it, which may move p */
+    push_extra_root (&p);
+
     for (; i<l; i++) 
-      acc = inner_hash (depth+1, acc, ((void**) a->contents)[i]);
+      acc = inner_hash (depth+1, acc, ((void**) TO_DATA(p)->contents)[i]);
+
+    pop_extra_root (&p);
 
     return acc;
   }
@@ -768,16 +1325,17 @@ int inner_hash (int depth, unsigned acc, void *p) {
 }
 
 extern void* LstringInt (char *b) {
-  int n;
-  sscanf (b, "%d", &n);
+  aint n;
+  b = Bflatten (b);
+  sscanf (b, "%" SCNdAI, &n);
   return (void*) BOX(n);
 }
 
-extern int Lhash (void *p) {
+extern aint Lhash (void *p) {
   return BOX(0x3fffff & inner_hash (0, 0, p));
 }
 
-extern int LflatCompare (void *p, void *q) {
+extern aint LflatCompare (void *p, void *q) {
   if (UNBOXED(p)) {
     if (UNBOXED(q)) {
       return BOX (UNBOX(p) - UNBOX(q));
@@ -791,7 +1349,7 @@ extern int LflatCompare (void *p, void *q) {
   else BOX(1);
 }
 
-extern int Lcompare (void *p, void *q) {
+extern aint Lcompare (void *p, void *q) {
 # define COMPARE_AND_RETURN(x,y) do if (x != y) return BOX(x - y); while (0)
   
   if (p == q) return BOX(0);
@@ -805,15 +1363,16 @@ extern int Lcompare (void *p, void *q) {
     if (is_valid_heap_pointer (p)) {
       if (is_valid_heap_pointer (q)) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
-        int ta = TAG(a->tag), tb = TAG(b->tag);
-        int la = LEN(a->tag), lb = LEN(b->tag);
-        int i;
+        aint ta = TAG(a->tag), tb = TAG(b->tag);
+        aint la = LEN(a->tag), lb = LEN(b->tag);
+        aint i;
     
         COMPARE_AND_RETURN (ta, tb);
       
         switch (ta) {
         case STRING_TAG:
-          return BOX(strcmp (a->contents, b->contents));
+          flatten_strings (&p, &q);
+          return BOX(strcmp ((char*) p, (char*) q));
       
         case CLOSURE_TAG:
           COMPARE_AND_RETURN (((void**) a->contents)[0], ((void**) b->contents)[0]);
@@ -828,9 +1387,9 @@ extern int Lcompare (void *p, void *q) {
 
         case SEXP_TAG: {
 #ifndef DEBUG_PRINT
-          int ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
+          aint ta = TO_SEXP(p)->tag, tb = TO_SEXP(q)->tag;      
 #else
-          int ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
+          aint ta = GET_SEXP_TAG(TO_SEXP(p)->tag), tb = GET_SEXP_TAG(TO_SEXP(q)->tag);
 #endif      
           COMPARE_AND_RETURN (ta, tb);
           COMPARE_AND_RETURN (la, lb);
@@ -839,14 +1398,24 @@ extern int Lcompare (void *p, void *q) {
         }
 
         default:
-          failure ("invalid tag %d in compare *****\n", ta);
+          failure ("invalid tag %d in compare *****\n", (int) ta);
         }
 
+        /* Comparing rope elements flattens them, which may move p and q */
+        size_t scope = enter_extra_roots_scope ();
+
+        push_extra_root (&p);
+        push_extra_root (&q);
+
         for (; i<la; i++) {
-          int c = Lcompare (((void**) a->contents)[i], ((void**) b->contents)[i]);
-          if (c != BOX(0)) return BOX(c);
+          aint c = Lcompare (((void**) TO_DATA(p)->contents)[i], ((void**) TO_DATA(q)->contents)[i]);
+          if (c != BOX(0)) {
+            leave_extra_roots_scope (scope);
+            return BOX(c);
+          }
         }
     
+        leave_extra_roots_scope (scope);
         return BOX(0);
       }
       else return BOX(-1);
@@ -856,7 +1425,7 @@ extern int Lcompare (void *p, void *q) {
   }
 }
 
-extern void* Belem (void *p, int i) {
+extern void* Belem (void *p, aint i) {
   data *a = (data *)BOX(NULL);
 
   ASSERT_BOXED(".elem:1", p);
@@ -866,33 +1435,34 @@ extern void* Belem (void *p, int i) {
   i = UNBOX(i);
   
   if (TAG(a->tag) == STRING_TAG) {
+    if (IS_ROPE(a->tag)) a = TO_DATA(Bflatten (p));
     return (void*) BOX(a->contents[i]);
   }
   
-  return (void*) ((int*) a->contents)[i];
+  return (void*) ((aint*) a->contents)[i];
 }
 
-extern void* LmakeArray (int length) {
+extern void* LmakeArray (aint length) {
   data *r;
-  int n;
+  aint n;
 
   ASSERT_UNBOXED("makeArray:1", length);
   
   __pre_gc ();
 
   n = UNBOX(length);
-  r = (data*) alloc (sizeof(int) * (n+1));
+  r = (data*) alloc (sizeof(aint) * (n+1));
 
   r->tag = ARRAY_TAG | (n << 3);
 
-  memset (r->contents, 0, n * sizeof(int));
+  memset (r->contents, 0, n * sizeof(aint));
   
   __post_gc ();
 
   return r->contents;
 }
 
-extern void* LmakeSexp (int bn, int btag) {
+extern void* LmakeSexp (aint bn, aint btag) {
     va_list args;
     int     i;
     int     ai;
@@ -903,11 +1473,11 @@ extern void* LmakeSexp (int bn, int btag) {
     ASSERT_UNBOXED("makeSexp:1", bn);
     ASSERT_UNBOXED("makeSexp:2", btag);
 
-    int n = UNBOX(bn);
+    aint n = UNBOX(bn);
 
     __pre_gc () ;
 
-    r = (sexp*) alloc (sizeof(int) * (n+1));
+    r = (sexp*) alloc (sizeof(aint) * (n+1));
     d = &(r->contents);
 
     d->tag = SEXP_TAG | ((n-1) << 3);
@@ -918,15 +1488,15 @@ extern void* LmakeSexp (int bn, int btag) {
     return d->contents;
 }
 
-extern void* LmakeString (int length) {
-  int   n = UNBOX(length);
+extern void* LmakeString (aint length) {
+  aint  n = UNBOX(length);
   data *r;
 
   ASSERT_UNBOXED("makeString", length);
   
   __pre_gc () ;
   
-  r = (data*) alloc (n + 1 + sizeof (int));
+  r = (data*) alloc (n + 1 + sizeof (aint));
 
   r->tag = STRING_TAG | (n << 3);
 
@@ -935,14 +1505,14 @@ extern void* LmakeString (int length) {
   return r->contents;
 }
 
-extern void* LMakeClosure (int bn, void *entry) {
+extern void* LMakeClosure (aint bn, void *entry) {
     int     i;
     data    *r;
-    int     n = UNBOX(bn);
+    aint    n = UNBOX(bn);
 
     __pre_gc ();
 
-    r = (data*) alloc (sizeof(int) * (n+2));
+    r = (data*) alloc (sizeof(aint) * (n+2));
     r->tag = CLOSURE_TAG | ((n + 1) << 3);
     ((void**) r->contents)[0] = entry;
 
@@ -982,18 +1552,30 @@ extern void* Bstring (void *p) {
 extern void* Lstringcat (void *p) {
   void *s;
 
+  aint  n;
+
   ASSERT_BOXED("stringcat", p);
   
   __pre_gc ();
-  
-  createStringBuf ();
-  stringcat (p);
 
-  push_extra_root(&p);
-  s = Bstring (stringBuf.contents);
-  pop_extra_root(&p);
+  /* Lists of strings are concatenated directly into the result */
+  if ((n = stringcat_length (p)) >= 0) {
+    push_extra_root(&p);
+    s = LmakeString (BOX(n));
+    pop_extra_root(&p);
+
+    *stringcat_copy ((char*) s, p) = 0;
+  }
+  else {
+    createStringBuf ();
+    stringcat (p);
+
+    push_extra_root(&p);
+    s = Bstring (stringBuf.contents);
+    pop_extra_root(&p);
   
-  deleteStringBuf ();
+    deleteStringBuf ();
+  }
 
   __post_gc ();
 
@@ -1001,78 +1583,78 @@ extern void* Lstringcat (void *p) {
 }
 
 extern void* Bstringval (void *p) {
-  void *s = (void *) BOX (NULL);
+  void  *s = (void *) BOX (NULL);
+  size_t n = value_length (p);
+  printer pr;
 
   __pre_gc () ;
-  
-  createStringBuf ();
-  printValue (p);
 
   push_extra_root(&p);
-
-  s = Bstring (stringBuf.contents);
+  s = LmakeString (BOX(n));
   pop_extra_root(&p);
-  
-  deleteStringBuf ();
+
+  pr.dst   = (char*) s;
+  pr.write = NULL;
+  pr.len   = 0;
+  print_value (&pr, p);
+  ((char*) s)[n] = 0;
 
   __post_gc ();
 
   return s;
 }
 
-extern void* Bclosure (int bn, void *entry, ...) {
+extern void* Bclosure (aint bn, void *entry, ...) {
   va_list args; 
-  int     i, ai;
-  register int * ebp asm ("ebp");
-  size_t  *argss;
+  aint    i;
   data    *r; 
-  int     n = UNBOX(bn);
+  aint    n = UNBOX(bn);
+  /* Captured values are fetched into a local array first: on x86-64 they are
+     passed in registers, so they cannot be rooted in place on the stack */
+  void   *argss[n > 0 ? n : 1];
+  size_t  scope = enter_extra_roots_scope ();
   
   __pre_gc ();
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf ("Bclosure: create n = %d\n", n); fflush(stdout);
+  printf ("Bclosure: create n = %d\n", (int) n); fflush(stdout);
 #endif
-  argss = (ebp + 12);
-  for (i = 0; i<n; i++, argss++) {
-    push_extra_root ((void**)argss);
+  va_start(args, entry);
+  
+  for (i = 0; i<n; i++) {
+    argss[i] = va_arg(args, void*);
+    push_extra_root (&argss[i]);
   }
+  
+  va_end(args);
 
-  r = (data*) alloc (sizeof(int) * (n+2));
+  r = (data*) alloc (sizeof(aint) * (n+2));
   
   r->tag = CLOSURE_TAG | ((n + 1) << 3);
   ((void**) r->contents)[0] = entry;
   
-  va_start(args, entry);
-  
   for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i+1] = ai;
+    ((void**)r->contents)[i+1] = argss[i];
   }
-  
-  va_end(args);
 
   __post_gc();
 
-  argss--;
-  for (i = 0; i<n; i++, argss--) {
-    pop_extra_root ((void**)argss);
-  }
+  leave_extra_roots_scope (scope);
 
 #ifdef DEBUG_PRINT
   print_indent ();
-  printf ("Bclosure: ends\n", n); fflush(stdout);
+  printf ("Bclosure: ends\n"); fflush(stdout);
   indent--;
 #endif
 
   return r->contents;
 }
 
-extern void* Barray (int bn, ...) {
+extern void* Barray (aint bn, ...) {
   va_list args; 
-  int     i, ai; 
+  aint    i, ai; 
   data    *r; 
-  int     n = UNBOX(bn);
+  aint    n = UNBOX(bn);
     
   __pre_gc ();
   
@@ -1080,15 +1662,15 @@ extern void* Barray (int bn, ...) {
   indent++; print_indent ();
   printf ("Barray: create n = %d\n", n); fflush(stdout);
 #endif
-  r = (data*) alloc (sizeof(int) * (n+1));
+  r = (data*) alloc (sizeof(aint) * (n+1));
 
   r->tag = ARRAY_TAG | (n << 3);
   
   va_start(args, bn);
   
   for (i = 0; i<n; i++) {
-    ai = va_arg(args, int);
-    ((int*)r->contents)[i] = ai;
+    ai = va_arg(args, aint);
+    ((aint*)r->contents)[i] = ai;
   }
   
   va_end(args);
@@ -1100,22 +1682,22 @@ extern void* Barray (int bn, ...) {
   return r->contents;
 }
 
-extern void* Bsexp (int bn, ...) {
+extern void* Bsexp (aint bn, ...) {
   va_list args; 
-  int     i;    
-  int     ai;  
+  aint    i;    
+  aint    ai;  
   size_t *p;  
   sexp   *r;  
   data   *d;  
-  int n = UNBOX(bn); 
+  aint n = UNBOX(bn); 
 
   __pre_gc () ;
   
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
-  printf("Bsexp: allocate %zu!\n",sizeof(int) * (n+1)); fflush (stdout);
+  printf("Bsexp: allocate %zu!\n",sizeof(aint) * (n+1)); fflush (stdout);
 #endif
-  r = (sexp*) alloc (sizeof(int) * (n+1));
+  r = (sexp*) alloc (sizeof(aint) * (n+1));
   d = &(r->contents);
   r->tag = 0;
     
@@ -1124,13 +1706,13 @@ extern void* Bsexp (int bn, ...) {
   va_start(args, bn);
   
   for (i=0; i<n-1; i++) {
-    ai = va_arg(args, int);
+    ai = va_arg(args, aint);
     
     p = (size_t*) ai;
-    ((int*)d->contents)[i] = ai;
+    ((aint*)d->contents)[i] = ai;
   }
 
-  r->tag = UNBOX(va_arg(args, int));
+  r->tag = UNBOX(va_arg(args, aint));
 
 #ifdef DEBUG_PRINT
   r->tag = SEXP_TAG | ((r->tag) << 3);
@@ -1146,7 +1728,7 @@ extern void* Bsexp (int bn, ...) {
   return d->contents;
 }
 
-extern int Btag (void *d, int t, int n) {
+extern aint Btag (void *d, aint t, aint n) {
   data *r; 
   
   if (UNBOXED(d)) return BOX(0);
@@ -1161,7 +1743,7 @@ extern int Btag (void *d, int t, int n) {
   }
 }
 
-extern int Barray_patt (void *d, int n) {
+extern aint Barray_patt (void *d, aint n) {
   data *r; 
   
   if (UNBOXED(d)) return BOX(0);
@@ -1171,7 +1753,7 @@ extern int Barray_patt (void *d, int n) {
   }
 }
 
-extern int Bstring_patt (void *x, void *y) {
+extern aint Bstring_patt (void *x, void *y) {
   data *rx = (data *) BOX (NULL),
        *ry = (data *) BOX (NULL);
   
@@ -1182,50 +1764,55 @@ extern int Bstring_patt (void *x, void *y) {
     rx = TO_DATA(x); ry = TO_DATA(y);
 
     if (TAG(rx->tag) != STRING_TAG) return BOX(0);
+
+    if (IS_ROPE(rx->tag) || IS_ROPE(ry->tag)) {
+      flatten_strings (&x, &y);
+      rx = TO_DATA(x); ry = TO_DATA(y);
+    }
     
     return BOX(strcmp (rx->contents, ry->contents) == 0 ? 1 : 0);
   }
 }
 
-extern int Bclosure_tag_patt (void *x) {
+extern aint Bclosure_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == CLOSURE_TAG);
 }
 
-extern int Bboxed_patt (void *x) {
+extern aint Bboxed_patt (void *x) {
   return BOX(UNBOXED(x) ? 0 : 1);
 }
 
-extern int Bunboxed_patt (void *x) {
+extern aint Bunboxed_patt (void *x) {
   return BOX(UNBOXED(x) ? 1 : 0);
 }
 
-extern int Barray_tag_patt (void *x) {
+extern aint Barray_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == ARRAY_TAG);
 }
 
-extern int Bstring_tag_patt (void *x) {
+extern aint Bstring_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == STRING_TAG);
 }
 
-extern int Bsexp_tag_patt (void *x) {
+extern aint Bsexp_tag_patt (void *x) {
   if (UNBOXED(x)) return BOX(0);
   
   return BOX(TAG(TO_DATA(x)->tag) == SEXP_TAG);
 }
 
-extern void* Bsta (void *v, int i, void *x) {
+extern void* Bsta (void *v, aint i, void *x) {
   if (UNBOXED(i)) {
     ASSERT_BOXED(".sta:3", x);
     //    ASSERT_UNBOXED(".sta:2", i);
   
-    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) x)[UNBOX(i)] = (char) UNBOX(v);
-    else ((int*) x)[UNBOX(i)] = (int) v;
+    if (TAG(TO_DATA(x)->tag) == STRING_TAG)((char*) Bflatten (x))[UNBOX(i)] = (char) UNBOX(v);
+    else ((aint*) x)[UNBOX(i)] = (aint) v;
 
     return v;
   }
@@ -1235,53 +1822,144 @@ extern void* Bsta (void *v, int i, void *x) {
   return v;
 }
 
-static void fix_unboxed (char *s, va_list va) {
-  size_t *p = (size_t*)va;
-  int i = 0;
-  
-  while (*s) {
-    if (*s == '%') {
-      size_t n = p [i];
-      if (UNBOXED (n)) {
-	p[i] = UNBOX(n);
+/* Formats a Lama format string into stringBuf. Every argument is a word
+   which is unboxed if needed; they are fetched one by one since on x86-64
+   variadic arguments are passed in registers and cannot be fixed in place */
+static void vprintStringBufUnboxed (char *fmt, va_list args) {
+  char spec[32];
+  char *p;
+  aint  a;
+  int   n;
+
+  while (*fmt) {
+    p = fmt;
+
+    if (*p != '%') {
+      while (*p && *p != '%') p++;
+      printStringBuf ("%.*s", (int) (p - fmt), fmt);
+      fmt = p;
+      continue;
+    }
+
+    if (p[1] == '%') {
+      printStringBuf ("%%");
+      fmt = p + 2;
+      continue;
+    }
+
+    for (p++; *p && strchr ("#0- +123456789.", *p); p++);
+    n = p - fmt;
+    while (*p == 'l' || *p == 'h') p++;
+
+    if (!*p || n + 4 >= sizeof (spec)) {
+      failure ("invalid format string: %s\n", fmt);
+    }
+
+    a = va_arg (args, aint);
+    if (UNBOXED(a)) a = UNBOX(a);
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+      snprintf (spec, sizeof (spec), "%.*s%.*s%c",
+                n, fmt, (int) strlen (PRIdAI) - 1, PRIdAI, *p);
+      printStringBuf (spec, a);
+      break;
+
+    case 'c':
+      snprintf (spec, sizeof (spec), "%.*s%c", n, fmt, *p);
+      printStringBuf (spec, (int) a);
+      break;
+
+    case 's': {
+      char *tmp = NULL;
+
+      if (is_valid_heap_pointer ((void*) a) && TAG(TO_DATA(a)->tag) == STRING_TAG) {
+        a = (aint) string_chars ((void*) a, &tmp);
       }
-      i++;
+
+      snprintf (spec, sizeof (spec), "%.*s%c", n, fmt, *p);
+      printStringBuf (spec, (void*) a);
+      free (tmp);
+      break;
     }
-    s++;
+
+    case 'p':
+      snprintf (spec, sizeof (spec), "%.*s%c", n, fmt, *p);
+      printStringBuf (spec, (void*) a);
+      break;
+
+    default:
+      failure ("unsupported conversion %%%c in format string\n", *p);
+    }
+
+    fmt = p + 1;
   }
 }
 
 extern void Lfailure (char *s, ...) {
   va_list args;
+  char   *tmp;
   
-  va_start    (args, s);
-  fix_unboxed (s, args);
-  vfailure    (s, args);
+  va_start (args, s);
+  createStringBuf ();
+  vprintStringBufUnboxed (string_chars (s, &tmp), args);
+  va_end   (args);
+  free     (tmp);
+  failure  ("%s", stringBuf.contents);
 }
 
-extern void Bmatch_failure (void *v, char *fname, int line, int col) {
-  createStringBuf ();
-  printValue (v);
-  failure ("match failure at %s:%d:%d, value '%s'\n",
-	   fname, UNBOX(line), UNBOX(col), stringBuf.contents);
+extern void Bmatch_failure (void *v, char *fname, aint line, aint col) {
+  printer pr = {NULL, error_output, 0};
+
+  flush_output ();
+  fprintf (stderr, "*** FAILURE: match failure at %s:%d:%d, value '",
+           fname, (int) UNBOX(line), (int) UNBOX(col));
+  print_value (&pr, v);
+  fputs ("'\n", stderr);
+  failure_exit ();
 }
 
 extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
   data *da = (data*) BOX (NULL);
   data *db = (data*) BOX (NULL);
   data *d  = (data*) BOX (NULL);
+  aint  n;
 
   ASSERT_STRING("++:1", a);
   ASSERT_STRING("++:2", b);
   
   da = TO_DATA(a);
   db = TO_DATA(b);
+  n  = LEN(da->tag) + LEN(db->tag);
 
   __pre_gc () ;
 
+  if (n >= ROPE_MIN_LENGTH) {
+    size_t scope = enter_extra_roots_scope ();
+    void  *l, *r;
+
+    push_extra_root (&a);
+    push_extra_root (&b);
+    l = rope_part (a);
+    push_extra_root (&l);
+    r = rope_part (b);
+    push_extra_root (&r);
+    d = (data *) alloc (3 * sizeof (aint));
+    leave_extra_roots_scope (scope);
+
+    d->tag = STRING_TAG | ROPE_FLAG | (n << 3);
+    ROPE_LEFT(d)  = l;
+    ROPE_RIGHT(d) = r;
+
+    __post_gc();
+
+    return d->contents;
+  }
+
+  /* Ropes are never shorter than ROPE_MIN_LENGTH, so both strings are flat */
   push_extra_root (&a);
   push_extra_root (&b);
-  d  = (data *) alloc (sizeof(int) + LEN(da->tag) + LEN(db->tag) + 1);
+  d  = (data *) alloc (sizeof(aint) + n + 1);
   pop_extra_root (&b);
   pop_extra_root (&a);
 
@@ -1303,15 +1981,17 @@ extern void* /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
 extern void* Lsprintf (char * fmt, ...) {
   va_list args;
   void *s;
+  char *tmp;
 
   ASSERT_STRING("sprintf:1", fmt);
   
   va_start (args, fmt);
-  fix_unboxed (fmt, args);
   
   createStringBuf ();
 
-  vprintStringBuf (fmt, args);
+  vprintStringBufUnboxed (string_chars (fmt, &tmp), args);
+  va_end (args);
+  free (tmp);
 
   __pre_gc ();
 
@@ -1327,7 +2007,7 @@ extern void* Lsprintf (char * fmt, ...) {
 }
 
 extern void* LgetEnv (char *var) {
-  char *e = getenv (var);
+  char *e = getenv (Bflatten (var));
   void *s;
   
   if (e == NULL)
@@ -1342,37 +2022,46 @@ extern void* LgetEnv (char *var) {
   return s;
 }
 
-extern int Lsystem (char *cmd) {
-  return BOX (system (cmd));
+extern aint Lsystem (char *cmd) {
+  flush_output ();
+
+  return BOX (system (Bflatten (cmd)));
 }
 
 extern void Lfprintf (FILE *f, char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+  va_list args;
+  char   *tmp;
 
   ASSERT_BOXED("fprintf:1", f);
   ASSERT_STRING("fprintf:2", s);  
   
-  va_start    (args, s);
-  fix_unboxed (s, args);
+  va_start (args, s);
+  createStringBuf ();
+  vprintStringBufUnboxed (string_chars (s, &tmp), args);
+  va_end   (args);
+  free     (tmp);
   
-  if (vfprintf (f, s, args) < 0) {
+  if (fputs (stringBuf.contents, f) < 0) {
     failure ("fprintf (...): %s\n", strerror (errno));
   }
+
+  deleteStringBuf ();
 }
 
 extern void Lprintf (char *s, ...) {
-  va_list args = (va_list) BOX (NULL);
+  va_list args;
+  char   *tmp;
 
   ASSERT_STRING("printf:1", s);
 
-  va_start    (args, s);
-  fix_unboxed (s, args);
+  va_start (args, s);
+  createStringBuf ();
+  vprintStringBufUnboxed (string_chars (s, &tmp), args);
+  va_end   (args);
+  free     (tmp);
   
-  if (vprintf (s, args) < 0) {
-    failure ("fprintf (...): %s\n", strerror (errno));
-  }
-
-  fflush (stdout);
+  output (stringBuf.contents, stringBuf.ptr);
+  deleteStringBuf ();
 }
 
 extern FILE* Lfopen (char *f, char *m) {
@@ -1381,6 +2070,7 @@ extern FILE* Lfopen (char *f, char *m) {
   ASSERT_STRING("fopen:1", f);
   ASSERT_STRING("fopen:2", m);
 
+  flatten_strings ((void**) &f, (void**) &m);
   h = fopen (f, m);
   
   if (h)
@@ -1396,21 +2086,36 @@ extern void Lfclose (FILE *f) {
 }
 
 extern void* LreadLine () {
-  char *buf;
+  char  *buf = NULL;
+  size_t len = 0;
+  void  *s;
 
-  if (scanf ("%m[^\n]", &buf) == 1) {
-    void * s = Bstring (buf);
+  flush_output ();
 
-    getchar ();
-    
-    free (buf);
-    return s;
+  while (input_peek () != EOF && *input_ptr != '\n') {
+    char  *nl = memchr (input_ptr, '\n', input_end - input_ptr);
+    size_t n  = (nl ? nl : input_end) - input_ptr;
+
+    buf = (char*) realloc (buf, len + n + 1);
+
+    if (buf == NULL) {
+      failure ("readLine (): %s\n", strerror (errno));
+    }
+
+    memcpy (buf + len, input_ptr, n);
+    len       += n;
+    input_ptr += n;
   }
-  
-  if (errno != 0)
-    failure ("readLine (): %s\n", strerror (errno));
 
-  return (void*) BOX (0);
+  if (len == 0) return (void*) BOX (0);
+
+  buf[len] = 0;
+  s = Bstring (buf);
+
+  if (input_peek () == '\n') input_ptr++;
+
+  free (buf);
+  return s;
 }
 
 extern void* Lfread (char *fname) {
@@ -1418,7 +2123,8 @@ extern void* Lfread (char *fname) {
 
   ASSERT_STRING("fread", fname);
 
-  f = fopen (fname, "r");
+  fname = Bflatten (fname);
+  f     = fopen (fname, "r");
   
   if (f) {
     if (fseek (f, 0l, SEEK_END) >= 0) {
@@ -1442,7 +2148,8 @@ extern void Lfwrite (char *fname, char *contents) {
 
   ASSERT_STRING("fwrite:1", fname);
   ASSERT_STRING("fwrite:2", contents);
-  
+
+  flatten_strings ((void**) &fname, (void**) &contents);
   f = fopen (fname, "w");
 
   if (f) {
@@ -1473,35 +2180,47 @@ extern void* Ltl (void *v) {
 }
 
 /* Lread is an implementation of the "read" construct */
-extern int Lread () {
-  int result = BOX(0);
+extern aint Lread () {
+  aint result = BOX(0);
 
-  printf ("> "); 
-  fflush (stdout);
-  scanf  ("%d", &result);
+  if (input_interactive < 0) {
+    input_interactive = isatty (input_fd);
+  }
+
+  if (input_interactive) {
+    output ("> ", 2);
+    flush_output ();
+  }
+
+  input_aint (&result);
 
   return BOX(result);
 }
 
 /* Lwrite is an implementation of the "write" construct */
-extern int Lwrite (int n) {
-  printf ("%d\n", UNBOX(n));
-  fflush (stdout);
+extern aint Lwrite (aint n) {
+  char  buf[3 * sizeof (aint) + 2], *end = buf + sizeof (buf), *p;
+
+  *--end = '\n';
+  p = format_aint (end, UNBOX(n));
+  output (p, end + 1 - p);
+
+  if (output_line_buffered) flush_output ();
 
   return 0;
 }
 
-extern int Lrandom (int n) {
+extern aint Lrandom (aint n) {
   ASSERT_UNBOXED("Lrandom, 0", n);
 
   if (UNBOX(n) <= 0) {
-    failure ("invalid range in random: %d\n", UNBOX(n));
+    failure ("invalid range in random: %" PRIdAI "\n", UNBOX(n));
   }
   
   return BOX (random () % UNBOX(n));
 }
 
-extern int Ltime () {
+extern aint Ltime () {
   struct timespec t;
   
   clock_gettime (CLOCK_MONOTONIC_RAW, &t);
@@ -1511,7 +2230,7 @@ extern int Ltime () {
 
 extern void set_args (int argc, char *argv[]) {
   data *a;
-  int n = argc, *p = NULL;
+  aint n = argc, *p = NULL;
   int i;
   
   __pre_gc ();
@@ -1532,7 +2251,7 @@ extern void set_args (int argc, char *argv[]) {
     print_indent ();
     printf ("set_args: iteration %i %p %p ->\n", i, &p, p); fflush(stdout);
 #endif
-    ((int*)p) [i] = (int) Bstring (argv[i]);
+    ((aint*)p) [i] = (aint) Bstring (argv[i]);
 #ifdef DEBUG_PRINT
     print_indent ();
     printf ("set_args: iteration %i <- %p %p\n", i, &p, p); fflush(stdout);
@@ -1553,7 +2272,7 @@ extern void set_args (int argc, char *argv[]) {
 
 /* GC starts here */
 
-static int enable_GC = 1;
+static _Thread_local int enable_GC = 1;
 
 extern void LenableGC () {
   enable_GC = 1;
@@ -1583,25 +2302,86 @@ extern void __gc_root_scan_stack ();
 /* ======================================== */
 
 //static size_t SPACE_SIZE = 16;
-static size_t SPACE_SIZE = 256 * 1024 * 1024;
+static size_t initial_space_size = 256 * 1024 * 1024;
 // static size_t SPACE_SIZE = 128;
 // static size_t SPACE_SIZE = 1024 * 1024;
 
+/* The size of the semispaces of the thread, 0 until its first heap */
+static _Thread_local size_t SPACE_SIZE = 0;
+
+static _Thread_local size_t   gc_count;
+static _Thread_local uint64_t gc_ns;
+static _Thread_local void   (*gc_hook) (int event, size_t size);
+static _Thread_local gc_census *census;
+
+extern void set_heap_size (size_t words) {
+  initial_space_size = words < 1024 ? 1024 : words;
+}
+
+extern void __gc_stats (size_t *count, uint64_t *ns) {
+  *count = gc_count;
+  *ns    = gc_ns;
+}
+
+extern void set_gc_hook (void (*hook) (int event, size_t size)) {
+  gc_hook = hook;
+}
+
+extern void set_gc_census (gc_census *c) {
+  census = c;
+}
+
+static void census_add (aint kind, aint tag, size_t words) {
+  size_t k = ((auint) tag >> 1) % GC_CENSUS_TAGS;
+
+  census->count[kind >> 1]++;
+  census->words[kind >> 1] += words;
+  if (kind != SEXP_TAG) return;
+
+  for (size_t n = 0; n < GC_CENSUS_TAGS; n++, k = (k + 1) % GC_CENSUS_TAGS) {
+    if (census->sexps[k].count == 0) census->sexps[k].tag = tag;
+    if (census->sexps[k].tag == tag) {
+      census->sexps[k].count++;
+      census->sexps[k].words += words;
+      return;
+    }
+  }
+
+  census->other_count++;
+  census->other_words += words;
+}
+
+static uint64_t now_ns (void) {
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* On x86-64 the heap is not confined to the low 4 GB */
+# ifdef X86_64
+# define GC_MMAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+# else
+# define GC_MMAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT)
+# endif
+
 static int free_pool (pool * p) {
   size_t *a = p->begin, b = p->size;
   p->begin   = NULL;
   p->size    = 0;
   p->end     = NULL;
   p->current = NULL;
-  return munmap((void *)a, b);
+  return munmap((void *)a, b * sizeof(size_t));
 }
 
 static void init_to_space (int flag) {
   size_t space_size = 0;
+  if (SPACE_SIZE == 0) SPACE_SIZE = initial_space_size;
   if (flag) SPACE_SIZE = SPACE_SIZE << 1;
   space_size     = SPACE_SIZE * sizeof(size_t);
+  if (flag && gc_hook != NULL) gc_hook (GC_EVENT_GROW, space_size);
   to_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+			 GC_MMAP_FLAGS, -1, 0);
   if (to_space.begin == MAP_FAILED) {
     perror ("EROOR: init_to_space: mmap failed\n");
     exit   (1);
@@ -1690,6 +2470,55 @@ static void copy_elements (size_t *where, size_t *from, int len) {
 
 }
 
+/* The rope node behind the part p which is not copied yet, or NULL */
+static data* uncopied_rope_node (size_t p) {
+  data *d;
+
+  if (!IS_VALID_HEAP_POINTER(p)) return NULL;
+
+  d = TO_DATA(p);
+
+  return IS_FORWARD_PTR(d->tag) || !IS_ROPE_NODE(d) ? NULL : d;
+}
+
+/* Copies the parts of the rope node from into where. Only the shorter
+   part is copied by recursion, and the nodes of the longer one are copied
+   in this loop, so that the depth of the recursion is logarithmic in the
+   length of the string for ropes of any shape, e.g. the spines of append
+   and prepend loops */
+static void copy_rope_parts (size_t *where, size_t *from) {
+  for (;;) {
+    data   *l = uncopied_rope_node (from[0]), *r = uncopied_rope_node (from[1]), *b;
+    int     i = r != NULL && (l == NULL || LEN(r->tag) > LEN(l->tag));
+    size_t *c;
+
+    if (l == NULL && r == NULL) {
+      copy_elements (where, from, 2);
+      return;
+    }
+
+    copy_elements (where + 1 - i, from + 1 - i, 1);
+
+    b = TO_DATA(from[i]);
+
+    if (IS_FORWARD_PTR(b->tag)) {
+      where[i] = b->tag;
+      return;
+    }
+
+    c = current;
+    current += 3;
+    if (census != NULL) census_add (STRING_TAG, 0, 3);
+    *c = b->tag;
+    c++;
+    b->tag = (aint) c;
+    where[i] = (size_t) c;
+
+    where = c;
+    from  = (size_t*) b->contents;
+  }
+}
+
 static int extend_spaces (void) {
   void *p = (void *) BOX (NULL);
   size_t old_space_size = SPACE_SIZE        * sizeof(size_t),
@@ -1714,6 +2543,7 @@ static int extend_spaces (void) {
   to_space.end    += SPACE_SIZE;
   SPACE_SIZE      =  SPACE_SIZE << 1;
   to_space.size   =  SPACE_SIZE;
+  if (gc_hook != NULL) gc_hook (GC_EVENT_GROW, new_space_size);
   return 0;
 }
 
@@ -1775,9 +2605,10 @@ extern size_t * gc_copy (size_t *obj) {
       // current += LEN(d->tag) + 1;
       // current += ((LEN(d->tag) + 1) * sizeof(int) -1) / sizeof(size_t) + 1;
       current += i+1;
+      if (census != NULL) census_add (CLOSURE_TAG, 0, current - copy);
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (aint) copy;
       copy_elements (copy, obj, i);
       break;
     
@@ -1786,11 +2617,12 @@ extern size_t * gc_copy (size_t *obj) {
       print_indent ();
       printf ("gc_copy:array_tag; len =  %zu\n", LEN(d->tag)); fflush (stdout);
 #endif
-      current += ((LEN(d->tag) + 1) * sizeof (int) - 1) / sizeof (size_t) + 1;
+      current += ((LEN(d->tag) + 1) * sizeof (aint) - 1) / sizeof (size_t) + 1;
+      if (census != NULL) census_add (ARRAY_TAG, 0, current - copy);
       *copy = d->tag;
       copy++;
       i = LEN(d->tag);
-      d->tag = (int) copy;
+      d->tag = (aint) copy;
       copy_elements (copy, obj, i);
       break;
 
@@ -1799,10 +2631,20 @@ extern size_t * gc_copy (size_t *obj) {
       print_indent ();
       printf ("gc_copy:string_tag; len = %d\n", LEN(d->tag) + 1); fflush (stdout);
 #endif
-      current += (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+      if (IS_ROPE(d->tag)) {
+        current += 3;
+        if (census != NULL) census_add (STRING_TAG, 0, 3);
+        *copy = d->tag;
+        copy++;
+        d->tag = (aint) copy;
+        copy_rope_parts (copy, obj);
+        break;
+      }
+      current += (LEN(d->tag) + sizeof(aint)) / sizeof(size_t) + 1;
+      if (census != NULL) census_add (STRING_TAG, 0, current - copy);
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (aint) copy;
       strcpy ((char*)&copy[0], (char*) obj);
       break;
 
@@ -1820,11 +2662,12 @@ extern size_t * gc_copy (size_t *obj) {
 #endif
       i = LEN(s->contents.tag);
       current += i + 2;
+      if (census != NULL) census_add (SEXP_TAG, s->tag, i + 2);
       *copy = s->tag;
       copy++;
       *copy = d->tag;
       copy++;
-      d->tag = (int) copy;
+      d->tag = (aint) copy;
       copy_elements (copy, obj, i);
       break;
 
@@ -1883,12 +2726,15 @@ static inline void init_extra_roots (void) {
 }
 
 extern void __init (void) {
-  size_t space_size = SPACE_SIZE * sizeof(size_t);
+  size_t space_size;
+
+  if (SPACE_SIZE == 0) SPACE_SIZE = initial_space_size;
+  space_size = SPACE_SIZE * sizeof(size_t);
 
   srandom (time (NULL));
   
   from_space.begin = mmap (NULL, space_size, PROT_READ | PROT_WRITE,
-    			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    			   GC_MMAP_FLAGS, -1, 0);
   to_space.begin   = NULL;
   if (to_space.begin == MAP_FAILED) {
     perror ("EROOR: init_pool: mmap failed\n");
@@ -1903,12 +2749,116 @@ extern void __init (void) {
   init_extra_roots ();
 }
 
+/* Releases the heap and the extra roots of the calling thread; the next
+   allocation starts a new heap */
+extern void __shutdown (void) {
+  if (from_space.begin != NULL) free_pool (&from_space);
+  if (to_space.begin != NULL) free_pool (&to_space);
+  current = NULL;
+
+  free (extra_roots.roots);
+  extra_roots.roots        = NULL;
+  extra_roots.size         = 0;
+  extra_roots.current_free = 0;
+}
+
+/* Heap snapshots. The used part of the heap is saved as is, together with
+   a relocation map: a byte per word, telling whether the word holds a
+   pointer into the heap or to code (the entry of a closure). The map is
+   built by a traversal from the roots, as the words of the heap can only
+   be told apart knowing the objects they belong to. Pointers are to the
+   contents, so that of an empty object may be the end of the used part */
+# define IN_USED_HEAP(p) \
+  (!UNBOXED(p) && from_space.begin < (size_t*) (p) && (size_t*) (p) <= from_space.current)
+
+extern size_t __heap_snapshot (void **roots, size_t n_roots, size_t **image, unsigned char **reloc) {
+  size_t words = from_space.current - from_space.begin, n = 0, size = 64;
+  aint **stack;
+  unsigned char *map;
+
+  *image = from_space.begin;
+  *reloc = map = (unsigned char*) calloc (words + 1, 1);
+  stack  = (aint**) malloc (size * sizeof (aint*));
+
+  if (map == NULL || stack == NULL) {
+    failure ("*** FAILURE: unable to allocate memory.\n");
+  }
+
+  for (size_t r = 0; r <= n_roots; r++) {
+    aint *obj = r < n_roots ? (aint*) roots[r] : NULL;
+
+    /* The header of a visited object is marked as a pointer, which it
+       never is otherwise; then its fields go to the stack */
+    while (1) {
+      if (obj != NULL && IN_USED_HEAP(obj) && map[obj - 1 - (aint*) from_space.begin] == RELOC_NONE) {
+        data *d = TO_DATA(obj);
+        aint  i = 0, len = LEN(d->tag);
+
+        map[obj - 1 - (aint*) from_space.begin] = RELOC_HEAP;
+
+        switch (TAG(d->tag)) {
+        case STRING_TAG:
+          len = IS_ROPE(d->tag) ? 2 : 0;
+          break;
+        case CLOSURE_TAG:
+          map[obj - (aint*) from_space.begin] = RELOC_CODE;
+          i = 1;
+          break;
+        }
+
+        for (; i < len; i++) {
+          if (!IN_USED_HEAP(obj[i])) continue;
+          map[obj + i - (aint*) from_space.begin] = RELOC_HEAP;
+          if (n == size) {
+            stack = (aint**) realloc (stack, (size *= 2) * sizeof (aint*));
+            if (stack == NULL) failure ("*** FAILURE: unable to allocate memory.\n");
+          }
+          stack[n++] = (aint*) obj[i];
+        }
+      }
+
+      if (n == 0) break;
+      obj = stack[--n];
+    }
+  }
+
+  /* The headers were marked only to stop the traversal */
+  for (size_t w = 0; w < words; w++) {
+    if (map[w] == RELOC_HEAP && !IN_USED_HEAP(from_space.begin[w])) map[w] = RELOC_NONE;
+  }
+
+  free (stack);
+  return words;
+}
+
+extern size_t * __heap_restore (const size_t *image, const unsigned char *reloc, size_t words,
+                                const size_t *old_begin, ptrdiff_t code_delta) {
+  ptrdiff_t heap_delta;
+
+  if (from_space.begin != NULL) __shutdown ();
+  if (SPACE_SIZE == 0) SPACE_SIZE = initial_space_size;
+  while (SPACE_SIZE < 2 * words) SPACE_SIZE <<= 1;
+  __init ();
+
+  memcpy (from_space.begin, image, words * sizeof (size_t));
+  from_space.current = from_space.begin + words;
+  heap_delta = (char*) from_space.begin - (char*) old_begin;
+
+  for (size_t w = 0; w < words; w++) {
+    if (reloc[w] == RELOC_HEAP) from_space.begin[w] += heap_delta;
+    else if (reloc[w] == RELOC_CODE) from_space.begin[w] += code_delta;
+  }
+
+  return from_space.begin;
+}
+
 static void* gc (size_t size) {
   if (! enable_GC) {
     Lfailure ("GC disabled");
   }
   
   current = to_space.begin;
+  if (census != NULL) memset (census, 0, sizeof (gc_census));
 #ifdef DEBUG_PRINT
   print_indent ();
   printf ("gc: current:%p; to_space.b =%p; to_space.e =%p; \
@@ -1923,10 +2873,10 @@ static void* gc (size_t size) {
   printf ("gc: data is scanned\n"); fflush (stdout);
 #endif
   __gc_root_scan_stack ();
-  for (int i = 0; i < extra_roots.current_free; i++) {
+  for (size_t i = 0; i < extra_roots.current_free; i++) {
 #ifdef DEBUG_PRINT
     print_indent ();
-    printf ("gc: extra_root № %i: %p %p\n", i, extra_roots.roots[i],
+    printf ("gc: extra_root № %zu: %p %p\n", i, extra_roots.roots[i],
 	    (size_t*) extra_roots.roots[i]);
     fflush (stdout);
 #endif
@@ -1997,16 +2947,16 @@ static void printFromSpace (void) {
     case STRING_TAG:
       printf ("(=>%p): STRING\n\t%s; len = %i %zu\n",
 	      d->contents, d->contents,
-	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(int));
+	      LEN(d->tag), LEN(d->tag) + 1 + sizeof(aint));
       fflush (stdout);
-      len = (LEN(d->tag) + sizeof(int)) / sizeof(size_t) + 1;
+      len = (LEN(d->tag) + sizeof(aint)) / sizeof(size_t) + 1;
       break;
 
     case CLOSURE_TAG:
       printf ("(=>%p): CLOSURE\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
+	aint elem = ((aint*)d->contents)[i];
 	if (UNBOXED(elem)) printf ("%d ", elem);
 	else printf ("%p ", elem);
       }
@@ -2019,7 +2969,7 @@ static void printFromSpace (void) {
       printf ("(=>%p): ARRAY\n\t", d->contents);
       len = LEN(d->tag);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)d->contents)[i];
+	aint elem = ((aint*)d->contents)[i];
 	if (UNBOXED(elem)) printf ("%d ", elem);
 	else printf ("%p ", elem);
       }
@@ -2036,7 +2986,7 @@ static void printFromSpace (void) {
       len = LEN(d->tag);
       tmp = (s->contents.contents);
       for (int i = 0; i < len; i++) {
-	int elem = ((int*)tmp)[i];
+	aint elem = ((aint*)tmp)[i];
 	if (UNBOXED(elem)) printf ("%d ", UNBOX(elem));
 	else printf ("%p ", elem);
       }
@@ -2070,6 +3020,7 @@ static void printFromSpace (void) {
 // alloc: allocates `size` bytes in heap
 extern void * alloc (size_t size) {
   void * p = (void*)BOX(NULL);
+  uint64_t start;
   size = (size - 1) / sizeof(size_t) + 1; // convert bytes to words
 #ifdef DEBUG_PRINT
   indent++; print_indent ();
@@ -2087,6 +3038,10 @@ extern void * alloc (size_t size) {
     return p;
   }
   
+  start = now_ns ();
+  if (gc_hook != NULL && from_space.begin != NULL) {
+    gc_hook (GC_EVENT_START, (from_space.current - from_space.begin) * sizeof(size_t));
+  }
   init_to_space (0);
 #ifdef DEBUG_PRINT
   print_indent ();
@@ -2100,7 +3055,15 @@ extern void * alloc (size_t size) {
   indent--;
   return p;
 #else
-  return gc (size);
+  /* The first allocation of a thread makes its heap this way */
+  if (from_space.begin == NULL) return gc (size);
+  p = gc (size);
+  gc_count++;
+  gc_ns += now_ns () - start;
+  if (gc_hook != NULL) {
+    gc_hook (GC_EVENT_END, (from_space.current - from_space.begin - size) * sizeof(size_t));
+  }
+  return p;
 #endif
 }
 # endif
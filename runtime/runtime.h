@@ -1,15 +1,41 @@
 #ifndef LAMAI_RUNTIME_H
 #define LAMAI_RUNTIME_H
 
-# define WORD_SIZE (CHAR_BIT * sizeof(int))
+# include <stdio.h>
+# include <stdarg.h>
+# include <setjmp.h>
+# include <stddef.h>
+# include <stdint.h>
+# include <assert.h>
+# include <inttypes.h>
+# include <limits.h>
+
+/* Word-sized values: 31-bit tagged integers on i386, 63-bit ones on x86-64 */
+# if defined(__x86_64__)
+#  define X86_64
+# endif
+
+# ifdef X86_64
+typedef int64_t  aint;
+typedef uint64_t auint;
+#  define PRIdAI PRId64
+#  define SCNdAI SCNd64
+# else
+typedef int32_t  aint;
+typedef uint32_t auint;
+#  define PRIdAI PRId32
+#  define SCNdAI SCNd32
+# endif
+
+# define WORD_SIZE (CHAR_BIT * sizeof(aint))
 
 typedef struct {
-    int tag;
+    aint tag;
     char contents[0];
 } data;
 
 typedef struct {
-    int tag;
+    aint tag;
     data contents;
 } sexp;
 
@@ -19,38 +45,203 @@ typedef struct {
 # define CLOSURE_TAG 0x00000007
 # define UNBOXED_TAG 0x00000009 // Not actually a tag; used to return from LkindOf
 
-# define LEN(x) ((x & 0xFFFFFFF8) >> 3)
+/* Strings built by ++ may be ropes: STRING_TAG objects with ROPE_FLAG set
+   in the header, the total length in LEN and two words of contents, the
+   left and the right part. A flattened rope keeps its flat copy on the
+   left and BOX(0) on the right */
+# define ROPE_FLAG ((auint) 1 << (WORD_SIZE - 1))
+
+# define LEN(x) ((aint) (((auint) (x) & ~(ROPE_FLAG | 0x00000007)) >> 3))
 # define TAG(x)  (x & 0x00000007)
+# define IS_ROPE(x) (((auint) (x) & ROPE_FLAG) != 0)
+
+# define TO_DATA(x) ((data*)((char*)(x)-sizeof(aint)))
+# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(aint)))
+
+# define UNBOXED(x)  (((aint) (x)) &  0x0001)
+# define UNBOX(x)    (((aint) (x)) >> 1)
+# define BOX(x)      ((((aint) (x)) << 1) | 0x0001)
+
+/* GC extra roots: a growable shadow stack of addresses of C variables
+   holding heap values; the GC scans it together with the Lama stack */
+typedef struct {
+    size_t   current_free;
+    size_t   size;
+    void  ***roots;
+} extra_roots_pool;
 
-# define TO_DATA(x) ((data*)((char*)(x)-sizeof(int)))
-# define TO_SEXP(x) ((sexp*)((char*)(x)-2*sizeof(int)))
+extern _Thread_local extra_roots_pool extra_roots;
 
-# define UNBOXED(x)  (((int) (x)) &  0x0001)
-# define UNBOX(x)    (((int) (x)) >> 1)
-# define BOX(x)      ((((int) (x)) << 1) | 0x0001)
+void grow_extra_roots (void);
+void clear_extra_roots (void);
 
+/* Makes and releases the heap of the calling thread */
+void __init (void);
+void __shutdown (void);
 
-int LtagHash (char *s);
-void* LmakeArray (int length);
-void* LmakeSexp (int bn, int btag);
-void* LMakeClosure (int bn, void *entry);
+/* Allocates size bytes in the heap, collecting if it is full */
+void* alloc (size_t size);
+
+/* The initial size in words of the semispaces of the threads started next */
+void set_heap_size (size_t words);
+
+/* The number of collections of the calling thread and their total time */
+void __gc_stats (size_t *count, uint64_t *ns);
+
+/* The hook of the thread is told when a collection starts (with the size
+   of the used heap), when it ends (with the size copied) and when the
+   heap grows (with the new size of a semispace); sizes are in bytes */
+# define GC_EVENT_START 0
+# define GC_EVENT_END   1
+# define GC_EVENT_GROW  2
+
+void set_gc_hook (void (*hook) (int event, size_t size));
+
+/* A census of the objects copied by a collection, that is of the live
+   ones, by kind (TAG (x) >> 1) and, for sexps, by constructor; the
+   constructors that do not fit in the table are counted together. The
+   census given to the runtime is cleared when a collection of the thread
+   starts and is complete when GC_EVENT_END is told */
+# define GC_CENSUS_KINDS 4
+# define GC_CENSUS_TAGS  256
+
+typedef struct {
+    aint   tag;
+    size_t count, words;
+} gc_census_tag;
+
+typedef struct {
+    size_t        count[GC_CENSUS_KINDS], words[GC_CENSUS_KINDS];
+    gc_census_tag sexps[GC_CENSUS_TAGS];
+    size_t        other_count, other_words;
+} gc_census;
+
+void set_gc_census (gc_census *census);
+
+/* Heap snapshots: __heap_snapshot returns the number of used words of the
+   heap, pointing image at them and reloc at a malloc'ed map with a byte
+   per word; __heap_restore makes a copy of the image the heap of the
+   calling thread, relocating the pointers, and returns its address */
+# define RELOC_NONE 0
+# define RELOC_HEAP 1
+# define RELOC_CODE 2
+
+size_t __heap_snapshot (void **roots, size_t n_roots, size_t **image, unsigned char **reloc);
+size_t * __heap_restore (const size_t *image, const unsigned char *reloc, size_t words,
+                         const size_t *old_begin, ptrdiff_t code_delta);
+
+static inline void push_extra_root (void **p) {
+    if (extra_roots.current_free == extra_roots.size) grow_extra_roots ();
+    extra_roots.roots[extra_roots.current_free++] = p;
+}
+
+static inline void pop_extra_root (void **p) {
+    assert (extra_roots.current_free > 0 &&
+            extra_roots.roots[extra_roots.current_free - 1] == p);
+    (void) p;
+    extra_roots.current_free--;
+}
+
+/* Handle scopes: every root pushed after enter is dropped at once by leave */
+static inline size_t enter_extra_roots_scope (void) {
+    return extra_roots.current_free;
+}
+
+static inline void leave_extra_roots_scope (size_t scope) {
+    assert (scope <= extra_roots.current_free);
+    extra_roots.current_free = scope;
+}
+
+aint LtagHash (char *s);
+char* de_hash (aint n);
+void* LmakeArray (aint length);
+void* LmakeSexp (aint bn, aint btag);
+void* LMakeClosure (aint bn, void *entry);
 void* Bstring (void *p);
 void* Bstringval (void *p);
-int Btag (void *d, int t, int n);
-int Barray_patt (void *d, int n);
-int Bstring_patt (void *x, void *y);
-int Bclosure_tag_patt (void *x);
-int Bboxed_patt (void *x);
-int Bunboxed_patt (void *x);
-int Barray_tag_patt (void *x);
-int Bstring_tag_patt (void *x);
-int Bsexp_tag_patt (void *x);
-void* Bsta (void *v, int i, void *x);
-void Bmatch_failure (void *v, char *fname, int line, int col);
-int Lread ();
-int Lwrite (int n);
-void* Belem (void *p, int i);
-int Blength (void *p);
+void* Bflatten (void *p);
+aint Btag (void *d, aint t, aint n);
+aint Barray_patt (void *d, aint n);
+aint Bstring_patt (void *x, void *y);
+aint Bclosure_tag_patt (void *x);
+aint Bboxed_patt (void *x);
+aint Bunboxed_patt (void *x);
+aint Barray_tag_patt (void *x);
+aint Bstring_tag_patt (void *x);
+aint Bsexp_tag_patt (void *x);
+void* Bsta (void *v, aint i, void *x);
+void Bmatch_failure (void *v, char *fname, aint line, aint col);
+aint Lread ();
+aint Lwrite (aint n);
+void flush_output (void);
+void set_output_line_buffered (int flag);
+void set_input_interactive (int flag);
+void set_input_fd (int fd);
+void set_output_fd (int fd);
+
+/* A failure prints the message and exits with 255, or jumps to the
+   failure handler if the thread has set one */
+void set_failure_handler (jmp_buf *handler);
+
+/* The failure messages of the thread are followed by what where prints,
+   such as the source location of the failure */
+void set_failure_location (void (*where) (void));
+void vfailure (char *s, va_list args);
+void* Belem (void *p, aint i);
+aint Blength (void *p);
 void printValue (void *p);
+void fprintValue (FILE *f, void *p);
+
+/* The natives of Std.i */
+struct re_pattern_buffer;
+
+void Lassert (void *f, char *s, ...);
+void* LgetEnv (char *var);
+aint Lsystem (char *cmd);
+void* LstringInt (char *b);
+void* Lclone (void *p);
+aint Lhash (void *p);
+void* Lfst (void *v);
+void* Lsnd (void *v);
+void* Lhd (void *v);
+void* Ltl (void *v);
+void* LreadLine ();
+void* Lstringcat (void *p);
+aint LmatchSubString (char *subj, char *patt, aint pos);
+void* Lsubstring (void *subj, aint p, aint l);
+struct re_pattern_buffer* Lregexp (char *regexp);
+aint LregexpMatch (struct re_pattern_buffer *b, char *s, aint pos);
+void* Lsprintf (char *fmt, ...);
+void* LmakeString (aint length);
+void Lprintf (char *s, ...);
+void Lfprintf (FILE *f, char *s, ...);
+FILE* Lfopen (char *f, char *m);
+void Lfclose (FILE *f);
+void* Lfread (char *fname);
+void Lfwrite (char *fname, char *contents);
+void Lfailure (char *s, ...);
+aint Lcompare (void *p, void *q);
+void* Li__Infix_4343 (void *a, void *b);
+void* Ls__Infix_58 (void *p, void *q);
+aint Ls__Infix_3333 (void *p, void *q);
+aint Ls__Infix_3838 (void *p, void *q);
+aint Ls__Infix_6161 (void *p, void *q);
+aint Ls__Infix_3361 (void *p, void *q);
+aint Ls__Infix_6061 (void *p, void *q);
+aint Ls__Infix_60 (void *p, void *q);
+aint Ls__Infix_6261 (void *p, void *q);
+aint Ls__Infix_62 (void *p, void *q);
+aint Ls__Infix_43 (void *p, void *q);
+aint Ls__Infix_45 (void *p, void *q);
+aint Ls__Infix_42 (void *p, void *q);
+aint Ls__Infix_47 (void *p, void *q);
+aint Ls__Infix_37 (void *p, void *q);
+void LenableGC ();
+void LdisableGC ();
+aint Lrandom (aint n);
+aint Ltime ();
+aint LkindOf (void *p);
+aint LcompareTags (void *p, void *q);
+aint LflatCompare (void *p, void *q);
 
 #endif //LAMAI_RUNTIME_H
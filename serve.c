@@ -0,0 +1,80 @@
+/* Lama SM Bytecode interpreter: the pre-forking server */
+
+# include <string.h>
+# include <stdio.h>
+# include <errno.h>
+# include <signal.h>
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+
+# include "lamai.h"
+# include "serve.h"
+
+static char *socket_path;
+
+/* The snapshot hook: accepts connections and forks a child for each; only
+   the children return, to run the rest of the program */
+static void serve (void) {
+    struct sockaddr_un addr;
+    int s = socket (AF_UNIX, SOCK_STREAM, 0);
+
+    if (s == -1) {
+        failure ("socket: %s\n", strerror (errno));
+    }
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+        failure ("%s: the socket path is too long\n", socket_path);
+    }
+
+    strcpy (addr.sun_path, socket_path);
+    unlink (socket_path);
+
+    if (bind (s, (struct sockaddr*) &addr, sizeof (addr)) == -1 || listen (s, SOMAXCONN) == -1) {
+        failure ("%s: %s\n", socket_path, strerror (errno));
+    }
+
+    /* Nothing written so far may be written again by the children */
+    flush_output ();
+    fflush (stderr);
+
+    /* The children are reaped by the kernel */
+    signal (SIGCHLD, SIG_IGN);
+    fprintf (stderr, "lamai: serving on %s\n", socket_path);
+
+    for (;;) {
+        int c = accept (s, NULL, NULL);
+        pid_t pid;
+
+        if (c == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            failure ("accept: %s\n", strerror (errno));
+        }
+
+        if ((pid = fork ()) == 0) {
+            signal (SIGCHLD, SIG_DFL);
+            close (s);
+            if (dup2 (c, STDIN_FILENO) == -1 || dup2 (c, STDOUT_FILENO) == -1) _exit (255);
+            close (c);
+            set_input_fd (STDIN_FILENO);
+            return;
+        }
+
+        if (pid == -1) {
+            fprintf (stderr, "fork: %s\n", strerror (errno));
+        }
+
+        close (c);
+    }
+}
+
+int run_server (char *fname, char *path, int line) {
+    socket_path = path;
+    lamai_set_snapshot_hook (serve, line);
+    lamai_close (lamai_open (fname));
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef LAMAI_SERVE_H
+#define LAMAI_SERVE_H
+
+/* Server mode: the program runs once to the snapshot point (the LINE of
+   line, or a call of the snapshot native), and then listens on the Unix
+   socket at path. Every connection gets a forked copy of the process,
+   which shares the warm heap copy-on-write and goes on from the point
+   with the connection as its stdin and stdout. Returns only on errors */
+int run_server (char *fname, char *path, int line);
+
+#endif //LAMAI_SERVE_H
@@ -0,0 +1,206 @@
+/* Lama SM Bytecode interpreter: the timeline of the run in the Chrome
+   trace event format. The writer only uses write and formats numbers
+   itself, so that it can run in the handlers of SIGINT and SIGTERM */
+
+# include <string.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdbool.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <signal.h>
+# include <time.h>
+# include <unistd.h>
+# include <sys/mman.h>
+
+# include "timeline.h"
+
+timeline_event *timeline_buffer;
+uint64_t        timeline_count;
+
+static timeline_event *ring;
+static const char *timeline_path;
+static const char* (*timeline_name) (int offset, char *buf, size_t size);
+static uint64_t    start_tsc, start_ns;
+
+/* The output, buffered */
+static int    out_fd;
+static char   out[1 << 16];
+static size_t out_used;
+static bool   out_first;
+
+static uint64_t now_ns (void) {
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void flush (void) {
+    size_t done = 0;
+
+    while (done < out_used) {
+        ssize_t n = write (out_fd, out + done, out_used - done);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    out_used = 0;
+}
+
+static void put (const char *s) {
+    for (; *s; s++) {
+        if (out_used == sizeof (out)) flush ();
+        out[out_used++] = *s;
+    }
+}
+
+static void put_uint (uint64_t x) {
+    char buf[24], *p = buf + sizeof (buf);
+
+    *--p = 0;
+    do {
+        *--p = '0' + x % 10;
+        x /= 10;
+    } while (x != 0);
+    put (p);
+}
+
+static void put_name (const char *s) {
+    char c[2] = {0, 0};
+
+    put ("\"");
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') put ("\\");
+        c[0] = *s;
+        put (c);
+    }
+    put ("\"");
+}
+
+/* One event at ns from the start, in microseconds */
+static void put_event (const char *name, const char *ph, uint64_t ns, const char *arg, uint64_t value) {
+    char frac[4] = {'0' + ns / 100 % 10, '0' + ns / 10 % 10, '0' + ns % 10, 0};
+
+    put (out_first ? "\n" : ",\n");
+    out_first = false;
+
+    put ("{\"name\":");
+    put_name (name);
+    put (",\"ph\":\"");
+    put (ph);
+    put ("\",\"ts\":");
+    put_uint (ns / 1000);
+    put (".");
+    put (frac);
+    put (",\"pid\":1,\"tid\":1");
+    if (ph[0] == 'i') put (",\"s\":\"t\"");
+    if (arg != NULL) {
+        put (",\"args\":{\"");
+        put (arg);
+        put ("\":");
+        put_uint (value);
+        put ("}");
+    }
+    put ("}");
+}
+
+static void on_signal (int sig) {
+    timeline_write ();
+    signal (sig, SIG_DFL);
+    raise (sig);
+}
+
+void timeline_open (const char *path, const char* (*name) (int offset, char *buf, size_t size)) {
+    if (ring == NULL) {
+        ring = (timeline_event*) mmap (NULL, TIMELINE_EVENTS * sizeof (timeline_event),
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ring == MAP_FAILED) {
+            ring = NULL;
+            fprintf (stderr, "timeline: %s\n", strerror (errno));
+            return;
+        }
+
+        signal (SIGINT, on_signal);
+        signal (SIGTERM, on_signal);
+    }
+
+    timeline_path  = path;
+    timeline_name  = name;
+    timeline_count = 0;
+    start_ns  = now_ns ();
+    start_tsc = __rdtsc ();
+    timeline_buffer = ring;
+}
+
+void timeline_write (void) {
+    static const char *io[] = {"Lread", "Lwrite"};
+    timeline_event *buffer = timeline_buffer;
+    uint64_t first, end_tsc, end_ns;
+    double scale;
+    int depth = 0;
+    char buf[32];
+
+    if (buffer == NULL) return;
+    timeline_buffer = NULL;
+
+    end_ns  = now_ns ();
+    end_tsc = __rdtsc ();
+    scale   = end_tsc == start_tsc ? 0.0 : (double) (end_ns - start_ns) / (end_tsc - start_tsc);
+
+    if ((out_fd = open (timeline_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf (stderr, "%s: %s\n", timeline_path, strerror (errno));
+        return;
+    }
+
+    out_used  = 0;
+    out_first = true;
+    put ("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    /* The ends of the slices begun before the oldest event kept are
+       dropped, the slices not ended are ended now */
+    first = timeline_count > TIMELINE_EVENTS ? timeline_count - TIMELINE_EVENTS : 0;
+    for (uint64_t i = first; i < timeline_count; i++) {
+        timeline_event *e = &buffer[i & (TIMELINE_EVENTS - 1)];
+        uint64_t ns = e->tsc < start_tsc ? 0 : (uint64_t) ((e->tsc - start_tsc) * scale);
+
+        switch (e->kind) {
+        case TIMELINE_ENTER:
+            put_event (timeline_name (e->arg, buf, sizeof (buf)), "B", ns, NULL, 0);
+            depth++;
+            break;
+        case TIMELINE_GC_START:
+            put_event ("gc", "B", ns, "used", e->value);
+            depth++;
+            break;
+        case TIMELINE_IO_START:
+            put_event (io[e->arg & 1], "B", ns, NULL, 0);
+            depth++;
+            break;
+        case TIMELINE_LEAVE:
+        case TIMELINE_GC_END:
+        case TIMELINE_IO_END:
+            if (depth == 0) break;
+            put_event ("", "E", ns, e->kind == TIMELINE_GC_END ? "copied" : NULL, e->value);
+            depth--;
+            break;
+        case TIMELINE_HEAP_GROW:
+            put_event ("heap grow", "i", ns, "size", e->value);
+            break;
+        case TIMELINE_STACK_GROW:
+            put_event ("stack grow", "i", ns, "size", e->value);
+            break;
+        case TIMELINE_CI_GROW:
+            put_event ("call stack grow", "i", ns, "size", e->value);
+            break;
+        }
+    }
+
+    for (; depth > 0; depth--) put_event ("", "E", end_ns - start_ns, NULL, 0);
+
+    put ("\n]}\n");
+    flush ();
+    close (out_fd);
+}
@@ -0,0 +1,57 @@
+#ifndef LAMAI_TIMELINE_H
+#define LAMAI_TIMELINE_H
+
+# include <stdint.h>
+# include <stddef.h>
+# include <x86intrin.h>
+
+/* A timeline of the run: the events are stamped with rdtsc and kept in a
+   ring buffer of the last TIMELINE_EVENTS, which is written in the Chrome
+   trace event format (chrome://tracing, Perfetto) at exit or on SIGINT
+   and SIGTERM. Functions, collections and I/O calls are slices, the
+   growth of the heap, of the stack and of the call stack are instants */
+# define TIMELINE_EVENTS ((size_t) 1 << 20)
+
+typedef enum {
+    TIMELINE_ENTER,                /* arg: the offset of the BEGIN                 */
+    TIMELINE_LEAVE,
+    TIMELINE_GC_START,             /* value: the bytes in use                      */
+    TIMELINE_GC_END,               /* value: the bytes copied                      */
+    TIMELINE_HEAP_GROW,            /* value: the new size of a semispace in bytes  */
+    TIMELINE_STACK_GROW,           /* value: the new size of the stack in bytes    */
+    TIMELINE_CI_GROW,              /* value: the new size of the call stack        */
+    TIMELINE_IO_START,             /* arg: 0 for Lread, 1 for Lwrite               */
+    TIMELINE_IO_END
+} timeline_kind;
+
+typedef struct {
+    uint64_t tsc;
+    uint64_t value;
+    int32_t  arg;
+    uint32_t kind;
+} timeline_event;
+
+/* NULL unless the timeline is being recorded */
+extern timeline_event *timeline_buffer;
+extern uint64_t        timeline_count;
+
+static inline void timeline_record (timeline_kind kind, int32_t arg, uint64_t value) {
+    timeline_event *e = &timeline_buffer[timeline_count++ & (TIMELINE_EVENTS - 1)];
+
+    e->tsc   = __rdtsc ();
+    e->value = value;
+    e->arg   = arg;
+    e->kind  = kind;
+}
+
+# define TIMELINE(kind, arg, value) \
+    do { if (timeline_buffer != NULL) timeline_record (kind, arg, value); } while (0)
+
+/* Starts recording; name writes the name of the function at an offset to
+   buf, and may be called from a signal handler */
+void timeline_open (const char *path, const char* (*name) (int offset, char *buf, size_t size));
+
+/* Writes the timeline and stops recording, if it is being recorded */
+void timeline_write (void);
+
+#endif //LAMAI_TIMELINE_H